@@ -0,0 +1,647 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+// Open-loop HTTP load generator.
+//
+// Requests are due on a fixed schedule (rate per second, spread over the
+// worker threads) whether or not earlier ones have completed. Latency is
+// measured from the time a request was due, not from when a connection
+// happened to be free to send it, so a stalled server shows up as latency
+// instead of silently lowering the offered load (coordinated omission).
+//
+// Each request uses its own connection with "Connection: close", which all
+// server variants honour. At most --connections requests are in flight;
+// due requests beyond that wait, accumulating latency, until one finishes.
+
+#define DEFAULT_PORT 8888
+#define DEFAULT_RATE 100
+#define DEFAULT_CONNECTIONS 64
+#define DEFAULT_DURATION_S 10
+#define DEFAULT_TIMEOUT_MS 15000
+#define MAX_EVENTS 256
+#define RESPONSE_HEAD_SIZE 4096
+
+#define NSEC_PER_SEC 1000000000ULL
+
+// Log-linear latency histogram in the style of HdrHistogram: values below
+// 2^HIST_SUB_BITS are exact, above that every power of two is split into
+// 2^HIST_SUB_BITS linear buckets, so any value is within 1/128 of its
+// bucket. Values are microseconds; the top bucket ends past an hour.
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 42
+#define HIST_SIZE ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_SIZE];
+    uint64_t total;
+    uint64_t max;
+} histogram_t;
+
+static int hist_index(uint64_t value) {
+    if (value < HIST_SUB_COUNT)
+        return value;
+
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HIST_MAX_BITS)
+        return HIST_SIZE - 1;
+
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT + (int)((value >> shift) - HIST_SUB_COUNT);
+}
+
+// Highest value that lands in the bucket
+static uint64_t hist_value(int index) {
+    if (index < HIST_SUB_COUNT)
+        return index;
+
+    int shift = index / HIST_SUB_COUNT - 1;
+    uint64_t low = (uint64_t)(HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+static void hist_record(histogram_t *h, uint64_t value) {
+    h->counts[hist_index(value)]++;
+    h->total++;
+    if (value > h->max)
+        h->max = value;
+}
+
+static void hist_merge(histogram_t *into, const histogram_t *from) {
+    for (int i = 0; i < HIST_SIZE; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+static uint64_t hist_percentile(const histogram_t *h, double percentile) {
+    uint64_t target = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    uint64_t seen = 0;
+
+    if (target == 0)
+        target = 1;
+    for (int i = 0; i < HIST_SIZE; i++) {
+        seen += h->counts[i];
+        if (seen >= target)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+// Request mix
+typedef enum {
+    REQ_GET,
+    REQ_POST,
+    REQ_OPTIONS,
+    REQ_NOT_FOUND,
+    REQ_KINDS
+} req_kind_t;
+
+static const char *const kind_names[REQ_KINDS] = { "get", "post", "options", "404" };
+
+static const char *const requests[REQ_KINDS] = {
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+
+    "POST / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 5\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "hello",
+
+    "OPTIONS / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Origin: http://localhost\r\n"
+    "Access-Control-Request-Method: POST\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+
+    "DELETE /missing HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+};
+
+static const int expected_status[REQ_KINDS] = { 200, 200, 204, 404 };
+
+typedef struct {
+    struct sockaddr_in addr;
+    double rate;
+    int connections;
+    int duration_s;
+    int timeout_ms;
+    int threads;
+    unsigned weights[REQ_KINDS];
+    unsigned weight_total;
+} config_t;
+
+static config_t config;
+
+// One request in flight
+typedef struct {
+    int fd;                         // -1 while the slot is free
+    req_kind_t kind;
+    uint64_t due_ns;                // When the schedule said to send it
+    size_t sent;
+    char head[RESPONSE_HEAD_SIZE];  // Start of the response, up to the body
+    size_t head_len;
+    int status;                     // 0 until the status line is in
+    long content_length;            // -1: delimited by close
+    size_t body_len;
+    size_t header_end;
+} request_t;
+
+typedef struct {
+    int id;
+    double rate;
+    int connections;
+    uint64_t seed;
+    pthread_t thread;
+
+    // Results
+    histogram_t latency;
+    uint64_t completed;
+    uint64_t ok;
+    uint64_t unexpected;            // Completed with a status other than expected
+    uint64_t server_errors;         // 5xx, e.g. shed load
+    uint64_t socket_errors;
+    uint64_t timeouts;
+    uint64_t per_kind[REQ_KINDS];
+} worker_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static req_kind_t pick_kind(worker_t *w) {
+    unsigned r = next_random(&w->seed) % config.weight_total;
+
+    for (int k = 0; k < REQ_KINDS; k++) {
+        if (r < config.weights[k])
+            return k;
+        r -= config.weights[k];
+    }
+    return REQ_GET;
+}
+
+static void request_finish(worker_t *w, int epoll_fd, request_t *req, uint64_t now) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, req->fd, NULL);
+    close(req->fd);
+    req->fd = -1;
+
+    w->completed++;
+    w->per_kind[req->kind]++;
+    hist_record(&w->latency, (now - req->due_ns) / 1000);
+
+    if (req->status == expected_status[req->kind])
+        w->ok++;
+    else if (req->status >= 500)
+        w->server_errors++;
+    else
+        w->unexpected++;
+}
+
+static void request_fail(worker_t *w, int epoll_fd, request_t *req, int timed_out) {
+    if (req->fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, req->fd, NULL);
+        close(req->fd);
+    }
+    req->fd = -1;
+
+    if (timed_out)
+        w->timeouts++;
+    else
+        w->socket_errors++;
+}
+
+// Open a non-blocking connection for a due request; the request is sent
+// once the connect completes
+static int request_start(worker_t *w, int epoll_fd, request_t *req, uint64_t due_ns) {
+    struct epoll_event ev;
+    int one = 1;
+
+    memset(req, 0, sizeof(*req));
+    req->kind = pick_kind(w);
+    req->due_ns = due_ns;
+    req->content_length = -1;
+
+    req->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (req->fd < 0) {
+        request_fail(w, epoll_fd, req, 0);
+        return -1;
+    }
+    setsockopt(req->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(req->fd, (struct sockaddr *)&config.addr, sizeof(config.addr)) < 0 &&
+        errno != EINPROGRESS) {
+        request_fail(w, epoll_fd, req, 0);
+        return -1;
+    }
+
+    ev.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = req;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, req->fd, &ev) < 0) {
+        request_fail(w, epoll_fd, req, 0);
+        return -1;
+    }
+    return 0;
+}
+
+// Pick the status line and framing out of the response head
+static void parse_head(request_t *req) {
+    char *end = memmem(req->head, req->head_len, "\r\n\r\n", 4);
+
+    if (req->status == 0 && req->head_len >= 12 && memcmp(req->head, "HTTP/1.", 7) == 0)
+        req->status = atoi(req->head + 9);
+    if (end == NULL || req->header_end != 0)
+        return;
+
+    req->header_end = end - req->head + 4;
+    req->body_len = req->head_len - req->header_end;
+
+    for (char *line = memchr(req->head, '\n', req->header_end); line != NULL && line < end;
+         line = memchr(line + 1, '\n', end - line)) {
+        if (strncasecmp(line + 1, "Content-Length:", 15) == 0)
+            req->content_length = atol(line + 16);
+    }
+    if (req->status == 204 || req->status == 304)
+        req->content_length = 0;
+}
+
+// Drive one request on a readiness event; returns 1 once it is done and
+// -1 if it failed
+static int request_progress(int epoll_fd, request_t *req, uint32_t events) {
+    size_t len = strlen(requests[req->kind]);
+
+    if (events & EPOLLERR)
+        return -1;
+
+    if (req->sent < len && (events & EPOLLOUT)) {
+        ssize_t n = send(req->fd, requests[req->kind] + req->sent, len - req->sent, MSG_NOSIGNAL);
+
+        if (n < 0 && errno != EAGAIN)
+            return -1;
+        if (n > 0)
+            req->sent += n;
+
+        // Sent: only the response matters from here on
+        if (req->sent == len) {
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = req };
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, req->fd, &ev);
+        }
+    }
+
+    while (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        char discard[16384];
+        char *buf = discard;
+        size_t space = sizeof(discard);
+        ssize_t n;
+
+        // Keep the head until the header block is in; then only count bytes
+        if (req->header_end == 0 && req->head_len < sizeof(req->head)) {
+            buf = req->head + req->head_len;
+            space = sizeof(req->head) - req->head_len;
+        }
+
+        n = recv(req->fd, buf, space, 0);
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+        if (n == 0)
+            return req->status != 0 ? 1 : -1;
+
+        if (buf == discard) {
+            req->body_len += n;
+        } else {
+            req->head_len += n;
+            parse_head(req);
+            if (req->header_end == 0 && req->head_len == sizeof(req->head))
+                return -1;
+        }
+
+        if (req->header_end != 0 && req->content_length >= 0 &&
+            req->body_len >= (size_t)req->content_length)
+            return 1;
+    }
+    return 0;
+}
+
+static void *worker_run(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    request_t *slots = calloc(w->connections, sizeof(request_t));
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    uint64_t interval_ns = (uint64_t)(NSEC_PER_SEC / w->rate);
+    uint64_t start = now_ns() + interval_ns * w->id / config.threads;
+    uint64_t end = start + config.duration_s * NSEC_PER_SEC;
+    uint64_t timeout_ns = (uint64_t)config.timeout_ms * 1000000ULL;
+    uint64_t issued = 0;            // Requests taken off the schedule so far
+    uint64_t scheduled = (end - start) / interval_ns;
+    int in_flight = 0;
+    int cursor = 0;
+
+    if (slots == NULL || epoll_fd < 0) {
+        perror("Failed to set up worker");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < w->connections; i++)
+        slots[i].fd = -1;
+
+    while (issued < scheduled || in_flight > 0) {
+        uint64_t now = now_ns();
+
+        // Start every request that is due while connections are free; a
+        // due request that could not even start within the timeout is lost
+        while (issued < scheduled) {
+            uint64_t due = start + issued * interval_ns;
+
+            if (due > now)
+                break;
+            if (now - due > timeout_ns) {
+                w->timeouts++;
+                issued++;
+                continue;
+            }
+            if (in_flight == w->connections)
+                break;
+
+            while (slots[cursor].fd >= 0)
+                cursor = (cursor + 1) % w->connections;
+            issued++;
+            if (request_start(w, epoll_fd, &slots[cursor], due) == 0)
+                in_flight++;
+        }
+
+        // Sleep until the next request is due, or a little while if every
+        // connection is busy and it is overdue already
+        int wait_ms = 10;
+        if (issued < scheduled) {
+            uint64_t due = start + issued * interval_ns;
+            if (due > now)
+                wait_ms = (due - now) / 1000000;
+            if (wait_ms > 10)
+                wait_ms = 10;
+        }
+
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, wait_ms);
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            request_t *req = events[i].data.ptr;
+            int done = request_progress(epoll_fd, req, events[i].events);
+
+            if (done > 0) {
+                request_finish(w, epoll_fd, req, now);
+                in_flight--;
+            } else if (done < 0) {
+                request_fail(w, epoll_fd, req, 0);
+                in_flight--;
+            }
+        }
+
+        for (int i = 0; i < w->connections; i++) {
+            if (slots[i].fd >= 0 && now - slots[i].due_ns > timeout_ns) {
+                request_fail(w, epoll_fd, &slots[i], 1);
+                in_flight--;
+            }
+        }
+    }
+
+    close(epoll_fd);
+    free(slots);
+    return NULL;
+}
+
+// Parse "get=70,post=10,options=10,404=10"; kinds left out get no weight
+static int parse_mix(const char *spec) {
+    char *copy = strdup(spec);
+    char *save = NULL;
+
+    memset(config.weights, 0, sizeof(config.weights));
+    config.weight_total = 0;
+
+    for (char *item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        int k;
+
+        if (eq == NULL)
+            break;
+        *eq = '\0';
+        for (k = 0; k < REQ_KINDS; k++) {
+            if (strcmp(item, kind_names[k]) == 0)
+                break;
+        }
+        if (k == REQ_KINDS) {
+            free(copy);
+            return -1;
+        }
+        config.weights[k] = atoi(eq + 1);
+        config.weight_total += config.weights[k];
+    }
+
+    free(copy);
+    return config.weight_total > 0 ? 0 : -1;
+}
+
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] [host]\n"
+            "  --port=N         server port (default %d)\n"
+            "  --rate=N         requests per second, open loop (default %d)\n"
+            "  --connections=N  most requests in flight (default %d)\n"
+            "  --duration=S     seconds of load (default %d)\n"
+            "  --timeout=MS     give up on a request this long after it was due\n"
+            "                   (default %d)\n"
+            "  --threads=N      worker threads sharing the rate (default 1)\n"
+            "  --mix=SPEC       weights, e.g. get=70,post=10,options=10,404=10\n"
+            "                   (default equal shares)\n"
+            "  --tsv            print one tab-separated result line\n",
+            prog, DEFAULT_PORT, DEFAULT_RATE, DEFAULT_CONNECTIONS, DEFAULT_DURATION_S,
+            DEFAULT_TIMEOUT_MS);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = "127.0.0.1";
+    int port = DEFAULT_PORT;
+    int tsv = 0;
+    worker_t *workers;
+    worker_t total;
+
+    config.rate = DEFAULT_RATE;
+    config.connections = DEFAULT_CONNECTIONS;
+    config.duration_s = DEFAULT_DURATION_S;
+    config.timeout_ms = DEFAULT_TIMEOUT_MS;
+    config.threads = 1;
+    parse_mix("get=1,post=1,options=1,404=1");
+
+    static const struct option options[] = {
+        { "port",        required_argument, NULL, 'p' },
+        { "rate",        required_argument, NULL, 'r' },
+        { "connections", required_argument, NULL, 'c' },
+        { "duration",    required_argument, NULL, 'd' },
+        { "timeout",     required_argument, NULL, 't' },
+        { "threads",     required_argument, NULL, 'T' },
+        { "mix",         required_argument, NULL, 'm' },
+        { "tsv",         no_argument,       NULL, 's' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "p:r:c:d:t:T:m:sh", options, NULL)) != -1) {
+        switch (c) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'c':
+            config.connections = atoi(optarg);
+            break;
+        case 'd':
+            config.duration_s = atoi(optarg);
+            break;
+        case 't':
+            config.timeout_ms = atoi(optarg);
+            break;
+        case 'T':
+            config.threads = atoi(optarg);
+            break;
+        case 'm':
+            if (parse_mix(optarg) < 0) {
+                fprintf(stderr, "Invalid mix: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            tsv = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (optind < argc)
+        host = argv[optind];
+
+    if (config.rate <= 0 || config.connections < 1 || config.duration_s < 1 || config.threads < 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (config.connections < config.threads)
+        config.threads = config.connections;
+
+    config.addr.sin_family = AF_INET;
+    config.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &config.addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid IPv4 address: %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+
+    raise_fd_limit();
+
+    workers = calloc(config.threads, sizeof(worker_t));
+    if (workers == NULL) {
+        perror("Failed to allocate workers");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t started = now_ns();
+    for (int i = 0; i < config.threads; i++) {
+        workers[i].id = i;
+        workers[i].rate = config.rate / config.threads;
+        workers[i].connections = config.connections / config.threads +
+                                 (i < config.connections % config.threads);
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            perror("Failed to create thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        hist_merge(&total.latency, &workers[i].latency);
+        total.completed += workers[i].completed;
+        total.ok += workers[i].ok;
+        total.unexpected += workers[i].unexpected;
+        total.server_errors += workers[i].server_errors;
+        total.socket_errors += workers[i].socket_errors;
+        total.timeouts += workers[i].timeouts;
+        for (int k = 0; k < REQ_KINDS; k++)
+            total.per_kind[k] += workers[i].per_kind[k];
+    }
+    double elapsed = (now_ns() - started) / 1e9;
+    double throughput = total.ok / elapsed;
+    uint64_t errors = total.unexpected + total.server_errors + total.socket_errors + total.timeouts;
+
+    if (tsv) {
+        // ok/s, p50, p99, p99.9, max (ms), errors, 5xx, timeouts
+        printf("%.1f\t%.2f\t%.2f\t%.2f\t%.2f\t%lu\t%lu\t%lu\n", throughput,
+               hist_percentile(&total.latency, 50) / 1000.0,
+               hist_percentile(&total.latency, 99) / 1000.0,
+               hist_percentile(&total.latency, 99.9) / 1000.0,
+               total.latency.max / 1000.0,
+               (unsigned long)errors, (unsigned long)total.server_errors,
+               (unsigned long)total.timeouts);
+        return 0;
+    }
+
+    printf("%.0f req/s offered for %d s over %d connections, %d thread(s)\n",
+           config.rate, config.duration_s, config.connections, config.threads);
+    printf("  completed %lu (get %lu, post %lu, options %lu, 404 %lu) in %.2f s\n",
+           (unsigned long)total.completed, (unsigned long)total.per_kind[REQ_GET],
+           (unsigned long)total.per_kind[REQ_POST], (unsigned long)total.per_kind[REQ_OPTIONS],
+           (unsigned long)total.per_kind[REQ_NOT_FOUND], elapsed);
+    printf("  throughput %.1f ok/s\n", throughput);
+    printf("  latency ms: p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+           hist_percentile(&total.latency, 50) / 1000.0,
+           hist_percentile(&total.latency, 90) / 1000.0,
+           hist_percentile(&total.latency, 99) / 1000.0,
+           hist_percentile(&total.latency, 99.9) / 1000.0,
+           total.latency.max / 1000.0);
+    printf("  errors: unexpected status %lu, 5xx %lu, socket %lu, timeout %lu\n",
+           (unsigned long)total.unexpected, (unsigned long)total.server_errors,
+           (unsigned long)total.socket_errors, (unsigned long)total.timeouts);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#!/usr/bin/env bash
+# Build the load generator and the server, then put each engine under the
+# same open-loop load in turn and print the results side by side.
+#
+#   bench/run.sh [loadgen options]      e.g. bench/run.sh --rate=200 --duration=20
+#
+# ENGINES picks the engines (default: iterative select thread-per-conn pool
+# epoll); BUILD_DIR keeps the binaries somewhere other than a temporary
+# directory. Every engine listens on port 8888, so nothing else may hold it.
+
+set -eu
+
+cd "$(dirname "$0")/.."
+
+ENGINES=${ENGINES:-"iterative select thread-per-conn pool epoll"}
+BUILD_DIR=${BUILD_DIR:-$(mktemp -d)}
+PORT=8888
+CFLAGS=${CFLAGS:-"-O2 -pthread"}
+
+mkdir -p "$BUILD_DIR"
+gcc $CFLAGS bench/loadgen.c -o "$BUILD_DIR/loadgen"
+gcc $CFLAGS server/server.c -o "$BUILD_DIR/server"
+
+# Wait until the server accepts connections, or give up if it died
+wait_for_port() {
+    local pid=$1
+
+    for _ in $(seq 50); do
+        kill -0 "$pid" 2>/dev/null || return 1
+        (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+printf '%-16s %10s %10s %10s %10s %10s %8s %8s %8s\n' \
+    engine 'ok/s' 'p50 ms' 'p99 ms' 'p99.9 ms' 'max ms' errors 5xx timeouts
+
+for engine in $ENGINES; do
+    "$BUILD_DIR/server" --engine="$engine" --port="$PORT" >/dev/null 2>&1 &
+    pid=$!
+
+    if ! wait_for_port "$pid"; then
+        printf '%-16s failed to start (port %d busy?)\n' "$engine" "$PORT"
+        kill "$pid" 2>/dev/null || true
+        wait "$pid" 2>/dev/null || true
+        continue
+    fi
+
+    result=$("$BUILD_DIR/loadgen" --port="$PORT" --tsv "$@")
+
+    kill "$pid"
+    wait "$pid" 2>/dev/null || true
+
+    printf '%-16s' "$engine"
+    printf ' %10s %10s %10s %10s %10s %8s %8s %8s' $result
+    printf '\n'
+done
@@ -0,0 +1,371 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+// Connection admission: how the listener is set up, how connections are
+// taken off it, and which of them are let in.
+//
+// The listen backlog is configurable (default SOMAXCONN, which the kernel
+// clamps to net.core.somaxconn) and TCP_DEFER_ACCEPT can hold a connection
+// back until its first bytes arrive. admission_accept() takes connections
+// with accept4() in a loop until the backlog is drained, so one wakeup
+// clears a burst of connects.
+//
+// Two caps keep a connect storm from starving established clients: one on
+// the connections open at once, and one per source address. A connection
+// over either cap gets a canned 503 sent without blocking and is closed
+// straight away; it never reaches a handler, a buffer or a queue. Both
+// caps are off by default.
+//
+// Running out of descriptors is not left to accept(): main() caps the
+// connections below the open file limit (raise_fd_limit() in engine.h),
+// and should accept() still fail with EMFILE or ENFILE, the process holds
+// a spare descriptor to give up for a moment, take the waiting connection
+// with and turn it away with the same 503. The backlog
+// is drained either way, so a client is never left queued behind a
+// listener that an edge-triggered engine has stopped watching.
+//
+// Every admitted connection must be closed with admission_close(), or
+// released with admission_release() when something else closes it, so its
+// counts go down again.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "response.h"
+
+#define ADMISSION_SLOTS 65536       // Per-address table, a power of two
+#define ADMISSION_STRIPES 256       // Locks, each over a run of slots
+#define ADMISSION_STRIPE_SLOTS (ADMISSION_SLOTS / ADMISSION_STRIPES)
+#define ADMISSION_MAX_FDS (1 << 24) // Higher descriptors go untracked per address
+
+// Options every admitting server takes, for its getopt_long() tables
+#define ADMISSION_OPTSTRING "B:D:C:I:"
+#define ADMISSION_OPTIONS                                       \
+    { "backlog",      required_argument, NULL, 'B' },           \
+    { "defer-accept", required_argument, NULL, 'D' },           \
+    { "max-conns",    required_argument, NULL, 'C' },           \
+    { "max-per-ip",   required_argument, NULL, 'I' }
+#define ADMISSION_USAGE                                                         \
+    "  --backlog=N       listen backlog (default SOMAXCONN)\n"                  \
+    "  --defer-accept=S  accept a connection only once it has sent data,\n"     \
+    "                    waiting up to S seconds (default 0, off)\n"            \
+    "  --max-conns=N     answer 503 to connections past N open (0 = no cap)\n"  \
+    "  --max-per-ip=N    answer 503 to connections past N open from one\n"      \
+    "                    source address (0 = no cap)\n"
+
+typedef struct {
+    uint32_t addr;                  // Source address, network order; 0 = free
+    uint32_t count;                 // Connections open from it
+} admission_slot_t;
+
+static struct {
+    int backlog;
+    int defer_accept;               // Seconds; 0 leaves TCP_DEFER_ACCEPT off
+    unsigned max_conns;             // 0 = no cap
+    unsigned max_per_ip;            // 0 = no cap
+    unsigned open;                  // Admitted and not yet released
+    uint32_t *peers;                // Source address by descriptor, 0 = untracked
+    int max_fds;
+    int spare;                      // Given up by admission_shed(); -1 while in use
+    pthread_mutex_t locks[ADMISSION_STRIPES];
+    admission_slot_t slots[ADMISSION_SLOTS];
+} admission = { .backlog = SOMAXCONN, .spare = -1 };
+
+// Handle one of ADMISSION_OPTIONS. Returns 1 if c was one of them, 0 if
+// it is the caller's.
+static inline int admission_option(int c, const char *arg) {
+    switch (c) {
+    case 'B':
+        admission.backlog = atoi(arg);
+        return 1;
+    case 'D':
+        admission.defer_accept = atoi(arg);
+        return 1;
+    case 'C':
+        admission.max_conns = (unsigned)atoi(arg);
+        return 1;
+    case 'I':
+        admission.max_per_ip = (unsigned)atoi(arg);
+        return 1;
+    }
+    return 0;
+}
+
+// Lower the global cap to what the server can hold, if it is higher
+static inline void admission_limit(unsigned max_conns) {
+    if (admission.max_conns == 0 || admission.max_conns > max_conns)
+        admission.max_conns = max_conns;
+}
+
+// Put a descriptor aside for admission_shed(), unless one already is
+static inline void admission_spare_open(void) {
+    int fd, none = -1;
+
+    if (__atomic_load_n(&admission.spare, __ATOMIC_ACQUIRE) >= 0)
+        return;
+    fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && !__atomic_compare_exchange_n(&admission.spare, &none, fd, 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        close(fd);
+}
+
+// Set up the spare descriptor and the per-address table. Called once from
+// main(), after the open file limit is raised, since that sizes the
+// descriptor map, and before the engine takes descriptors of its own.
+static inline int admission_init(void) {
+    struct rlimit rl;
+
+    admission_spare_open();
+    for (int i = 0; i < ADMISSION_STRIPES; i++)
+        pthread_mutex_init(&admission.locks[i], NULL);
+
+    if (admission.max_per_ip == 0)
+        return 0;
+
+    admission.max_fds = ADMISSION_MAX_FDS;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)admission.max_fds)
+        admission.max_fds = (int)rl.rlim_cur;
+    admission.peers = calloc(admission.max_fds, sizeof(uint32_t));
+    return admission.peers == NULL ? -1 : 0;
+}
+
+// Apply TCP_DEFER_ACCEPT and start listening with the configured backlog
+static inline int admission_listen(int server_socket) {
+    int secs = admission.defer_accept;
+
+    if (secs > 0 && setsockopt(server_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                               &secs, sizeof(secs)) < 0)
+        return -1;
+    return listen(server_socket, admission.backlog);
+}
+
+// An address's home slot. Fibonacci hashing spreads neighbouring
+// addresses; the top bits pick the stripe.
+static inline unsigned admission_home(uint32_t addr) {
+    return (addr * 2654435761u) >> (32 - 16);
+}
+
+// Find addr in its stripe, or the free slot it would go in. Returns NULL
+// if it is absent and the stripe is full. Called with the stripe locked.
+static inline admission_slot_t *admission_find(uint32_t addr) {
+    unsigned home = admission_home(addr);
+    admission_slot_t *run = &admission.slots[home & ~(ADMISSION_STRIPE_SLOTS - 1)];
+
+    for (unsigned i = 0; i < ADMISSION_STRIPE_SLOTS; i++) {
+        admission_slot_t *slot = &run[(home + i) & (ADMISSION_STRIPE_SLOTS - 1)];
+        if (slot->addr == addr || slot->addr == 0)
+            return slot;
+    }
+    return NULL;
+}
+
+// Free a slot and shift later entries of its probe run back into the gap,
+// so every lookup still finds its address before a free slot
+static inline void admission_remove(admission_slot_t *slot) {
+    admission_slot_t *run = slot - ((slot - admission.slots) & (ADMISSION_STRIPE_SLOTS - 1));
+    unsigned gap = slot - run;
+    unsigned next = gap;
+
+    while (1) {
+        next = (next + 1) & (ADMISSION_STRIPE_SLOTS - 1);
+        if (run[next].addr == 0)
+            break;
+
+        // Leave the entry if its home lies cyclically in (gap, next]
+        unsigned home = admission_home(run[next].addr) & (ADMISSION_STRIPE_SLOTS - 1);
+        if (gap <= next ? (gap < home && home <= next) : (gap < home || home <= next))
+            continue;
+
+        run[gap] = run[next];
+        gap = next;
+    }
+    run[gap].addr = 0;
+    run[gap].count = 0;
+}
+
+// Count a connection against its source address. Returns -1 if that is
+// over the cap. An address that finds its stripe full is let in untracked
+// rather than refused.
+static inline int admission_track(int fd, uint32_t addr) {
+    pthread_mutex_t *lock = &admission.locks[admission_home(addr) / ADMISSION_STRIPE_SLOTS];
+    admission_slot_t *slot;
+
+    if (addr == 0 || fd >= admission.max_fds)
+        return 0;
+
+    pthread_mutex_lock(lock);
+    slot = admission_find(addr);
+    if (slot != NULL && slot->count >= admission.max_per_ip) {
+        pthread_mutex_unlock(lock);
+        return -1;
+    }
+    if (slot != NULL) {
+        slot->addr = addr;
+        slot->count++;
+        admission.peers[fd] = addr;
+    }
+    pthread_mutex_unlock(lock);
+    return 0;
+}
+
+// Take a connection's count off its source address
+static inline void admission_untrack(int fd) {
+    uint32_t addr;
+    pthread_mutex_t *lock;
+    admission_slot_t *slot;
+
+    if (admission.peers == NULL || fd >= admission.max_fds || admission.peers[fd] == 0)
+        return;
+
+    addr = admission.peers[fd];
+    admission.peers[fd] = 0;
+    lock = &admission.locks[admission_home(addr) / ADMISSION_STRIPE_SLOTS];
+
+    pthread_mutex_lock(lock);
+    slot = admission_find(addr);
+    if (slot != NULL && slot->addr == addr && --slot->count == 0)
+        admission_remove(slot);
+    pthread_mutex_unlock(lock);
+}
+
+// Turn a connection away: a 503 if the socket buffer takes it, without
+// waiting, then close. Whatever request already arrived is read first so
+// the close does not reset the connection under the response.
+static inline void admission_reject(int fd) {
+    response_t response;
+    char discard[1024];
+    uint64_t start_us = metrics_now_us();
+
+    RESPONSE_START_LITERAL(&response, "HTTP/1.1 503 Service Unavailable\r\n"
+                                      CORS_HEADERS
+                                      "Retry-After: 1\r\n"
+                                      "Content-Length: 0\r\n");
+    response_add_date(&response);
+    response_end_headers(&response, 0);
+
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+        ;
+    sendmsg(fd, response_msghdr(&response), MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    metrics_request(ROUTE_REJECTED, 503, start_us);
+    close(fd);
+}
+
+// Decide on a freshly accepted connection from peer (looked up if NULL
+// and needed). Returns 0 if it is admitted, -1 if it was rejected and is
+// already closed.
+static inline int admission_admit(int fd, const struct sockaddr_in *peer) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    if (__atomic_add_fetch(&admission.open, 1, __ATOMIC_RELAXED) > admission.max_conns &&
+        admission.max_conns > 0)
+        goto reject;
+
+    if (admission.peers != NULL) {
+        if (peer == NULL) {
+            if (getpeername(fd, (struct sockaddr *)&addr, &len) < 0 || addr.sin_family != AF_INET)
+                return 0;
+            peer = &addr;
+        }
+        if (admission_track(fd, peer->sin_addr.s_addr) < 0)
+            goto reject;
+    }
+    return 0;
+
+reject:
+    __atomic_sub_fetch(&admission.open, 1, __ATOMIC_RELAXED);
+    admission_reject(fd);
+    return -1;
+}
+
+// Out of descriptors with a connection waiting on server_socket: close the
+// spare, take the connection with it and turn it away, then reopen the
+// spare. Returns 0 if a connection was turned away, -1 with errno set if
+// there was none or no spare to take it with.
+static inline int admission_shed(int server_socket) {
+    struct pollfd pfd = { .fd = server_socket, .events = POLLIN };
+    int spare, fd, saved;
+
+    // The listener may be blocking (uring); only take what is there
+    if (poll(&pfd, 1, 0) <= 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Another thread may have the spare; the caller tries again later
+    spare = __atomic_exchange_n(&admission.spare, -1, __ATOMIC_ACQ_REL);
+    if (spare < 0) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    close(spare);
+    fd = accept4(server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    saved = errno;
+    if (fd >= 0)
+        admission_reject(fd);
+    admission_spare_open();
+    errno = saved;
+    return fd >= 0 ? 0 : -1;
+}
+
+// Take the next admitted connection off a non-blocking listener, turning
+// away any over the caps on the way, and any that come when the process
+// is out of descriptors. Returns -1 with errno EAGAIN once the backlog is
+// drained, or with another errno if accept4() failed.
+static inline int admission_accept(int server_socket, int flags) {
+    struct sockaddr_in addr;
+    socklen_t len;
+
+    // Take the spare back if a shed lost it to another thread's descriptor
+    admission_spare_open();
+
+    while (1) {
+        len = sizeof(addr);
+        int fd = accept4(server_socket, (struct sockaddr *)&addr, &len, flags);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EMFILE || errno == ENFILE) && admission_shed(server_socket) == 0)
+                continue;
+            return -1;
+        }
+        if (admission_admit(fd, &addr) == 0)
+            return fd;
+    }
+}
+
+// Release an admitted connection whose descriptor is closed elsewhere.
+// Call it before the close, so the descriptor cannot be reused by another
+// connection in between.
+static inline void admission_release(int fd) {
+    admission_untrack(fd);
+    __atomic_sub_fetch(&admission.open, 1, __ATOMIC_RELAXED);
+}
+
+// Connections admitted and not yet released
+static inline unsigned admission_open(void) {
+    return __atomic_load_n(&admission.open, __ATOMIC_RELAXED);
+}
+
+// Release and close an admitted connection
+static inline void admission_close(int fd) {
+    admission_release(fd);
+    close(fd);
+}
+
+#endif
@@ -0,0 +1,506 @@
+#ifndef CORO_H
+#define CORO_H
+
+// M:N stackful coroutines: many straight-line handlers over a few
+// scheduler threads.
+//
+// Each scheduler thread owns an epoll instance, a timer wheel and a run
+// queue. coro_spawn() hands a new coroutine to the schedulers round-robin
+// through a lock-free inbox; from then on it stays on that thread, so
+// thread-local state (metrics shards, log rings, slab lists) behaves as it
+// would in a thread of its own. A coroutine that would block parks itself:
+// coro_wait() on a one-shot epoll registration, coro_sleep() on the wheel,
+// coro_offload() on the scheduler's offload port while an executor thread
+// runs blocking work for it.
+// The io_deadline set by a handler travels with its coroutine, and a
+// coro_wait() past it times out on the wheel.
+// Plugged into io_wait, that makes the blocking helpers in http_parser.h,
+// http_body.h and response.h yield instead of blocking the thread.
+//
+// Stacks are CORO_STACK_SIZE of address space with a guard page below, so
+// an overflow faults instead of corrupting a neighbour; only the pages a
+// handler touches are ever backed by memory. Each stack is two mappings,
+// so vm.max_map_count must allow twice the coroutines wanted. Finished
+// stacks are kept per scheduler for the next coroutine.
+//
+// The context switch is a few instructions of assembly on x86-64 and
+// swapcontext() elsewhere.
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#include "io_wait.h"
+#include "offload.h"
+#include "slab.h"
+#include "timer_wheel.h"
+
+#define CORO_STACK_SIZE (64 * 1024)     // Address space per coroutine, guard included
+#define CORO_STACK_CACHE 1024           // Finished stacks kept per scheduler
+#define CORO_MAX_EVENTS 256
+#define CORO_RETRY_MS 10                // Before retrying spawns that found no stack
+
+struct coro_sched;
+
+typedef struct coro {
+#if defined(__x86_64__)
+    void *sp;                           // Saved stack pointer while switched out
+#else
+    ucontext_t ctx;
+#endif
+    void (*fn)(void *arg);
+    void *arg;
+    char *stack;                        // Lowest address, the guard page
+    struct coro *next;                  // Inbox or run queue link
+    struct coro_sched *sched;
+    wheel_timer_t timer;
+    int wait_fd;                        // Socket registered with the epoll, or -1
+    int io_waiting;                     // Parked in coro_wait(), not yet woken
+    int timed_out;                      // Woken by io_deadline, not the socket
+    uint64_t deadline;                  // Its io_deadline while switched out
+    int done;
+} coro_t;
+
+typedef struct coro_sched {
+    int epoll_fd;
+    int event_fd;                       // Wakes the loop when the inbox fills
+    timer_wheel_t wheel;
+    coro_t *inbox;                      // Pushed by any thread, LIFO
+    coro_t *run_head, *run_tail;
+    coro_t *deferred_head, *deferred_tail;  // Spawned, waiting for a stack
+    wheel_timer_t retry;
+    offload_port_t port;                // Blocking work done for its coroutines
+    coro_t *current;
+#if defined(__x86_64__)
+    void *sp;                           // The loop's own stack while a coroutine runs
+#else
+    ucontext_t ctx;
+#endif
+    char *stacks[CORO_STACK_CACHE];
+    int num_stacks;
+    uint64_t live;                      // Coroutines spawned here and not finished
+    pthread_t thread;
+} coro_sched_t;
+
+static struct {
+    coro_sched_t *scheds;
+    int num_scheds;
+    unsigned next;                      // Round-robin cursor for coro_spawn()
+} coro_runtime;
+
+static __thread coro_sched_t *coro_local;
+
+#if defined(__x86_64__)
+// coro_switch(from, to): save the callee-saved registers on the current
+// stack, store its pointer in *from and resume the stack at to
+void coro_switch(void **from, void *to) __asm__("coro_switch");
+__asm__(
+    ".text\n"
+    ".hidden coro_switch\n"
+    ".globl coro_switch\n"
+    ".type coro_switch, @function\n"
+    "coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_switch, .-coro_switch\n");
+#endif
+
+// The coroutine running on this thread, or NULL outside of one
+static inline coro_t *coro_self(void) {
+    return coro_local != NULL ? coro_local->current : NULL;
+}
+
+static inline void coro_ready(coro_t *co) {
+    coro_sched_t *sched = co->sched;
+
+    co->next = NULL;
+    if (sched->run_tail != NULL)
+        sched->run_tail->next = co;
+    else
+        sched->run_head = co;
+    sched->run_tail = co;
+}
+
+// Back to the scheduler loop; returns when something makes co ready again
+static inline void coro_yield_to_loop(coro_t *co) {
+#if defined(__x86_64__)
+    coro_switch(&co->sp, co->sched->sp);
+#else
+    swapcontext(&co->ctx, &co->sched->ctx);
+#endif
+}
+
+// Give other ready coroutines a turn
+static inline void coro_yield(void) {
+    coro_t *co = coro_self();
+
+    coro_ready(co);
+    coro_yield_to_loop(co);
+}
+
+// The socket a parked coroutine waits on is ready. A late event, for a
+// wait that has already timed out, is dropped.
+static inline void coro_io_ready(coro_t *co) {
+    if (!co->io_waiting)
+        return;
+    co->io_waiting = 0;
+    timer_cancel(&co->timer);
+    coro_ready(co);
+}
+
+static inline void coro_io_timeout(void *data) {
+    coro_t *co = (coro_t *)data;
+
+    if (!co->io_waiting)
+        return;
+    co->io_waiting = 0;
+    co->timed_out = 1;
+    coro_ready(co);
+}
+
+// Park until fd is ready for events (POLLIN and/or POLLOUT), or has hung
+// up; returns 0, or -1 outside a coroutine or if fd cannot be watched.
+// Past the coroutine's io_deadline it gives up with ETIMEDOUT. This is the
+// io_wait hook once the runtime is started.
+static inline int coro_wait(int fd, unsigned events) {
+    coro_t *co = coro_self();
+    struct epoll_event ev;
+    int left = io_deadline_left();
+
+    if (co == NULL)
+        return -1;
+    if (left == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    // One-shot, so a coroutine is made ready once per wait; the
+    // registration stays and is re-armed by the next wait. A reader also
+    // wakes when the peer shuts its side, to see the end of input.
+    ev.events = (events & (POLLIN | POLLOUT)) | EPOLLONESHOT;
+    if (events & POLLIN)
+        ev.events |= EPOLLRDHUP;
+    ev.data.ptr = co;
+    if (co->wait_fd != fd || epoll_ctl(co->sched->epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        // First wait on fd, or it was closed and its number reused
+        if (epoll_ctl(co->sched->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return -1;
+        co->wait_fd = fd;
+    }
+
+    if (left > 0)
+        timer_wheel_add(&co->sched->wheel, &co->timer, left, coro_io_timeout, co);
+    co->io_waiting = 1;
+    coro_yield_to_loop(co);
+
+    if (co->timed_out) {
+        co->timed_out = 0;
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void coro_wake(void *data) {
+    coro_ready((coro_t *)data);
+}
+
+// Park for ms milliseconds on the scheduler's wheel
+static inline void coro_sleep(unsigned ms) {
+    coro_t *co = coro_self();
+
+    if (co == NULL) {
+        usleep(ms * 1000);
+        return;
+    }
+    timer_wheel_add(&co->sched->wheel, &co->timer, ms, coro_wake, co);
+    coro_yield_to_loop(co);
+}
+
+// Run work(arg) on the offload executor with only this coroutine parked;
+// -1 if the executor has no room. Outside a coroutine it runs right here.
+static inline int coro_offload(offload_work_fn work, unsigned arg) {
+    coro_t *co = coro_self();
+    offload_job_t job;
+
+    if (co == NULL) {
+        work(arg);
+        return 0;
+    }
+    if (offload_submit(&job, &co->sched->port, work, arg, coro_wake, co) < 0)
+        return -1;
+    coro_yield_to_loop(co);
+    return 0;
+}
+
+// First frame of every coroutine. It never returns: once fn does, the
+// loop frees the coroutine and never switches back to it.
+static void coro_main(void) {
+    coro_t *co = coro_self();
+
+    co->fn(co->arg);
+    co->done = 1;
+    coro_yield_to_loop(co);
+    abort();
+}
+
+static inline char *coro_stack_get(coro_sched_t *sched) {
+    if (sched->num_stacks > 0)
+        return sched->stacks[--sched->num_stacks];
+
+    char *stack = mmap(NULL, CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+        return NULL;
+    if (mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE) < 0) {
+        munmap(stack, CORO_STACK_SIZE);
+        return NULL;
+    }
+    return stack;
+}
+
+static inline void coro_stack_put(coro_sched_t *sched, char *stack) {
+    if (sched->num_stacks < CORO_STACK_CACHE)
+        sched->stacks[sched->num_stacks++] = stack;
+    else
+        munmap(stack, CORO_STACK_SIZE);
+}
+
+// Give a coroutine taken from the inbox a stack and an initial frame
+// that enters coro_main(); returns -1 when out of memory
+static inline int coro_prepare(coro_sched_t *sched, coro_t *co) {
+    if ((co->stack = coro_stack_get(sched)) == NULL)
+        return -1;
+
+    co->sched = sched;
+    co->wait_fd = -1;
+#if defined(__x86_64__)
+    // Six zeroed registers for coro_switch() to pop, then coro_main() as
+    // the return address; the slot above keeps the ABI's alignment
+    void **sp = (void **)(co->stack + CORO_STACK_SIZE);
+    *--sp = NULL;
+    *--sp = (void *)coro_main;
+    for (int i = 0; i < 6; i++)
+        *--sp = NULL;
+    co->sp = sp;
+#else
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack;
+    co->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, coro_main, 0);
+#endif
+    return 0;
+}
+
+static inline void coro_run(coro_sched_t *sched, coro_t *co) {
+    sched->current = co;
+    io_deadline = co->deadline;
+#if defined(__x86_64__)
+    coro_switch(&sched->sp, co->sp);
+#else
+    swapcontext(&sched->ctx, &co->ctx);
+#endif
+    co->deadline = io_deadline;
+    io_deadline = 0;
+    sched->current = NULL;
+
+    if (co->done) {
+        timer_cancel(&co->timer);
+        coro_stack_put(sched, co->stack);
+        slab_free(co, sizeof(*co));
+        __atomic_store_n(&sched->live, sched->live - 1, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void coro_retry(void *data);
+
+// Queue each new coroutine in the list to run, in order. Those that find
+// no stack wait, in order, for finished coroutines to free some.
+static inline void coro_start(coro_sched_t *sched, coro_t *list) {
+    while (list != NULL) {
+        coro_t *co = list;
+
+        if (sched->deferred_head != NULL || coro_prepare(sched, co) < 0) {
+            if (sched->deferred_tail != NULL)
+                sched->deferred_tail->next = list;
+            else
+                sched->deferred_head = list;
+            while (list->next != NULL)
+                list = list->next;
+            sched->deferred_tail = list;
+            if (!timer_pending(&sched->retry))
+                timer_wheel_add(&sched->wheel, &sched->retry, CORO_RETRY_MS, coro_retry, sched);
+            return;
+        }
+
+        list = co->next;
+        __atomic_store_n(&sched->live, sched->live + 1, __ATOMIC_RELAXED);
+        coro_ready(co);
+    }
+}
+
+static inline void coro_retry(void *data) {
+    coro_sched_t *sched = (coro_sched_t *)data;
+    coro_t *list = sched->deferred_head;
+
+    sched->deferred_head = sched->deferred_tail = NULL;
+    coro_start(sched, list);
+}
+
+// Start what coro_spawn() queued, oldest first
+static inline void coro_take_inbox(coro_sched_t *sched) {
+    coro_t *list = __atomic_exchange_n(&sched->inbox, NULL, __ATOMIC_ACQUIRE);
+    coro_t *fifo = NULL;
+
+    while (list != NULL) {
+        coro_t *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    coro_start(sched, fifo);
+}
+
+static inline void *coro_sched_run(void *arg) {
+    coro_sched_t *sched = (coro_sched_t *)arg;
+    struct epoll_event events[CORO_MAX_EVENTS];
+
+    coro_local = sched;
+    while (1) {
+        // Everything made ready so far, including by this pass
+        while (sched->run_head != NULL) {
+            coro_t *co = sched->run_head;
+            sched->run_head = co->next;
+            if (sched->run_head == NULL)
+                sched->run_tail = NULL;
+            coro_run(sched, co);
+        }
+
+        int n = epoll_wait(sched->epoll_fd, events, CORO_MAX_EVENTS, -1);
+        if (n < 0)
+            continue;
+
+        int timers_due = 0;
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &sched->wheel) {
+                timers_due = 1;
+            } else if (ptr == &sched->port) {
+                offload_port_ready(&sched->port);
+            } else if (ptr == sched) {
+                uint64_t count;
+                if (read(sched->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    continue;
+                coro_take_inbox(sched);
+            } else {
+                coro_io_ready((coro_t *)ptr);
+            }
+        }
+        if (timers_due)
+            timer_wheel_expire(&sched->wheel);
+    }
+
+    return NULL;
+}
+
+// Run fn(arg) as a coroutine on one of the schedulers; any thread may
+// call it. Returns -1 if out of memory, in which case fn never runs.
+// Once it returns 0, fn runs as soon as there is a stack for it.
+static inline int coro_spawn(void (*fn)(void *arg), void *arg) {
+    coro_t *co = slab_zalloc(sizeof(coro_t));
+    unsigned pick = __atomic_fetch_add(&coro_runtime.next, 1, __ATOMIC_RELAXED);
+    coro_sched_t *sched = &coro_runtime.scheds[pick % coro_runtime.num_scheds];
+
+    if (co == NULL)
+        return -1;
+    co->fn = fn;
+    co->arg = arg;
+
+    coro_t *head = __atomic_load_n(&sched->inbox, __ATOMIC_RELAXED);
+    do {
+        co->next = head;
+    } while (!__atomic_compare_exchange_n(&sched->inbox, &head, co, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Only the push onto an empty inbox needs to wake the loop
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(sched->event_fd, &one, sizeof(one)) < 0)
+            return 0;               // The counter is already set; it will wake
+    }
+    return 0;
+}
+
+// Coroutines running or waiting, over all schedulers
+static inline double coro_live(void) {
+    uint64_t live = 0;
+
+    for (int i = 0; i < coro_runtime.num_scheds; i++)
+        live += __atomic_load_n(&coro_runtime.scheds[i].live, __ATOMIC_RELAXED);
+    return live;
+}
+
+// Start num_threads schedulers and route io_wait to them; 0 or -1
+static inline int coro_runtime_start(int num_threads) {
+    struct epoll_event ev;
+
+    coro_runtime.scheds = calloc(num_threads, sizeof(coro_sched_t));
+    if (coro_runtime.scheds == NULL)
+        return -1;
+    coro_runtime.num_scheds = num_threads;
+
+    for (int i = 0; i < num_threads; i++) {
+        coro_sched_t *sched = &coro_runtime.scheds[i];
+
+        sched->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        sched->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (sched->epoll_fd < 0 || sched->event_fd < 0 || timer_wheel_init(&sched->wheel) < 0 ||
+            offload_port_init(&sched->port) < 0)
+            return -1;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = sched;
+        if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->event_fd, &ev) < 0)
+            return -1;
+        ev.data.ptr = &sched->wheel;
+        if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->wheel.timer_fd, &ev) < 0)
+            return -1;
+        ev.data.ptr = &sched->port;
+        if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->port.event_fd, &ev) < 0)
+            return -1;
+
+        if (pthread_create(&sched->thread, NULL, coro_sched_run, sched) != 0)
+            return -1;
+        pthread_detach(sched->thread);
+    }
+
+    io_wait = coro_wait;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+// Per-connection deadlines, so a slow or silent client costs the server a
+// bounded amount of time and never a worker, a slot or a loop for good:
+//
+//   header  from the connect, or from the first byte of a request after
+//           the first, until its header block is complete
+//   body    from the end of the headers until the whole body is in
+//   idle    between requests on a persistent connection
+//   write   from when the socket stops taking a response (io_uring: from
+//           the send) until the response is out
+//
+// Header and body deadlines are absolute, so trickling a byte at a time
+// does not extend them. A request cut off part way gets a 408 if the
+// socket buffer takes it; an idle connection or a stalled write is closed.
+//
+// The event-driven engines keep the deadline on the connection's timer in
+// their loop's wheel (http_conn.h). The straight-line handlers set it with
+// io_deadline_set() (io_wait.h), and their waits give up at it.
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "io_wait.h"
+#include "metrics.h"
+#include "response.h"
+
+#define DEADLINE_OPTSTRING "r:y:k:w:"
+#define DEADLINE_OPTIONS                                        \
+    { "header-timeout", required_argument, NULL, 'r' },         \
+    { "body-timeout",   required_argument, NULL, 'y' },         \
+    { "idle-timeout",   required_argument, NULL, 'k' },         \
+    { "write-timeout",  required_argument, NULL, 'w' }
+#define DEADLINE_USAGE                                                          \
+    "  --header-timeout=MS\n"                                                    \
+    "                    time allowed for a request's headers (default 10000)\n" \
+    "  --body-timeout=MS time allowed for a request body (default 30000)\n"    \
+    "  --idle-timeout=MS idle time allowed between requests (default 5000)\n"  \
+    "  --write-timeout=MS\n"                                                     \
+    "                    time allowed for a response to drain (default 10000)\n"
+
+static struct {
+    unsigned header_ms;
+    unsigned body_ms;
+    unsigned idle_ms;
+    unsigned write_ms;
+} deadline_config = {
+    .header_ms = 10000,
+    .body_ms = 30000,
+    .idle_ms = 5000,
+    .write_ms = 10000,
+};
+
+// Handle one of DEADLINE_OPTIONS. Returns 1 if c was one of them, 0 if it
+// is the caller's. A zero timeout would close every connection at once,
+// so it is taken as 1 ms.
+static inline int deadline_option(int c, const char *arg) {
+    unsigned *ms;
+
+    switch (c) {
+    case 'r':
+        ms = &deadline_config.header_ms;
+        break;
+    case 'y':
+        ms = &deadline_config.body_ms;
+        break;
+    case 'k':
+        ms = &deadline_config.idle_ms;
+        break;
+    case 'w':
+        ms = &deadline_config.write_ms;
+        break;
+    default:
+        return 0;
+    }
+
+    *ms = (unsigned)atoi(arg);
+    if (*ms == 0)
+        *ms = 1;
+    return 1;
+}
+
+// Milliseconds left until deadline (absolute, io_now_ms() time), at least
+// 1 so a timer armed with it still fires
+static inline unsigned deadline_left(uint64_t deadline) {
+    uint64_t now = io_now_ms();
+    return deadline > now ? (unsigned)(deadline - now) : 1;
+}
+
+// Tell a client that ran out of time on its request: a 408 if the socket
+// buffer takes it, without waiting. The caller closes the connection.
+static inline void deadline_reject(int fd) {
+    response_t response;
+    uint64_t start_us = metrics_now_us();
+
+    RESPONSE_START_LITERAL(&response, "HTTP/1.1 408 Request Timeout\r\n"
+                                      CORS_HEADERS
+                                      "Content-Length: 0\r\n");
+    response_add_date(&response);
+    response_end_headers(&response, 0);
+
+    sendmsg(fd, response_msghdr(&response), MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    metrics_request(ROUTE_REJECTED, 408, start_us);
+}
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+// What the concurrency engines (engine_*.h) share: the settings server.c
+// parses for them and the listener they all serve.
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "handoff.h"
+#include "log.h"
+
+#define BUFFER_SIZE 4096            // Request buffer, one per connection or handler
+#define ENGINE_FD_RESERVE 64        // Descriptors kept back from clients, see raise_fd_limit()
+
+// Engine settings. Each engine reads only the ones that apply to it.
+static struct {
+    int port;
+    int threads;                    // Pool size, coroutine threads or reactors;
+                                    // -1 = the engine's default, 0 = one per CPU
+    int min_threads;                // pool: workers kept even when idle
+    uint64_t queue_size;            // pool: injection queue capacity
+    int budget_ms;                  // pool: queueing delay that gets a 503
+    int fast_workers;               // pool: workers reserved for cheap requests
+    int pin;                        // epoll: pin reactors to CPUs
+    const char *root;               // epoll, uring: document root
+} engine_config = {
+    .port = 8888,
+    .threads = -1,
+    .min_threads = 2,
+    .queue_size = 1024,
+    .budget_ms = 200,
+    .fast_workers = 1,
+};
+
+// Thread count an engine runs with: its default unless one was given, and
+// the online CPUs for 0
+static inline int engine_threads(int fallback) {
+    int threads = engine_config.threads < 0 ? fallback : engine_config.threads;
+
+    if (threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    return threads > 0 ? threads : 1;
+}
+
+// Raise the open file limit so the connection count is bounded by the
+// kernel and not by the default soft limit of 1024, then cap connections
+// below it. Listeners, event and timer descriptors, the log and trace
+// files and cached files live in the reserve, so clients past the cap get
+// admission's 503 instead of failing accept() with EMFILE.
+static inline void raise_fd_limit(void) {
+    struct rlimit rl;
+    rlim_t reserve;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > UINT_MAX)
+        return;
+
+    reserve = rl.rlim_cur / 2 < ENGINE_FD_RESERVE ? rl.rlim_cur / 2 : ENGINE_FD_RESERVE;
+    admission_limit((unsigned)(rl.rlim_cur - reserve));
+}
+
+// Create the listener on the configured port, bound and listening with the
+// admission settings, or take one over from a predecessor (handoff.h).
+// flags go to socket() (SOCK_NONBLOCK for engines that drain it with
+// admission_accept()). With reuseport set, several listeners can bind the
+// same port and the kernel load-balances incoming connections across them;
+// hot restart always sets it, so a successor can add listeners of its own
+// next to the ones it inherits. Returns -1 with errno set on failure.
+static inline int engine_listen(int flags, int reuseport) {
+    int opt = 1;
+    int server_socket;
+    struct sockaddr_in server_addr;
+
+    server_socket = handoff_take(flags);
+    if (server_socket >= 0) {
+        handoff_register(server_socket);
+        return server_socket;
+    }
+    reuseport |= handoff_enabled();
+
+    server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+    if (server_socket == -1)
+        return -1;
+
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (reuseport && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0))
+        goto fail;
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(engine_config.port);
+
+    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+        admission_listen(server_socket) < 0)
+        goto fail;
+
+    handoff_register(server_socket);
+    return server_socket;
+
+fail:
+    opt = errno;
+    close(server_socket);
+    errno = opt;
+    return -1;
+}
+
+// Wait until the listener may have connections to accept. Once it has been
+// handed off to a successor (handoff.h) it is closed instead, and this
+// never returns: the thread is done, and the drain ends the process.
+static inline void engine_wait_accept(int server_socket) {
+    struct pollfd pfd[2] = {
+        { .fd = server_socket, .events = POLLIN },
+        { .fd = handoff_stop_fd(), .events = POLLIN },  // Ignored when -1
+    };
+
+    while (1) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno != EINTR)
+                log_error("Failed to wait for clients: %s", strerror(errno));
+            continue;
+        }
+        if (!(pfd[1].revents & POLLIN))
+            return;
+
+        close(server_socket);
+        while (1)
+            pause();
+    }
+}
+
+#endif
@@ -0,0 +1,509 @@
+#ifndef ENGINE_EPOLL_H
+#define ENGINE_EPOLL_H
+
+// epoll engine: edge-triggered event loops over non-blocking sockets,
+// driving the connection state machine in http_conn.h. With several
+// reactors each runs on its own thread with its own SO_REUSEPORT listener,
+// timer wheel and offload port, and connections never move between them.
+//
+// A response and the streamed output queued behind it go out in one
+// sendmsg() per wakeup, resumed on EPOLLOUT when the socket is full.
+// Headers ahead of a sendfile() body are sent with MSG_MORE, and the
+// responses to a batch of pipelined requests are corked (TCP_CORK) until
+// the loop is done with the connection, so they share segments.
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
+#include "admission.h"
+#include "engine.h"
+#include "http_conn.h"
+
+#define MAX_EVENTS 1024
+#define ACCEPT_RETRY_MS 100         // Before accepting again after running out of descriptors
+
+// One event loop with its own listener. In multi-reactor mode several run
+// side by side and nothing is shared between them on the accept path.
+typedef struct {
+    int id;
+    int cpu;                // CPU to pin to, or -1
+    int server_socket;
+    int epoll_fd;
+    timer_wheel_t wheel;    // Parked connections waiting on their delay
+    offload_port_t port;    // Connections whose blocking work is done
+    wheel_timer_t accept_retry; // Pending while the listener waits out a failed accept
+    pthread_t thread;
+} reactor_t;
+
+// Allocate a connection and register it for edge-triggered events
+static inline conn_t *conn_open(reactor_t *reactor, int client_socket) {
+    struct epoll_event ev;
+    conn_t *conn = slab_zalloc(sizeof(conn_t));
+
+    if (conn == NULL) {
+        log_error("Failed to allocate connection: %s", strerror(errno));
+        admission_close(client_socket);
+        return NULL;
+    }
+
+    metrics_connection_opened();
+    conn->fd = client_socket;
+    conn->state = CONN_READING;
+    conn->wheel = &reactor->wheel;
+    conn->port = &reactor->port;
+    conn->sendfile = 1;
+    conn_start_deadline(conn);
+    trace_begin(&conn->trace, client_socket, 1);
+
+    // Both directions are registered up front; with EPOLLET there is no
+    // need to EPOLL_CTL_MOD when switching from reading to writing
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+        log_error("Failed to add client to epoll: %s", strerror(errno));
+        metrics_connection_closed();
+        admission_close(client_socket);
+        slab_free(conn, sizeof(conn_t));
+        return NULL;
+    }
+
+    return conn;
+}
+
+// Close the socket (which also removes it from epoll) and free the state
+static inline void conn_close(conn_t *conn) {
+    timer_cancel(&conn->timer);
+    conn_release(conn);
+    admission_close(conn->fd);
+    slab_free(conn, sizeof(conn_t));
+}
+
+// Drain the socket until EAGAIN or a full buffer. Returns -1 once the
+// peer has closed or the read failed, 0 otherwise.
+static inline int conn_fill(conn_t *conn) {
+    if (conn_in_acquire(conn) < 0) {
+        log_error("Failed to allocate input buffer");
+        return -1;
+    }
+
+    while (conn_in_space(conn) > 0) {
+        ssize_t n = read(conn->fd, conn->in + conn->in_len, conn_in_space(conn));
+        if (n > 0) {
+            conn->in_len += n;
+            continue;
+        }
+        if (n == 0)
+            return -1;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+
+        log_error("Failed to read from client: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Read what is there, moving to HANDLING once the request at the front of
+// the buffer is complete
+static inline void conn_read(conn_t *conn) {
+    int eof = conn_fill(conn) < 0;
+
+    if (conn_request_complete(conn))
+        conn->state = CONN_HANDLING;
+    else if (eof)
+        conn->state = CONN_CLOSED;  // Peer closed before sending a complete request
+}
+
+static inline void conn_deadline_expired(void *data);
+
+static inline void conn_cork(conn_t *conn, int on) {
+    if (conn->corked == on)
+        return;
+    if (setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0)
+        conn->corked = on;
+}
+
+// Send the queued response and chain as far as the socket takes them:
+// 1 once they are out, 0 if the socket is full, -1 on error. more says
+// that more of the response follows at once.
+static inline int conn_flush(conn_t *conn, int more) {
+    while (conn_out_pending(conn) > 0) {
+        ssize_t n = sendmsg(conn->fd, conn_out_msghdr(conn),
+                            MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (n >= 0) {
+            conn_out_advance(conn, n);
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+
+        log_error("Failed to write to client: %s", strerror(errno));
+        return -1;
+    }
+    return 1;
+}
+
+// Write as much of the response as the socket accepts, headers and queued
+// output first and then any file body straight from the page cache;
+// EPOLLOUT resumes it, within the write deadline from the first time the
+// socket is full
+static inline void conn_write(conn_t *conn) {
+    int sent;
+
+    trace_mark_once(&conn->trace, TRACE_HANDLER_END);
+    if (conn_pipelined(conn))
+        conn_cork(conn, 1);
+
+    sent = conn_flush(conn, conn->file_offset < conn->file_end);
+    if (sent == 0)
+        goto blocked;
+    if (sent < 0) {
+        conn->state = CONN_CLOSED;
+        return;
+    }
+
+    while (conn->file_offset < conn->file_end) {
+        ssize_t n = sendfile(conn->fd, conn->file->fd, &conn->file_offset,
+                             conn->file_end - conn->file_offset);
+        if (n > 0)
+            continue;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            goto blocked;
+
+        // A file truncated under us ends early; the client sees a short body
+        log_error("Failed to send file to client: %s", n < 0 ? strerror(errno) : "file shrank");
+        conn->state = CONN_CLOSED;
+        return;
+    }
+
+    timer_cancel(&conn->timer);
+    conn_finish_request(conn);
+    return;
+
+blocked:
+    if (!timer_pending(&conn->timer))
+        timer_wheel_add(conn->wheel, &conn->timer, deadline_config.write_ms,
+                        conn_deadline_expired, conn);
+}
+
+static inline void conn_process(conn_t *conn);
+
+// Timer callback for a parked connection: its delay is over, send the response
+static inline void conn_resume(void *data) {
+    conn_t *conn = (conn_t *)data;
+
+    conn->state = CONN_WRITING;
+    conn_process(conn);
+}
+
+// Offload callback: the work is done, send the response, or close a
+// connection whose peer went away meanwhile
+static inline void conn_offloaded(void *data) {
+    conn_t *conn = (conn_t *)data;
+
+    conn_offload_done(conn);
+    conn_process(conn);
+}
+
+// Timer callback for a connection past its deadline, or idle for too long
+static inline void conn_deadline_expired(void *data) {
+    conn_t *conn = (conn_t *)data;
+
+    conn_timed_out(conn);
+    conn_close(conn);
+}
+
+// Run the state machine until it has to wait for the socket or a timer.
+// On a persistent connection this loops through every pipelined request
+// already sitting in the input buffer. Returns 0 once the connection is
+// closed and freed.
+static inline int conn_run(conn_t *conn) {
+    while (1) {
+        switch (conn->state) {
+        case CONN_READING:
+            conn_read(conn);
+            if (conn->state == CONN_READING) {
+                // Wait for more bytes until the deadline, or the idle limit
+                conn_in_release(conn);
+                timer_wheel_add(conn->wheel, &conn->timer, conn_read_timeout(conn),
+                                conn_deadline_expired, conn);
+                return 1;
+            }
+            break;
+        case CONN_HANDLING:
+            timer_cancel(&conn->timer);
+            handle_request(conn);
+            break;
+        case CONN_BODY:
+            conn_body(conn);
+            if (conn->state == CONN_BODY) {
+                // Everything buffered is used up; wait for the next piece
+                int eof = conn_fill(conn) < 0;
+                if (conn->in_len > 0)
+                    break;
+                if (eof) {
+                    conn->state = CONN_CLOSED;
+                    break;
+                }
+                // Send what the stream has queued while the body comes in
+                if (conn->out.bytes > 0 && conn_flush(conn, 0) < 0) {
+                    conn->state = CONN_CLOSED;
+                    break;
+                }
+                conn_in_release(conn);
+                timer_wheel_add(conn->wheel, &conn->timer, conn_read_timeout(conn),
+                                conn_deadline_expired, conn);
+                return 1;
+            }
+            break;
+        case CONN_WAITING:
+            if (conn->work != NULL) {
+                if (!conn->offloaded)
+                    conn_offload(conn, conn_offloaded);
+                if (conn->state == CONN_WAITING)
+                    return 1;
+                break;
+            }
+            if (!timer_pending(&conn->timer))
+                timer_wheel_add(conn->wheel, &conn->timer, conn->delay_ms, conn_resume, conn);
+            return 1;
+        case CONN_WRITING:
+            conn_write(conn);
+            if (conn->state == CONN_WRITING)
+                return 1;
+            break;
+        case CONN_CLOSED:
+            conn_close(conn);
+            return 0;
+        }
+    }
+}
+
+// Run the connection, then push out whatever a pipelined batch left corked
+static inline void conn_process(conn_t *conn) {
+    if (conn_run(conn))
+        conn_cork(conn, 0);
+}
+
+static inline void accept_retry(void *data);
+
+// Accept every pending connection; the listener is edge-triggered too, so
+// an accept that fails with the backlog not drained (out of descriptors
+// with no spare to shed with, see admission.h) is retried on a timer:
+// no new edge would come for the clients already queued
+static inline void accept_connections(reactor_t *reactor) {
+    while (1) {
+        int client_socket = admission_accept(reactor->server_socket,
+                                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            log_error("Failed to accept client: %s", strerror(errno));
+            if (!timer_pending(&reactor->accept_retry))
+                timer_wheel_add(&reactor->wheel, &reactor->accept_retry, ACCEPT_RETRY_MS,
+                                accept_retry, reactor);
+            return;
+        }
+
+        conn_t *conn = conn_open(reactor, client_socket);
+        if (conn != NULL)
+            conn_process(conn);
+    }
+}
+
+// Timer callback: try the listener again after a failed accept
+static inline void accept_retry(void *data) {
+    reactor_t *reactor = (reactor_t *)data;
+
+    if (reactor->server_socket >= 0)
+        accept_connections(reactor);
+}
+
+// Handed off: the successor accepts from here on, while this reactor keeps
+// serving the connections it has. The listener is shared with the
+// successor, so closing it alone would leave it in the epoll set.
+static inline void reactor_stop_accepting(reactor_t *reactor) {
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, handoff_stop_fd(), NULL);
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->server_socket, NULL);
+    timer_cancel(&reactor->accept_retry);
+    close(reactor->server_socket);
+    reactor->server_socket = -1;
+}
+
+// Set up the reactor's listener and epoll instance
+static inline void reactor_init(reactor_t *reactor, int reuseport) {
+    struct epoll_event ev;
+
+    reactor->server_socket = engine_listen(SOCK_NONBLOCK, reuseport);
+    if (reactor->server_socket < 0) {
+        perror("Failed to set up listener");
+        exit(EXIT_FAILURE);
+    }
+
+    reactor->epoll_fd = epoll_create1(0);
+    if (reactor->epoll_fd < 0) {
+        perror("Failed to create epoll instance");
+        exit(EXIT_FAILURE);
+    }
+
+    // The listener is the only registration with a NULL data.ptr
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->server_socket, &ev) < 0) {
+        perror("Failed to add server socket to epoll");
+        exit(EXIT_FAILURE);
+    }
+
+    // Hot restart signal, tagged with the listener it takes away
+    ev.events = EPOLLIN;
+    ev.data.ptr = &reactor->server_socket;
+    if (handoff_stop_fd() >= 0 &&
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, handoff_stop_fd(), &ev) < 0) {
+        perror("Failed to add handoff signal to epoll");
+        exit(EXIT_FAILURE);
+    }
+
+    if (timer_wheel_init(&reactor->wheel) < 0) {
+        perror("Failed to create timer");
+        exit(EXIT_FAILURE);
+    }
+
+    // The wheel's timerfd is tagged with the wheel itself
+    ev.events = EPOLLIN;
+    ev.data.ptr = &reactor->wheel;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wheel.timer_fd, &ev) < 0) {
+        perror("Failed to add timer to epoll");
+        exit(EXIT_FAILURE);
+    }
+
+    // And the offload port's eventfd with the port
+    ev.data.ptr = &reactor->port;
+    if (offload_port_init(&reactor->port) < 0 ||
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->port.event_fd, &ev) < 0) {
+        perror("Failed to set up offload port");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Event loop of one reactor; connections never move between reactors
+static inline void *reactor_run(void *arg) {
+    reactor_t *reactor = (reactor_t *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    if (reactor->cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(reactor->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            log_warn("Failed to pin reactor %d to CPU %d", reactor->id, reactor->cpu);
+    }
+
+    while (1) {
+        int n = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                log_error("Failed to wait for events: %s", strerror(errno));
+            continue;
+        }
+
+        int timers_due = 0, offloads_done = 0;
+
+        for (int i = 0; i < n; i++) {
+            conn_t *conn = events[i].data.ptr;
+
+            if (conn == NULL) {
+                if (reactor->server_socket >= 0)
+                    accept_connections(reactor);
+                continue;
+            }
+
+            if (events[i].data.ptr == &reactor->wheel) {
+                timers_due = 1;
+                continue;
+            }
+
+            if (events[i].data.ptr == &reactor->server_socket) {
+                reactor_stop_accepting(reactor);
+                continue;
+            }
+
+            if (events[i].data.ptr == &reactor->port) {
+                offloads_done = 1;
+                continue;
+            }
+
+            // A parked connection is also dropped here if the peer goes
+            // away; one whose work is out is closed once it is back
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                conn->state = CONN_CLOSED;
+
+            // Parked connections wait for their timer or work, not the socket
+            if (conn->state != CONN_WAITING && !conn->offloaded)
+                conn_process(conn);
+        }
+
+        // Timers and offload callbacks run after the batch: either may free
+        // a connection that still has an entry further down in events[]
+        if (timers_due)
+            timer_wheel_expire(&reactor->wheel);
+        if (offloads_done)
+            offload_port_ready(&reactor->port);
+    }
+
+    return NULL;
+}
+
+static inline void engine_epoll(void) {
+    int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_reactors = engine_threads(1);
+    reactor_t *reactors;
+
+    if (num_cpus < 1)
+        num_cpus = 1;
+
+    reactors = calloc(num_reactors, sizeof(reactor_t));
+    if (reactors == NULL) {
+        perror("Failed to allocate reactors");
+        exit(EXIT_FAILURE);
+    }
+
+    // All listeners are bound before any loop starts, so a bind failure
+    // (e.g. port already taken) is reported before serving anything
+    for (int i = 0; i < num_reactors; i++) {
+        reactors[i].id = i;
+        reactors[i].cpu = engine_config.pin ? i % num_cpus : -1;
+        reactor_init(&reactors[i], num_reactors > 1);
+    }
+
+    log_info("Server listening on port %d with %d reactor(s)...", engine_config.port, num_reactors);
+    handoff_ready();
+
+    for (int i = 1; i < num_reactors; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_run, &reactors[i]) != 0) {
+            perror("Failed to create reactor thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The main thread runs reactor 0
+    reactor_run(&reactors[0]);
+}
+
+#endif
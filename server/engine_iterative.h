@@ -0,0 +1,70 @@
+#ifndef ENGINE_ITERATIVE_H
+#define ENGINE_ITERATIVE_H
+
+// Iterative engine: one client at a time, start to finish, on the main
+// thread. The simulated workload stalls everyone queued behind it; this is
+// the baseline the other engines are measured against.
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+#include "engine.h"
+#include "http_serve.h"
+#include "io_wait.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Sit out the workload, or do the handler's blocking work, with the whole
+// server: there is nothing else for the thread to serve meanwhile
+static inline void iterative_wait(reply_t *reply) {
+    if (reply->result.work != NULL)
+        reply->result.work(reply->result.work_arg);
+    else
+        poll(NULL, 0, reply->result.delay_ms);
+    reply_finish(reply);
+}
+
+static inline void engine_iterative(void) {
+    char buffer[BUFFER_SIZE];
+    int server_socket, client_socket;
+    trace_t trace;
+
+    // Client sockets are non-blocking too, so every wait on one can give
+    // up at its deadline
+    io_wait = io_poll;
+
+    server_socket = engine_listen(SOCK_NONBLOCK, 0);
+    if (server_socket < 0) {
+        perror("Failed to set up listener");
+        exit(EXIT_FAILURE);
+    }
+
+    log_info("Server listening on port %d...", engine_config.port);
+    handoff_ready();
+
+    while (1) {
+        // Wait for connects, then serve every pending one in turn; a slow
+        // client holds up the rest only until its deadline
+        engine_wait_accept(server_socket);
+
+        // Each client takes a while, so stop taking them as soon as a
+        // successor has the listener
+        while (!handoff_draining() &&
+               (client_socket = admission_accept(server_socket,
+                                                  SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            log_info("New client connected...");
+            metrics_connection_opened();
+            trace_begin(&trace, client_socket, 1);
+            serve_client(client_socket, buffer, sizeof(buffer), &trace, iterative_wait);
+        }
+        if (!handoff_draining() && errno != EAGAIN && errno != EWOULDBLOCK)
+            log_error("Failed to accept client: %s", strerror(errno));
+    }
+}
+
+#endif
@@ -0,0 +1,474 @@
+#ifndef ENGINE_POOL_H
+#define ENGINE_POOL_H
+
+// Pool engine: an acceptor thread hands clients to an elastic pool of
+// worker threads over a work-stealing scheduler (scheduler.h). A worker
+// serves one client at a time; the simulated workload parks the reply on
+// a timer wheel, and blocking work goes to the offload executor, so the
+// worker takes the next client right away.
+//
+// Cheap requests (router_is_cheap(): preflights, scrapes, 404s) have a
+// fast lane. The acceptor peeks at each new client's request line, and a
+// cheap one goes on a queue of its own, served by reserved fast-lane
+// workers and by regular workers between their own clients, so it never
+// waits behind the regular lane however backed up that is.
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+#include "deadline.h"
+#include "engine.h"
+#include "http_parser.h"
+#include "http_serve.h"
+#include "io_wait.h"
+#include "log.h"
+#include "metrics.h"
+#include "response.h"
+#include "router.h"
+#include "scheduler.h"
+#include "timer_wheel.h"
+#include "trace.h"
+
+#define POOL_MAX_THREADS 64         // Default pool size, see engine_config.threads
+#define IDLE_TIMEOUT_MS 5000        // Idle time before a worker above the minimum retires
+#define POOL_FAST_QUEUE 1024        // Cheap requests waiting, a power of two
+#define POOL_FAST_WEIGHT 4          // Cheap requests a worker takes in a row while others wait
+#define POOL_PEEK_SIZE 512          // Bytes looked at to classify a request
+#define POOL_ACCEPT_RETRY_MS 100    // Acceptor pause after a failed accept
+
+// Elastic pool. A worker is added whenever clients queue up with nobody
+// idle to take them, up to max_threads; a worker idle for IDLE_TIMEOUT_MS
+// retires while more than min_threads run. Once the pool is at its maximum
+// and a new client would wait longer than the latency budget - predicted
+// from the queue depth and service time, or because no queued client has
+// been picked up for that long - it gets an immediate 503 instead of a
+// place in the queue.
+typedef struct {
+    scheduler_t scheduler;
+    int min_threads;
+    int max_threads;
+    uint32_t budget_us;
+    int *running;               // Per slot: a worker runs on it
+    uint32_t wait_us;           // Moving average of the queueing delay
+    uint32_t service_us;        // Moving average of the time per client
+    uint64_t submitted;         // Clients queued, by the acceptor
+    uint64_t started;           // Clients taken off the queues, by workers
+    uint32_t last_start_us;     // When a worker last took a client
+    mpmc_queue_t fast;          // Cheap requests, outside the counts above
+    event_count_t fast_work;    // Where fast-lane workers park
+} pool_t;
+
+static pool_t pool;
+
+// Parked replies. Workers add under pool_wheel_mutex; the timer thread
+// expires them and sends the due ones after dropping the lock.
+static timer_wheel_t pool_wheel;
+static pthread_mutex_t pool_wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static reply_t *pool_due_replies = NULL;
+
+// Replies whose work is done come back to the timer thread through here
+static offload_port_t pool_port;
+
+// Timer callback, runs with pool_wheel_mutex held: just collect the reply
+static inline void pool_collect_due(void *data) {
+    reply_t *reply = (reply_t *)data;
+
+    reply->next = pool_due_replies;
+    pool_due_replies = reply;
+}
+
+// Park the reply instead of sleeping, or offload its work, so the worker
+// can take the next task right away
+static inline void pool_park(reply_t *reply) {
+    if (reply->result.work != NULL) {
+        reply_offload(reply, &pool_port);
+        return;
+    }
+    pthread_mutex_lock(&pool_wheel_mutex);
+    timer_wheel_add(&pool_wheel, &reply->timer, reply->result.delay_ms, pool_collect_due, reply);
+    pthread_mutex_unlock(&pool_wheel_mutex);
+}
+
+// Single thread that sends every parked reply once its delay is over, and
+// every offloaded one once its work is done
+static inline void *pool_timer_thread(void *arg) {
+    struct pollfd pfd[2] = {
+        { .fd = pool_wheel.timer_fd, .events = POLLIN },
+        { .fd = pool_port.event_fd, .events = POLLIN },
+    };
+    (void)arg;
+
+    while (1) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno != EINTR)
+                log_error("Failed to wait for timer: %s", strerror(errno));
+            continue;
+        }
+
+        if (pfd[1].revents & POLLIN)
+            offload_port_ready(&pool_port);
+        if (!(pfd[0].revents & POLLIN))
+            continue;
+
+        pthread_mutex_lock(&pool_wheel_mutex);
+        timer_wheel_expire(&pool_wheel);
+        reply_t *due = pool_due_replies;
+        pool_due_replies = NULL;
+        pthread_mutex_unlock(&pool_wheel_mutex);
+
+        while (due != NULL) {
+            reply_t *next = due->next;
+
+            reply_finish(due);
+            due = next;
+        }
+    }
+
+    return NULL;
+}
+
+// Fold a sample into a moving average. Workers update it without a lock;
+// a lost update only delays the average by one sample.
+static inline void average_update(uint32_t *average, uint32_t sample) {
+    uint32_t old = __atomic_load_n(average, __ATOMIC_RELAXED);
+    __atomic_store_n(average, old - old / 8 + sample / 8, __ATOMIC_RELAXED);
+}
+
+static inline void *worker_thread(void *arg);
+
+// Start a worker on a free slot; returns -1 if the pool is at its maximum
+static inline int pool_grow(void) {
+    for (int slot = 0; slot < pool.max_threads; slot++) {
+        int free_slot = 0;
+        pthread_t thread;
+
+        if (!__atomic_compare_exchange_n(&pool.running[slot], &free_slot, 1, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+
+        __atomic_fetch_add(&pool.scheduler.active, 1, __ATOMIC_SEQ_CST);
+        if (pthread_create(&thread, NULL, worker_thread, (void *)(intptr_t)slot) != 0) {
+            log_error("Failed to create thread: %s", strerror(errno));
+            __atomic_fetch_sub(&pool.scheduler.active, 1, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&pool.running[slot], 0, __ATOMIC_RELEASE);
+            return -1;
+        }
+        pthread_detach(thread);
+        return 0;
+    }
+    return -1;
+}
+
+// Drop a worker from the count unless that would take the pool below its
+// minimum; the caller still owns its slot until it clears running[]
+static inline int pool_shrink(void) {
+    int active = __atomic_load_n(&pool.scheduler.active, __ATOMIC_SEQ_CST);
+
+    while (active > pool.min_threads) {
+        if (__atomic_compare_exchange_n(&pool.scheduler.active, &active, active - 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return 1;
+    }
+    return 0;
+}
+
+// Would a new client wait past the budget? Only asked of a full pool with
+// clients queued: either the queue ahead of it at the current service
+// time is too long, or the queue has not moved for the whole budget.
+static inline int pool_over_budget(void) {
+    uint64_t queued = __atomic_load_n(&pool.submitted, __ATOMIC_RELAXED) -
+                      __atomic_load_n(&pool.started, __ATOMIC_RELAXED);
+    int active = __atomic_load_n(&pool.scheduler.active, __ATOMIC_RELAXED);
+    uint32_t stalled;
+    uint64_t predicted;
+
+    if (queued == 0 || active < pool.max_threads)
+        return 0;
+
+    stalled = sched_now_us() - __atomic_load_n(&pool.last_start_us, __ATOMIC_RELAXED);
+    predicted = queued * __atomic_load_n(&pool.service_us, __ATOMIC_RELAXED) / active;
+    return predicted > pool.budget_us || stalled > pool.budget_us;
+}
+
+// Is a new client's request cheap? Looks at its request line without
+// reading it; one that has not arrived yet counts as not cheap, since the
+// acceptor never waits. Malformed ones are cheap: they get a 400 at once.
+static inline int pool_classify(int client_socket) {
+    char line[POOL_PEEK_SIZE];
+    http_request_t req;
+    ssize_t n = recv(client_socket, line, sizeof(line), MSG_PEEK | MSG_DONTWAIT);
+
+    if (n <= 0)
+        return 0;
+    http_request_init(&req);
+    n = http_parse_request_line(&req, line, line + n);
+    return n < 0 || (n > 0 && router_is_cheap(&req));
+}
+
+// Queue a cheap client on the fast lane; -1 if it is full
+static inline int pool_submit_fast(int client_socket) {
+    task_t task = { client_socket, sched_now_us() };
+
+    if (mpmc_push(&pool.fast, task) < 0)
+        return -1;
+    ec_notify(&pool.fast_work, 1);
+    return 0;
+}
+
+// Answer 503 right away and let the client come back later
+static inline void shed_client(int client_socket) {
+    response_t response;
+    char discard[BUFFER_SIZE];
+    uint64_t start_us = metrics_now_us();
+
+    // The acceptor must not wait on a client it cannot serve: the 503 goes
+    // out if the socket buffer takes it, and is lost otherwise
+    router_busy(&response, 0);
+    sendmsg(client_socket, response_msghdr(&response), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    // Drain what already arrived, so the close does not reset the connection
+    // under the response
+    shutdown(client_socket, SHUT_WR);
+    while (recv(client_socket, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+        ;
+    metrics_request(ROUTE_REJECTED, 503, start_us);
+    metrics_connection_closed();
+    admission_close(client_socket);
+}
+
+// Serve a client taken off a queue at now_us
+static inline void pool_serve(task_t task, uint64_t now_us, char *buffer) {
+    trace_t trace;
+
+    // Task stamps are the low bits of the metrics clock. The acceptor
+    // queues a client as soon as it has it, so the trace starts there.
+    trace_begin(&trace, task.fd, 0);
+    trace_mark_at(&trace, TRACE_ENQUEUE, now_us - (uint32_t)((uint32_t)now_us - task.queued_us));
+    trace_mark_at(&trace, TRACE_DEQUEUE, now_us);
+
+    metrics_queue_wait((uint32_t)now_us - task.queued_us);
+    serve_client(task.fd, buffer, BUFFER_SIZE, &trace, pool_park);
+}
+
+// Fast-lane worker: only cheap requests, so one is never stuck behind
+// the regular lane
+static inline void *pool_fast_thread(void *arg) {
+    char buffer[BUFFER_SIZE];
+    task_t task;
+    (void)arg;
+
+    while (1) {
+        if (mpmc_pop(&pool.fast, &task) < 0) {
+            uint32_t seq = ec_prepare(&pool.fast_work);
+            if (mpmc_pop(&pool.fast, &task) < 0) {
+                ec_wait(&pool.fast_work, seq, -1);
+                continue;
+            }
+            ec_cancel(&pool.fast_work);
+        }
+        pool_serve(task, metrics_now_us(), buffer);
+    }
+
+    return NULL;
+}
+
+// Pool worker: serve clients, measuring their queueing delay and service
+// time, and retire after a long enough idle spell. Cheap requests go
+// first, but no more than POOL_FAST_WEIGHT in a row while regular ones
+// wait, so neither lane starves the other.
+static inline void *worker_thread(void *arg) {
+    int slot = (int)(intptr_t)arg;
+    char buffer[BUFFER_SIZE];
+    task_t task;
+    unsigned fast_streak = 0;
+
+    while (1) {
+        if ((fast_streak < POOL_FAST_WEIGHT || scheduler_backlog(&pool.scheduler, slot) == 0) &&
+            mpmc_pop(&pool.fast, &task) == 0) {
+            fast_streak++;
+            metrics_busy(1);
+            pool_serve(task, metrics_now_us(), buffer);
+            metrics_busy(0);
+            continue;
+        }
+        fast_streak = 0;
+
+        if (scheduler_next(&pool.scheduler, slot, &task, IDLE_TIMEOUT_MS) < 0) {
+            if (!pool_shrink())
+                continue;
+
+            // A client queued between the last look and leaving the count
+            // must not be stranded: take it and stay
+            if (scheduler_try_next(&pool.scheduler, slot, &task) < 0) {
+                __atomic_store_n(&pool.running[slot], 0, __ATOMIC_RELEASE);
+                return NULL;
+            }
+            __atomic_fetch_add(&pool.scheduler.active, 1, __ATOMIC_SEQ_CST);
+        }
+
+        // Clients queue behind this one and nobody is free to take them:
+        // a blocking read could hold them up, so add a worker. So does a
+        // queueing delay past a quarter of the budget.
+        if (scheduler_idle(&pool.scheduler) == 0 &&
+            (scheduler_backlog(&pool.scheduler, slot) > 0 ||
+             __atomic_load_n(&pool.wait_us, __ATOMIC_RELAXED) > pool.budget_us / 4))
+            pool_grow();
+
+        uint64_t now_us = metrics_now_us();
+        uint32_t start = (uint32_t)now_us;
+        __atomic_fetch_add(&pool.started, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&pool.last_start_us, start, __ATOMIC_RELAXED);
+        average_update(&pool.wait_us, start - task.queued_us);
+        metrics_busy(1);
+        pool_serve(task, now_us, buffer);
+        metrics_busy(0);
+        average_update(&pool.service_us, sched_now_us() - start);
+    }
+
+    return NULL;
+}
+
+// Pool gauges for /metrics
+static inline double pool_workers(void) {
+    return __atomic_load_n(&pool.scheduler.active, __ATOMIC_RELAXED);
+}
+
+static inline double pool_queue_depth(void) {
+    return __atomic_load_n(&pool.submitted, __ATOMIC_RELAXED) -
+           __atomic_load_n(&pool.started, __ATOMIC_RELAXED);
+}
+
+static inline double pool_fast_queue_depth(void) {
+    return mpmc_depth(&pool.fast);
+}
+
+static inline double pool_utilization(void) {
+    double workers = pool_workers();
+    return workers > 0 ? metrics_busy_threads() / workers : 0;
+}
+
+static inline void engine_pool(void) {
+    uint64_t queue_size = engine_config.queue_size;
+    int server_socket, client_socket;
+
+    pool.max_threads = engine_threads(POOL_MAX_THREADS);
+    pool.min_threads = engine_config.min_threads;
+    if (pool.min_threads < 1)
+        pool.min_threads = 1;
+    if (pool.min_threads > pool.max_threads)
+        pool.min_threads = pool.max_threads;
+    if (queue_size < 2)
+        queue_size = 2;
+    while (queue_size & (queue_size - 1))
+        queue_size += queue_size & -queue_size;
+    pool.budget_us = engine_config.budget_ms > 0 ? engine_config.budget_ms * 1000U : 0;
+
+    // Initialize the scheduler with a slot for every potential worker
+    pool.running = calloc(pool.max_threads, sizeof(int));
+    if (pool.running == NULL ||
+        scheduler_init(&pool.scheduler, pool.max_threads, queue_size) < 0 ||
+        mpmc_init(&pool.fast, POOL_FAST_QUEUE) < 0) {
+        perror("Failed to create scheduler");
+        exit(EXIT_FAILURE);
+    }
+
+    metrics_gauge("pool_workers", "Worker threads running.", pool_workers);
+    metrics_gauge("pool_busy_workers", "Workers serving a client.", metrics_busy_threads);
+    metrics_gauge("pool_queue_depth", "Clients accepted and not yet taken by a worker.",
+                  pool_queue_depth);
+    metrics_gauge("pool_fast_queue_depth", "Cheap requests waiting for the fast lane.",
+                  pool_fast_queue_depth);
+    metrics_gauge("pool_utilization", "Fraction of the workers serving a client.",
+                  pool_utilization);
+
+    if (timer_wheel_init(&pool_wheel) < 0) {
+        perror("Failed to create timer");
+        exit(EXIT_FAILURE);
+    }
+    if (offload_port_init(&pool_port) < 0) {
+        perror("Failed to create offload port");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t timer;
+    if (pthread_create(&timer, NULL, pool_timer_thread, NULL) != 0) {
+        perror("Failed to create timer thread");
+        exit(EXIT_FAILURE);
+    }
+
+    // Create the minimum set of worker threads, and the fast lane's
+    for (int i = 0; i < pool.min_threads; i++) {
+        if (pool_grow() < 0)
+            exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < engine_config.fast_workers; i++) {
+        pthread_t fast;
+
+        if (pthread_create(&fast, NULL, pool_fast_thread, NULL) != 0) {
+            perror("Failed to create fast-lane thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(fast);
+    }
+
+    // Client sockets are non-blocking, so a silent client holds a worker
+    // only until its deadline
+    io_wait = io_poll;
+
+    // Non-blocking, so a burst of connects can be accepted in one go. The
+    // acceptor never blocks on the pool, so a deep backlog only absorbs
+    // bursts of connects.
+    server_socket = engine_listen(SOCK_NONBLOCK, 0);
+    if (server_socket < 0) {
+        perror("Failed to set up listener");
+        exit(EXIT_FAILURE);
+    }
+
+    log_info("Server listening on port %d...", engine_config.port);
+    handoff_ready();
+
+    while (1) {
+        // Wait for connects, then take every one that is pending. Workers
+        // wait on the clients through io_poll(), up to their deadlines.
+        log_debug("Waiting for new connection...");
+        engine_wait_accept(server_socket);
+
+        while ((client_socket = admission_accept(server_socket,
+                                                 SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            log_info("New client connected...");
+            metrics_connection_opened();
+
+            // Cheap requests skip the regular queue, and its budget
+            if (engine_config.fast_workers > 0 && pool_classify(client_socket) &&
+                pool_submit_fast(client_socket) == 0)
+                continue;
+
+            // Shed load rather than queue a client that would wait too long
+            __atomic_fetch_add(&pool.submitted, 1, __ATOMIC_RELAXED);
+            if (pool_over_budget() || scheduler_submit(&pool.scheduler, client_socket) < 0) {
+                __atomic_fetch_sub(&pool.submitted, 1, __ATOMIC_RELAXED);
+                log_warn("Pool saturated, sending 503...");
+                shed_client(client_socket);
+                continue;
+            }
+
+            // Nobody is free to take it: add a worker if the pool may grow
+            if (scheduler_idle(&pool.scheduler) == 0)
+                pool_grow();
+        }
+        // The listener stays readable while accept() fails; back off
+        // rather than spin on it
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_error("Failed to accept client: %s", strerror(errno));
+            poll(NULL, 0, POOL_ACCEPT_RETRY_MS);
+        }
+    }
+}
+
+#endif
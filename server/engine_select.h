@@ -0,0 +1,520 @@
+#ifndef ENGINE_SELECT_H
+#define ENGINE_SELECT_H
+
+// select() engine: one loop watches the listener, the clients and a timer
+// wheel, and answers one request per connection. Each client has a slot
+// that carries it through its phases, advanced only when select() says the
+// socket is ready, so no client holds up the loop at any point: headers
+// and body are read as they arrive, the reply is written as far as the
+// socket takes it and resumed when it is writable again. The simulated
+// workload parks the slot on the wheel instead of sleeping, and blocking
+// work goes to the offload executor. The same wheel enforces the header,
+// body and write deadlines.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "deadline.h"
+#include "engine.h"
+#include "http_body.h"
+#include "http_parser.h"
+#include "log.h"
+#include "metrics.h"
+#include "offload.h"
+#include "out_chain.h"
+#include "response.h"
+#include "router.h"
+#include "slab.h"
+#include "timer_wheel.h"
+#include "trace.h"
+
+#define SELECT_MAX_CLIENTS 30       // Clients reading their request at once
+#define SELECT_OUT_IOV 16           // iovecs per send: the response's and the chain's
+#define SELECT_OUT_HIGH_WATER 65536 // Echoed bytes queued before reading stops
+
+typedef enum {
+    SELECT_HEADERS,                 // Reading the request headers
+    SELECT_BODY,                    // Reading the body; an echo sends it back meanwhile
+    SELECT_WAITING,                 // Parked on the wheel, or its work offloaded
+    SELECT_WRITING                  // Sending the reply
+} select_phase_t;
+
+// A client, from accept to close. The buffer comes from the slab once the
+// first bytes arrive and goes back once the body is in.
+typedef struct {
+    int fd;
+    select_phase_t phase;
+    char *buffer;                   // BUFFER_SIZE bytes, or NULL
+    size_t len;
+    http_request_t req;
+    http_body_t body;
+    response_t response;
+    out_chain_t out;                // Echoed body, sent behind the response
+    int sent;                       // Part of the reply is out; too late for a 408
+    arena_t arena;                  // Scratch the response may point into
+    router_result_t result;
+    uint64_t start_us;              // When the headers were in, for the latency histogram
+    offload_job_t job;
+    wheel_timer_t timer;            // Deadline of the phase, or the end of the workload
+    trace_t trace;
+} select_slot_t;
+
+// Parked replies and deadlines; the wheel's timerfd is part of the
+// select() set, and so is the port offloaded work comes back through.
+// Slots are found by descriptor, which accept keeps below FD_SETSIZE.
+static timer_wheel_t select_wheel;
+static offload_port_t select_port;
+static select_slot_t *select_slots[FD_SETSIZE];
+static int select_top;              // Past the highest descriptor with a slot
+static int select_readers;          // Slots in HEADERS or BODY
+
+static inline void select_slot_ready(select_slot_t *slot);
+
+// Close the connection and free the slot, whatever its phase
+static inline void select_slot_close(select_slot_t *slot) {
+    if (slot->phase == SELECT_HEADERS || slot->phase == SELECT_BODY)
+        select_readers--;
+    timer_cancel(&slot->timer);
+    select_slots[slot->fd] = NULL;
+    metrics_connection_closed();
+    admission_close(slot->fd);
+    slab_free(slot->buffer, BUFFER_SIZE);
+    out_chain_free(&slot->out);
+    arena_reset(&slot->arena);
+    slab_free(slot, sizeof(*slot));
+}
+
+// Timer callback: the deadline of the phase has passed, or the workload
+// is over. A client cut off before any of its reply went out is told so.
+static inline void select_slot_timer(void *data) {
+    select_slot_t *slot = (select_slot_t *)data;
+
+    switch (slot->phase) {
+    case SELECT_HEADERS:
+    case SELECT_BODY:
+        if ((slot->len > 0 || slot->phase == SELECT_BODY) && !slot->sent)
+            deadline_reject(slot->fd);
+        select_slot_close(slot);
+        return;
+    case SELECT_WAITING:
+        slot->phase = SELECT_WRITING;
+        select_slot_ready(slot);
+        return;
+    case SELECT_WRITING:
+        log_warn("Client too slow to take its response, closing");
+        select_slot_close(slot);
+        return;
+    }
+}
+
+// Offload callback: the work is done, send the reply
+static inline void select_slot_offloaded(void *data) {
+    select_slot_t *slot = (select_slot_t *)data;
+
+    slot->phase = SELECT_WRITING;
+    select_slot_ready(slot);
+}
+
+// Send the response and the chain behind it as far as the socket takes
+// them: 1 once they are out, 0 if the socket is full, -1 on error
+static inline int select_slot_flush(select_slot_t *slot) {
+    response_t *r = &slot->response;
+
+    while (r->remaining + slot->out.bytes > 0) {
+        struct iovec iov[SELECT_OUT_IOV];
+        struct msghdr msg = { 0 };
+        int n = r->iovcnt - r->iov_pos;
+        ssize_t sent;
+
+        memcpy(iov, r->iov + r->iov_pos, n * sizeof(struct iovec));
+        n += out_chain_iov(&slot->out, iov + n, SELECT_OUT_IOV - n);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        sent = sendmsg(slot->fd, &msg, MSG_NOSIGNAL);
+        if (sent >= 0) {
+            size_t head = (size_t)sent < r->remaining ? (size_t)sent : r->remaining;
+
+            response_advance(r, head);
+            out_chain_consume(&slot->out, sent - head);
+            slot->sent = 1;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+
+        log_error("Failed to write to client: %s", strerror(errno));
+        return -1;
+    }
+    return 1;
+}
+
+// Write what the socket takes; the reply is counted and the connection
+// closed once it is all out. The write deadline runs from the first time
+// the socket is full.
+static inline void select_slot_write(select_slot_t *slot) {
+    int sent;
+
+    trace_mark_once(&slot->trace, TRACE_HANDLER_END);
+    sent = select_slot_flush(slot);
+    if (sent == 0) {
+        if (!timer_pending(&slot->timer))
+            timer_wheel_add(&select_wheel, &slot->timer, deadline_config.write_ms,
+                            select_slot_timer, slot);
+        return;
+    }
+    if (sent > 0) {
+        metrics_request(slot->result.route, slot->result.status, slot->start_us);
+        trace_end(&slot->trace, slot->result.route, slot->result.status);
+    }
+    select_slot_close(slot);
+}
+
+// The body is in: wait out the workload, hand off the blocking work, or
+// send the reply now
+static inline void select_slot_reply(select_slot_t *slot) {
+    select_readers--;
+    timer_cancel(&slot->timer);
+    slab_free(slot->buffer, BUFFER_SIZE);
+    slot->buffer = NULL;
+    slot->len = 0;
+
+    if (slot->result.work != NULL) {
+        if (offload_submit(&slot->job, &select_port, slot->result.work, slot->result.work_arg,
+                           select_slot_offloaded, slot) == 0) {
+            slot->phase = SELECT_WAITING;
+            return;
+        }
+        slot->result.status = router_busy(&slot->response, 0);
+        slot->result.work = NULL;
+    } else if (slot->result.delay_ms > 0) {
+        slot->phase = SELECT_WAITING;
+        timer_wheel_add(&select_wheel, &slot->timer, slot->result.delay_ms,
+                        select_slot_timer, slot);
+        return;
+    }
+
+    slot->phase = SELECT_WRITING;
+    select_slot_write(slot);
+}
+
+// Pass what is buffered of the body through the decoder, then read more,
+// until the body is in or the socket runs dry. An echo queues each piece
+// behind the response and stops reading at the high-water mark until the
+// client has taken some of it; any other body is dropped.
+static inline void select_slot_body(select_slot_t *slot) {
+    int echo = slot->result.route == ROUTE_ECHO;
+
+    while (1) {
+        if (slot->len > 0 && !http_body_done(&slot->body)) {
+            size_t out;
+            long used = http_body_decode(&slot->body, slot->buffer, slot->len, &out);
+
+            if (used < 0) {
+                // Broken chunk framing; once part of an echo is out there
+                // is no way to say so but to cut the connection
+                if (slot->sent) {
+                    select_slot_close(slot);
+                    return;
+                }
+                out_chain_free(&slot->out);
+                RESPONSE_START_LITERAL(&slot->response, head_400);
+                response_add_date(&slot->response);
+                response_add_length(&slot->response, sizeof("400 Bad Request\n") - 1);
+                response_end_headers(&slot->response, 0);
+                RESPONSE_ADD_LITERAL(&slot->response, "400 Bad Request\n");
+                slot->result = (router_result_t){ .route = ROUTE_REJECTED, .status = 400 };
+                select_slot_reply(slot);
+                return;
+            }
+            if (echo && out > 0 &&
+                (slot->result.chunked ? out_chain_add_chunk(&slot->out, slot->buffer, out)
+                                      : out_chain_add(&slot->out, slot->buffer, out)) < 0) {
+                log_error("Failed to queue echoed body");
+                select_slot_close(slot);
+                return;
+            }
+            memmove(slot->buffer, slot->buffer + used, slot->len - used);
+            slot->len -= used;
+        }
+
+        if (http_body_done(&slot->body)) {
+            if (echo && slot->result.chunked && out_chain_add_chunk(&slot->out, NULL, 0) < 0) {
+                log_error("Failed to queue echoed body");
+                select_slot_close(slot);
+                return;
+            }
+            select_slot_reply(slot);
+            return;
+        }
+
+        // Send what the echo has queued while the body comes in
+        if (echo && select_slot_flush(slot) < 0) {
+            select_slot_close(slot);
+            return;
+        }
+        if (slot->out.bytes >= SELECT_OUT_HIGH_WATER)
+            return;
+
+        ssize_t n = read(slot->fd, slot->buffer + slot->len, BUFFER_SIZE - slot->len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        if (n <= 0) {
+            if (n < 0)
+                log_error("Failed to read request body from client: %s", strerror(errno));
+            select_slot_close(slot);
+            return;
+        }
+        slot->len += n;
+    }
+}
+
+// The headers are in: route the request and take its body, within the
+// body deadline
+static inline void select_slot_handle(select_slot_t *slot) {
+    log_debug("Received request:\n%s", slot->buffer);
+
+    timer_cancel(&slot->timer);
+    trace_mark(&slot->trace, TRACE_PARSED);
+    slot->start_us = metrics_now_us();
+    trace_mark(&slot->trace, TRACE_HANDLER_START);
+    slot->result = router_handle(&slot->req, 0, &slot->response, &slot->arena);
+
+    if (slot->req.error_status != 0) {
+        select_slot_reply(slot);
+        return;
+    }
+
+    memmove(slot->buffer, slot->buffer + slot->req.header_len, slot->len - slot->req.header_len);
+    slot->len -= slot->req.header_len;
+    http_body_init(&slot->body, &slot->req);
+    slot->phase = SELECT_BODY;
+    timer_wheel_add(&select_wheel, &slot->timer, deadline_config.body_ms, select_slot_timer, slot);
+    select_slot_body(slot);
+}
+
+// Read what the client sent and handle it once the headers are complete
+static inline void select_slot_read(select_slot_t *slot) {
+    long status;
+    ssize_t n;
+
+    if (slot->buffer == NULL && (slot->buffer = slab_alloc(BUFFER_SIZE)) == NULL) {
+        log_error("Failed to allocate request buffer");
+        select_slot_close(slot);
+        return;
+    }
+
+    n = read(slot->fd, slot->buffer + slot->len, BUFFER_SIZE - 1 - slot->len);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0) {
+        if (n < 0)
+            log_error("Failed to read request from client: %s", strerror(errno));
+        select_slot_close(slot);
+        return;
+    }
+    if (slot->len == 0)
+        trace_mark(&slot->trace, TRACE_FIRST_BYTE);
+    slot->len += n;
+    slot->buffer[slot->len] = '\0';
+
+    status = http_parse_request(&slot->req, slot->buffer, slot->len);
+    if (status == HTTP_PARSE_INCOMPLETE) {
+        if (slot->len < BUFFER_SIZE - 1)
+            return;
+        http_parse_fail(&slot->req, 431);
+    }
+    select_slot_handle(slot);
+}
+
+// The socket is ready for what the slot's phase is waiting on
+static inline void select_slot_ready(select_slot_t *slot) {
+    switch (slot->phase) {
+    case SELECT_HEADERS:
+        select_slot_read(slot);
+        return;
+    case SELECT_BODY:
+        select_slot_body(slot);
+        return;
+    case SELECT_WAITING:
+        return;
+    case SELECT_WRITING:
+        select_slot_write(slot);
+        return;
+    }
+}
+
+// Give a new client a slot, with its header deadline
+static inline int select_slot_open(int client_socket) {
+    select_slot_t *slot = slab_zalloc(sizeof(select_slot_t));
+
+    if (slot == NULL) {
+        log_error("Failed to allocate client slot: %s", strerror(errno));
+        return -1;
+    }
+    slot->fd = client_socket;
+    slot->phase = SELECT_HEADERS;
+    http_request_init(&slot->req);
+    trace_begin(&slot->trace, client_socket, 1);
+    timer_wheel_add(&select_wheel, &slot->timer, deadline_config.header_ms,
+                    select_slot_timer, slot);
+
+    select_slots[client_socket] = slot;
+    if (client_socket >= select_top)
+        select_top = client_socket + 1;
+    select_readers++;
+    return 0;
+}
+
+static inline void engine_select(void) {
+    int server_socket, client_socket, max_sd, sd;
+    fd_set readfds, writefds;  // Sets of socket descriptors
+    int activity;
+
+    // Non-blocking, so a burst of connects can be accepted in one go
+    server_socket = engine_listen(SOCK_NONBLOCK, 0);
+    if (server_socket < 0) {
+        perror("Failed to set up listener");
+        exit(EXIT_FAILURE);
+    }
+
+    if (timer_wheel_init(&select_wheel) < 0) {
+        perror("Failed to create timer");
+        exit(EXIT_FAILURE);
+    }
+    if (offload_port_init(&select_port) < 0) {
+        perror("Failed to create offload port");
+        exit(EXIT_FAILURE);
+    }
+
+    log_info("Server listening on port %d...", engine_config.port);
+    handoff_ready();
+
+    while (1) {
+        // Clear the socket sets
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+
+        // Add server socket to set, and the hot restart signal while it
+        // is still ours
+        max_sd = -1;
+        if (server_socket >= 0) {
+            FD_SET(server_socket, &readfds);
+            max_sd = server_socket;
+            if (handoff_stop_fd() >= 0) {
+                FD_SET(handoff_stop_fd(), &readfds);
+                if (handoff_stop_fd() > max_sd)
+                    max_sd = handoff_stop_fd();
+            }
+        }
+
+        // Add the timer wheel so parked replies and deadlines go out on time
+        FD_SET(select_wheel.timer_fd, &readfds);
+        if (select_wheel.timer_fd > max_sd)
+            max_sd = select_wheel.timer_fd;
+
+        // And the offload port, so replies go out as soon as their work is done
+        FD_SET(select_port.event_fd, &readfds);
+        if (select_port.event_fd > max_sd)
+            max_sd = select_port.event_fd;
+
+        // Add each client for what its phase waits on: input while its
+        // request comes in, room in the socket while output is queued
+        for (sd = 0; sd < select_top; sd++) {
+            select_slot_t *slot = select_slots[sd];
+
+            if (slot == NULL)
+                continue;
+            if (slot->phase == SELECT_HEADERS ||
+                (slot->phase == SELECT_BODY && slot->out.bytes < SELECT_OUT_HIGH_WATER))
+                FD_SET(sd, &readfds);
+            if (slot->phase == SELECT_WRITING ||
+                (slot->phase == SELECT_BODY && slot->result.route == ROUTE_ECHO &&
+                 slot->response.remaining + slot->out.bytes > 0))
+                FD_SET(sd, &writefds);
+
+            // Get the highest socket number
+            if (sd > max_sd)
+                max_sd = sd;
+        }
+        select_top = max_sd + 1;
+
+        // Wait for an activity on one of the sockets, with no timeout
+        activity = select(max_sd + 1, &readfds, &writefds, NULL, NULL);
+
+        if ((activity < 0) && (errno != EINTR)) {
+            log_error("Select error: %s", strerror(errno));
+        }
+        if (activity < 0)
+            continue;
+
+        // Send the parked replies whose delay is over, and close the slots
+        // past their deadline
+        if (FD_ISSET(select_wheel.timer_fd, &readfds)) {
+            timer_wheel_expire(&select_wheel);
+        }
+
+        // Send the offloaded replies whose work is done
+        if (FD_ISSET(select_port.event_fd, &readfds))
+            offload_port_ready(&select_port);
+
+        // Handed off: the successor accepts from here on, while the
+        // clients already in the set are still served
+        if (server_socket >= 0 && handoff_stop_fd() >= 0 &&
+            FD_ISSET(handoff_stop_fd(), &readfds)) {
+            close(server_socket);
+            server_socket = -1;
+        }
+
+        // Check if something happened on the server socket (incoming
+        // connections). Clients are non-blocking too: a slow one must not
+        // hold up the loop.
+        if (server_socket >= 0 && FD_ISSET(server_socket, &readfds)) {
+            while ((client_socket = admission_accept(server_socket,
+                                                     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                // main() raises the descriptor limit past what an fd_set
+                // holds; a descriptor beyond it cannot be watched at all
+                if (client_socket >= FD_SETSIZE) {
+                    log_warn("Descriptor %d is past FD_SETSIZE, turning client away", client_socket);
+                    admission_release(client_socket);
+                    admission_reject(client_socket);
+                    continue;
+                }
+
+                // No room for another client reading its request: turn it
+                // away as if over a cap
+                if (select_readers >= SELECT_MAX_CLIENTS) {
+                    admission_release(client_socket);
+                    admission_reject(client_socket);
+                    continue;
+                }
+
+                if (select_slot_open(client_socket) < 0) {
+                    admission_close(client_socket);
+                    continue;
+                }
+                log_debug("Adding client socket %d to set", client_socket);
+                log_info("New client connected...");
+                metrics_connection_opened();
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("Failed to accept client: %s", strerror(errno));
+        }
+
+        // Move each ready client on. One accepted above may have taken a
+        // descriptor whose old client was ready; it finds nothing to do.
+        for (sd = 0; sd <= max_sd && sd < select_top; sd++) {
+            if (select_slots[sd] != NULL && (FD_ISSET(sd, &readfds) || FD_ISSET(sd, &writefds)))
+                select_slot_ready(select_slots[sd]);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef ENGINE_THREAD_H
+#define ENGINE_THREAD_H
+
+// Thread-per-connection engine, with the threads as coroutines (coro.h):
+// every client gets its own straight-line handler, multiplexed M:N over a
+// few scheduler threads. Sockets are non-blocking; every read, write and
+// the simulated workload park the coroutine rather than the thread under
+// it.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+#include "coro.h"
+#include "engine.h"
+#include "http_serve.h"
+#include "log.h"
+#include "metrics.h"
+#include "slab.h"
+#include "trace.h"
+
+// A connection handed from the acceptor to its coroutine, which frees it.
+// Both it and its buffer come from the slab allocator.
+typedef struct {
+    int socket;
+    char *buffer;               // BUFFER_SIZE bytes
+    trace_t trace;              // Accepted and spawned, so far
+} client_t;
+
+// Give a client's memory back once its coroutine is done with it
+static inline void client_free(client_t *client) {
+    slab_free(client->buffer, BUFFER_SIZE);
+    slab_free(client, sizeof(*client));
+}
+
+// Sit out the workload, or the handler's blocking work on the offload
+// executor, with only this coroutine parked
+static inline void thread_wait(reply_t *reply) {
+    if (reply->result.work == NULL)
+        coro_sleep(reply->result.delay_ms);
+    else if (coro_offload(reply->result.work, reply->result.work_arg) < 0)
+        reply_busy(reply);
+    reply_finish(reply);
+}
+
+// Coroutine body: serve the client, then free it
+static inline void thread_client(void *arg) {
+    client_t *client = (client_t *)arg;
+
+    trace_mark(&client->trace, TRACE_DEQUEUE);
+    serve_client(client->socket, client->buffer, BUFFER_SIZE, &client->trace, thread_wait);
+    client_free(client);
+}
+
+static inline void engine_thread(void) {
+    int server_socket, client_socket;
+
+    // Handlers run as coroutines on a few scheduler threads instead of a
+    // thread each
+    if (coro_runtime_start(engine_threads(0)) < 0) {
+        perror("Failed to start coroutine schedulers");
+        exit(EXIT_FAILURE);
+    }
+    metrics_gauge("coroutines", "Handler coroutines running or parked.", coro_live);
+
+    // Non-blocking, so a burst of connects can be accepted in one go
+    server_socket = engine_listen(SOCK_NONBLOCK, 0);
+    if (server_socket < 0) {
+        perror("Failed to set up listener");
+        exit(EXIT_FAILURE);
+    }
+
+    log_info("Server listening on port %d...", engine_config.port);
+    handoff_ready();
+
+    while (1) {
+        // Wait for connects, then take every one that is pending,
+        // non-blocking for their coroutines
+        engine_wait_accept(server_socket);
+
+        while ((client_socket = admission_accept(server_socket,
+                                                 SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            log_info("New client connected...");
+            metrics_connection_opened();
+
+            // Spawn a coroutine to handle the client request
+            client_t *client = slab_zalloc(sizeof(client_t));
+            if (client == NULL || (client->buffer = slab_alloc(BUFFER_SIZE)) == NULL) {
+                log_error("Failed to allocate client");
+                if (client != NULL)
+                    slab_free(client, sizeof(client_t));
+                metrics_connection_closed();
+                admission_close(client_socket);
+                continue;
+            }
+            client->socket = client_socket;
+            trace_begin(&client->trace, client_socket, 1);
+            trace_mark(&client->trace, TRACE_ENQUEUE);
+
+            if (coro_spawn(thread_client, client) < 0) {
+                log_error("Failed to spawn coroutine");
+                client_free(client);
+                metrics_connection_closed();
+                admission_close(client_socket);
+            }
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            log_error("Failed to accept client: %s", strerror(errno));
+    }
+}
+
+#endif
@@ -0,0 +1,613 @@
+#ifndef ENGINE_URING_H
+#define ENGINE_URING_H
+
+// io_uring engine: one thread submits every accept, receive, send and
+// close through a ring (raw syscalls, no liburing), with a multishot
+// accept and provided receive buffers, driving the connection state
+// machine in http_conn.h. Offloaded work completes to an eventfd that is
+// read through the ring like the timer. Needs Linux 6.0 or newer.
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "admission.h"
+#include "engine.h"
+#include "http_conn.h"
+
+#define RING_ENTRIES 4096
+#define RECV_BUFFERS 1024        // Provided buffer ring size, power of two
+#define RECV_BUFFER_SIZE 4096
+#define RECV_GROUP 0
+
+// Operation tag kept in the low bits of user_data, next to the conn
+// pointer; conns come from the slab, aligned to at least 64 bytes
+enum {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_SEND,
+    OP_CLOSE,
+    OP_TIMER,
+    OP_SHUTDOWN,
+    OP_HANDOFF,
+    OP_CANCEL,
+    OP_OFFLOAD
+};
+#define OP_MASK 15ULL
+
+// Minimal io_uring wrapper over the raw syscalls (no liburing dependency)
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;           // Local tail, published on submit
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    unsigned short buf_tail;
+    char *buf_base;
+} ring_t;
+
+static ring_t main_ring;
+static timer_wheel_t ring_wheel;
+static uint64_t timer_ticks;    // Target of the timerfd read
+static offload_port_t ring_port;
+static uint64_t offload_count;  // Target of the offload eventfd read
+
+static inline int ring_setup(ring_t *ring, unsigned entries) {
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq_ptr, *cq_ptr;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0 && errno == EINVAL) {
+        // Older kernels reject the scheduling hints; they are optional
+        memset(&p, 0, sizeof(p));
+        ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (ring->fd < 0)
+        return -1;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size)
+            sq_size = cq_size;
+        cq_size = sq_size;
+    }
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        return -1;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            return -1;
+    }
+
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return -1;
+
+    ring->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+
+    ring->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+    return 0;
+}
+
+// Hand a buffer back to the kernel so a later recv can select it
+static inline void buf_ring_recycle(ring_t *ring, unsigned short bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (RECV_BUFFERS - 1)];
+
+    buf->addr = (uintptr_t)(ring->buf_base + (size_t)bid * RECV_BUFFER_SIZE);
+    buf->len = RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Register the provided buffer ring that recv completions draw from
+static inline int buf_ring_setup(ring_t *ring) {
+    struct io_uring_buf_reg reg;
+
+    ring->buf_ring = mmap(NULL, RECV_BUFFERS * sizeof(struct io_uring_buf),
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED)
+        return -1;
+
+    ring->buf_base = malloc((size_t)RECV_BUFFERS * RECV_BUFFER_SIZE);
+    if (ring->buf_base == NULL)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buf_ring;
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid = RECV_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    ring->buf_tail = 0;
+    for (unsigned short bid = 0; bid < RECV_BUFFERS; bid++)
+        buf_ring_recycle(ring, bid);
+
+    return 0;
+}
+
+// Publish queued SQEs and optionally wait; this is the only syscall per batch
+static inline int ring_enter(ring_t *ring, unsigned wait_nr) {
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+static inline struct io_uring_sqe *ring_get_sqe(ring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    // Submission queue full: flush what we have before queueing more
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        if (ring_enter(ring, 0) < 0) {
+            perror("Failed to submit to io_uring");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sq_array[ring->sqe_tail & ring->sq_mask] = ring->sqe_tail & ring->sq_mask;
+    ring->sqe_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// One multishot accept keeps posting a CQE per new connection
+static inline void queue_accept(ring_t *ring, int server_socket) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+// Hot restart: a one-shot poll on the handoff signal (handoff.h)
+static inline void queue_handoff_poll(ring_t *ring) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = handoff_stop_fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = OP_HANDOFF;
+}
+
+// Handed off: cancel the multishot accept and leave the listener to the
+// successor; the connections already open are still served
+static inline void stop_accepting(ring_t *ring, int *server_socket) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = OP_ACCEPT;
+    sqe->user_data = OP_CANCEL;
+    close(*server_socket);
+    *server_socket = -1;
+}
+
+// Receive into whichever provided buffer the kernel picks
+static inline void queue_recv(ring_t *ring, conn_t *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = conn_in_space(conn) < RECV_BUFFER_SIZE ? conn_in_space(conn) : RECV_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = (uintptr_t)conn | OP_RECV;
+}
+
+static inline void ring_conn_deadline_expired(void *data);
+
+// Send the whole response, and the streamed output queued behind it, as
+// one sendmsg over their iovecs. MSG_WAITALL makes the kernel retry short
+// sends, so the completion means everything is out. On the last response
+// of a connection the close is linked behind the send, with no round trip
+// back.
+static inline void queue_send(ring_t *ring, conn_t *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+    trace_mark_once(&conn->trace, TRACE_HANDLER_END);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)conn_out_msghdr(conn);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)conn | OP_SEND;
+
+    // A client that stops reading gets the write deadline to take it all
+    timer_wheel_add(&ring_wheel, &conn->timer, deadline_config.write_ms,
+                    ring_conn_deadline_expired, conn);
+
+    if (!conn_last_response(conn))
+        return;
+
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = ring_get_sqe(ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = conn->fd;
+    sqe->user_data = (uintptr_t)conn | OP_CLOSE;
+}
+
+static inline void queue_close(ring_t *ring, conn_t *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+    // No timer may act on the fd once its close is in flight
+    timer_cancel(&conn->timer);
+
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = conn->fd;
+    sqe->user_data = (uintptr_t)conn | OP_CLOSE;
+}
+
+// Shut the socket down so its outstanding recv completes and closes it
+static inline void queue_shutdown(ring_t *ring, conn_t *conn) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = conn->fd;
+    sqe->len = SHUT_RDWR;
+    sqe->user_data = (uintptr_t)conn | OP_SHUTDOWN;
+}
+
+// Read the wheel's timerfd through the ring, so timers cost no extra syscall
+static inline void queue_timer_read(ring_t *ring) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring_wheel.timer_fd;
+    sqe->addr = (uintptr_t)&timer_ticks;
+    sqe->len = sizeof(timer_ticks);
+    sqe->user_data = OP_TIMER;
+}
+
+// Read the offload port's eventfd through the ring as well
+static inline void queue_offload_read(ring_t *ring) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring_port.event_fd;
+    sqe->addr = (uintptr_t)&offload_count;
+    sqe->len = sizeof(offload_count);
+    sqe->user_data = OP_OFFLOAD;
+}
+
+static inline void conn_advance(ring_t *ring, conn_t *conn);
+
+// Timer callback for a parked connection: its delay is over, send the response
+static inline void ring_conn_resume(void *data) {
+    conn_t *conn = (conn_t *)data;
+
+    conn->state = CONN_WRITING;
+    conn_advance(&main_ring, conn);
+}
+
+// Offload callback: the work is done, send the response
+static inline void ring_conn_offloaded(void *data) {
+    conn_t *conn = (conn_t *)data;
+
+    conn_offload_done(conn);
+    conn_advance(&main_ring, conn);
+}
+
+// Timer callback for a connection past its deadline, or idle for too long:
+// the shutdown completes whatever it has in flight, which then closes it
+static inline void ring_conn_deadline_expired(void *data) {
+    conn_t *conn = (conn_t *)data;
+
+    conn_timed_out(conn);
+    queue_shutdown(&main_ring, conn);
+}
+
+// Drive the state machine after new input, a timer or a completed send.
+// On a persistent connection this serves every pipelined request already
+// in the input buffer before asking the kernel for more.
+static inline void conn_advance(ring_t *ring, conn_t *conn) {
+    if (conn->state == CONN_READING) {
+        if (!conn_request_complete(conn)) {
+            // Wait for more bytes until the deadline, or the idle limit
+            conn_in_release(conn);
+            timer_wheel_add(&ring_wheel, &conn->timer, conn_read_timeout(conn),
+                            ring_conn_deadline_expired, conn);
+            queue_recv(ring, conn);
+            return;
+        }
+
+        timer_cancel(&conn->timer);
+        conn->state = CONN_HANDLING;
+        handle_request(conn);
+    }
+
+    if (conn->state == CONN_BODY) {
+        conn_body(conn);
+        // Everything received is used up: send what the stream has queued
+        // from it, then come back for the next piece
+        if (conn->state == CONN_BODY && conn->out.bytes > 0)
+            conn->state = CONN_WRITING;
+        if (conn->state == CONN_BODY) {
+            // Wait for the next piece
+            conn_in_release(conn);
+            timer_wheel_add(&ring_wheel, &conn->timer, conn_read_timeout(conn),
+                            ring_conn_deadline_expired, conn);
+            queue_recv(ring, conn);
+            return;
+        }
+    }
+
+    if (conn->state == CONN_CLOSED) {
+        queue_close(ring, conn);
+        return;
+    }
+
+    // No recv is outstanding while the work is out, so nothing else can
+    // close the connection before it is back
+    if (conn->state == CONN_WAITING && conn->work != NULL)
+        conn_offload(conn, ring_conn_offloaded);
+
+    if (conn->state == CONN_WAITING) {
+        if (conn->work == NULL)
+            timer_wheel_add(&ring_wheel, &conn->timer, conn->delay_ms, ring_conn_resume, conn);
+        return;
+    }
+
+    if (conn->state == CONN_WRITING)
+        queue_send(ring, conn);
+}
+
+static inline void handle_accept(ring_t *ring, int server_socket, struct io_uring_cqe *cqe) {
+    // Cancelled after a handoff; nothing more to accept
+    if (server_socket < 0 && cqe->res == -ECANCELED)
+        return;
+
+    // The multishot accept was terminated; re-arm it
+    if (!(cqe->flags & IORING_CQE_F_MORE) && server_socket >= 0)
+        queue_accept(ring, server_socket);
+
+    // Out of descriptors: turn away what is queued rather than leave it
+    // there for the re-armed accept to fail on again
+    if ((cqe->res == -EMFILE || cqe->res == -ENFILE) && server_socket >= 0) {
+        while (admission_shed(server_socket) == 0)
+            ;
+        return;
+    }
+
+    if (cqe->res < 0) {
+        log_error("Failed to accept client: %s", strerror(-cqe->res));
+        return;
+    }
+
+    // The multishot accept leaves no address behind; admission looks the
+    // peer up itself if it needs it
+    if (admission_admit(cqe->res, NULL) < 0)
+        return;
+
+    conn_t *conn = slab_zalloc(sizeof(conn_t));
+    if (conn == NULL) {
+        log_error("Failed to allocate connection: %s", strerror(errno));
+        admission_close(cqe->res);
+        return;
+    }
+
+    metrics_connection_opened();
+    conn->fd = cqe->res;
+    conn->state = CONN_READING;
+    conn->wheel = &ring_wheel;
+    conn->port = &ring_port;
+    // There is no sendfile opcode: files of any size go out from their
+    // mapping as part of the sendmsg
+    conn->sendfile = 0;
+    conn_start_deadline(conn);
+    trace_begin(&conn->trace, conn->fd, 1);
+    conn_advance(ring, conn);
+}
+
+static inline void handle_recv(ring_t *ring, conn_t *conn, struct io_uring_cqe *cqe) {
+    if (cqe->res == -ENOBUFS) {
+        // Every provided buffer is in flight; try again on the next batch
+        queue_recv(ring, conn);
+        return;
+    }
+    if (cqe->res <= 0) {
+        if (cqe->res < 0)
+            log_error("Failed to read from client: %s", strerror(-cqe->res));
+        queue_close(ring, conn);
+        return;
+    }
+
+    // Copy out of the provided buffer and give it straight back. The recv
+    // length was capped at the free space, so nothing is dropped here.
+    // The connection only holds an input buffer while it has input.
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (conn_in_acquire(conn) < 0) {
+        log_error("Failed to allocate input buffer");
+        buf_ring_recycle(ring, bid);
+        queue_close(ring, conn);
+        return;
+    }
+    memcpy(conn->in + conn->in_len, ring->buf_base + (size_t)bid * RECV_BUFFER_SIZE, cqe->res);
+    conn->in_len += cqe->res;
+    buf_ring_recycle(ring, bid);
+
+    conn_advance(ring, conn);
+}
+
+static inline void handle_send(ring_t *ring, conn_t *conn, struct io_uring_cqe *cqe) {
+    timer_cancel(&conn->timer);
+
+    // The last response has a close linked behind it; that completion
+    // (or its cancellation, if the send failed) releases the connection
+    if (conn_last_response(conn)) {
+        if (cqe->res < 0)
+            log_error("Failed to write to client: %s", strerror(-cqe->res));
+        else
+            conn_response_sent(conn);
+        return;
+    }
+
+    if (cqe->res < 0) {
+        log_error("Failed to write to client: %s", strerror(-cqe->res));
+        queue_close(ring, conn);
+        return;
+    }
+
+    conn_out_advance(conn, cqe->res);
+    conn_finish_request(conn);
+    conn_advance(ring, conn);
+}
+
+static inline void handle_close(conn_t *conn, struct io_uring_cqe *cqe) {
+    // The send failed and cancelled the linked close; close it here instead
+    if (cqe->res == -ECANCELED)
+        close(conn->fd);
+
+    // Releasing after the close is safe here: the accept that could reuse
+    // the descriptor completes behind this, on the same thread
+    admission_release(conn->fd);
+
+    timer_cancel(&conn->timer);
+    conn_release(conn);
+    slab_free(conn, sizeof(conn_t));
+}
+
+static inline void engine_uring(void) {
+    int server_socket;
+
+    server_socket = engine_listen(0, 0);
+    if (server_socket < 0) {
+        perror("Failed to set up listener");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ring_setup(&main_ring, RING_ENTRIES) < 0) {
+        perror("Failed to set up io_uring");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    if (buf_ring_setup(&main_ring) < 0) {
+        perror("Failed to register provided buffers");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    if (timer_wheel_init(&ring_wheel) < 0) {
+        perror("Failed to create timer");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    if (offload_port_init(&ring_port) < 0) {
+        perror("Failed to create offload port");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    log_info("Server listening on port %d...", engine_config.port);
+    handoff_ready();
+
+    queue_accept(&main_ring, server_socket);
+    queue_timer_read(&main_ring);
+    queue_offload_read(&main_ring);
+    if (handoff_stop_fd() >= 0)
+        queue_handoff_poll(&main_ring);
+
+    while (1) {
+        // Submit everything queued by the previous batch and wait for more
+        if (ring_enter(&main_ring, 1) < 0) {
+            log_error("Failed to enter io_uring: %s", strerror(errno));
+            continue;
+        }
+
+        unsigned head = *main_ring.cq_head;
+        unsigned tail = __atomic_load_n(main_ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &main_ring.cqes[head & main_ring.cq_mask];
+            conn_t *conn = (conn_t *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+
+            switch (cqe->user_data & OP_MASK) {
+            case OP_ACCEPT:
+                handle_accept(&main_ring, server_socket, cqe);
+                break;
+            case OP_RECV:
+                handle_recv(&main_ring, conn, cqe);
+                break;
+            case OP_SEND:
+                handle_send(&main_ring, conn, cqe);
+                break;
+            case OP_CLOSE:
+                handle_close(conn, cqe);
+                break;
+            case OP_SHUTDOWN:
+                // The outstanding recv completes with 0 and closes the conn
+                break;
+            case OP_HANDOFF:
+                stop_accepting(&main_ring, &server_socket);
+                break;
+            case OP_CANCEL:
+                break;
+            case OP_TIMER:
+                if (cqe->res == sizeof(timer_ticks))
+                    timer_wheel_advance(&ring_wheel, timer_ticks);
+                queue_timer_read(&main_ring);
+                break;
+            case OP_OFFLOAD:
+                offload_drain(&ring_port);
+                queue_offload_read(&main_ring);
+                break;
+            }
+        }
+
+        __atomic_store_n(main_ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+// Hot restart. With --handoff=PATH the server listens for its successor on
+// the Unix socket PATH. A new server started with the same PATH connects
+// there first and is sent every listening socket over SCM_RIGHTS. It
+// serves them as they are, so connections queued in their backlogs wait
+// for it instead of being refused. The old server stops accepting and
+// drains: connections still open finish their current request (keep-alive
+// ends with it), and the process exits once none are left or the drain
+// timeout passes.
+//
+// Engines learn that they must stop accepting from handoff_stop_fd(), an
+// eventfd that stays readable from then on. They remove the listener from
+// whatever waits on it before they close it: the listening socket is
+// shared with the successor, so closing it here does not take it out of an
+// epoll set.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "admission.h"
+#include "log.h"
+
+#define HANDOFF_MAX_LISTENERS 64    // Listeners passed on in one message
+#define HANDOFF_POLL_MS 100         // How often the drain checks what is left
+
+#define HANDOFF_OPTSTRING "H:T:"
+#define HANDOFF_OPTIONS                                         \
+    { "handoff",       required_argument, NULL, 'H' },          \
+    { "drain-timeout", required_argument, NULL, 'T' }
+#define HANDOFF_USAGE                                                           \
+    "  --handoff=PATH    take the listeners over from the server on the Unix\n" \
+    "                    socket PATH, if there is one, and hand them on to the\n" \
+    "                    next server started with the same PATH\n"              \
+    "  --drain-timeout=S once handed off, wait up to S seconds for open\n"      \
+    "                    connections before exiting (default 30)\n"
+
+static struct {
+    const char *path;               // NULL when hot restart is off
+    int drain_s;
+    int control_fd;                 // Where the successor connects
+    int stop_fd;                    // Readable once the listeners are handed off
+    int draining;
+    int inherited[HANDOFF_MAX_LISTENERS];   // From the predecessor, not yet taken
+    int num_inherited;
+    int listeners[HANDOFF_MAX_LISTENERS];   // Served here, to pass on
+    int num_listeners;
+    pthread_mutex_t lock;
+} handoff = {
+    .drain_s = 30,
+    .control_fd = -1,
+    .stop_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Handle one of HANDOFF_OPTIONS. Returns 1 if c was one of them, 0 if it
+// is the caller's.
+static inline int handoff_option(int c, const char *arg) {
+    switch (c) {
+    case 'H':
+        handoff.path = arg;
+        return 1;
+    case 'T':
+        handoff.drain_s = atoi(arg);
+        return 1;
+    }
+    return 0;
+}
+
+static inline int handoff_enabled(void) {
+    return handoff.path != NULL;
+}
+
+static inline int handoff_draining(void) {
+    return __atomic_load_n(&handoff.draining, __ATOMIC_RELAXED);
+}
+
+// The eventfd engines wait on alongside their listeners, or -1 when hot
+// restart is off
+static inline int handoff_stop_fd(void) {
+    return handoff.stop_fd;
+}
+
+static inline int handoff_fill_addr(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(handoff.path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, handoff.path);
+    return 0;
+}
+
+// Ask the server on PATH for its listeners. Having nobody there is not an
+// error: this is the first server.
+static inline int handoff_receive(void) {
+    struct sockaddr_un addr;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_LISTENERS)];
+    } control;
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t n;
+    int fd;
+
+    if (handoff_fill_addr(&addr) < 0)
+        return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return err == ENOENT || err == ECONNREFUSED ? 0 : -1;
+    }
+
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    close(fd);
+    if (n <= 0) {
+        errno = n == 0 ? EPROTO : errno;
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        handoff.num_inherited = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(handoff.inherited, CMSG_DATA(cmsg), handoff.num_inherited * sizeof(int));
+    }
+    log_info("Took over %d listener(s) from %s", handoff.num_inherited, handoff.path);
+    return 0;
+}
+
+// Take over from a predecessor, if one is serving on PATH. Called once from
+// main() before the engine starts.
+static inline int handoff_init(void) {
+    if (!handoff_enabled())
+        return 0;
+
+    handoff.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (handoff.stop_fd < 0)
+        return -1;
+    return handoff_receive();
+}
+
+// An inherited listener in place of a new one, switched to flags
+// (SOCK_NONBLOCK or not), or -1 if none are left
+static inline int handoff_take(int flags) {
+    int fd = -1, fl;
+
+    pthread_mutex_lock(&handoff.lock);
+    if (handoff.num_inherited > 0)
+        fd = handoff.inherited[--handoff.num_inherited];
+    pthread_mutex_unlock(&handoff.lock);
+
+    if (fd >= 0 && (fl = fcntl(fd, F_GETFL)) >= 0)
+        fcntl(fd, F_SETFL, flags & SOCK_NONBLOCK ? fl | O_NONBLOCK : fl & ~O_NONBLOCK);
+    return fd;
+}
+
+// Record a listener this server serves, so it can be passed on
+static inline void handoff_register(int fd) {
+    pthread_mutex_lock(&handoff.lock);
+    if (handoff.num_listeners < HANDOFF_MAX_LISTENERS)
+        handoff.listeners[handoff.num_listeners++] = fd;
+    pthread_mutex_unlock(&handoff.lock);
+}
+
+// Send every listener to the successor on fd, all in one message
+static inline int handoff_send(int fd) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_LISTENERS)];
+    } control;
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * handoff.num_listeners),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * handoff.num_listeners);
+    memcpy(CMSG_DATA(cmsg), handoff.listeners, sizeof(int) * handoff.num_listeners);
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+// Wait for a successor, hand it the listeners, then drain and exit
+static inline void *handoff_thread(void *arg) {
+    uint64_t one = 1;
+    time_t deadline;
+    unsigned left;
+    (void)arg;
+
+    while (1) {
+        int fd = accept4(handoff.control_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                log_error("Failed to accept successor: %s", strerror(errno));
+            continue;
+        }
+        if (handoff_send(fd) == 0) {
+            close(fd);
+            break;
+        }
+        log_error("Failed to hand off listeners: %s", strerror(errno));
+        close(fd);
+    }
+
+    // The successor unlinks PATH and binds its own; this one is done
+    close(handoff.control_fd);
+    __atomic_store_n(&handoff.draining, 1, __ATOMIC_RELAXED);
+    if (write(handoff.stop_fd, &one, sizeof(one)) < 0)
+        log_error("Failed to stop accepting: %s", strerror(errno));
+
+    deadline = time(NULL) + handoff.drain_s;
+    while ((left = admission_open()) > 0 &&
+           time(NULL) < deadline) {
+        struct timespec interval = { 0, HANDOFF_POLL_MS * 1000000L };
+        nanosleep(&interval, NULL);
+    }
+    if (left > 0)
+        log_warn("Drain timed out with %u connection(s) open", left);
+    log_info("Handed off, exiting");
+    exit(EXIT_SUCCESS);
+    return NULL;
+}
+
+// Called by an engine once its listeners are set up: listeners inherited
+// and not taken are closed, and from here on a successor may take over.
+static inline void handoff_ready(void) {
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    if (!handoff_enabled())
+        return;
+
+    pthread_mutex_lock(&handoff.lock);
+    while (handoff.num_inherited > 0)
+        close(handoff.inherited[--handoff.num_inherited]);
+    pthread_mutex_unlock(&handoff.lock);
+
+    // Replace whatever is on PATH: a predecessor's socket, which it no
+    // longer accepts on, or a stale one left by a crash
+    if (handoff_fill_addr(&addr) < 0 ||
+        (handoff.control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        (unlink(handoff.path) < 0 && errno != ENOENT) ||
+        bind(handoff.control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(handoff.control_fd, 1) < 0 ||
+        pthread_create(&thread, NULL, handoff_thread, NULL) != 0) {
+        log_error("Failed to listen for a successor on %s: %s", handoff.path, strerror(errno));
+        return;
+    }
+    pthread_detach(thread);
+    log_info("Hot restart: a successor can take over on %s", handoff.path);
+}
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef HTTP_BODY_H
+#define HTTP_BODY_H
+
+// Streaming request body decoder for Content-Length and chunked bodies.
+//
+// The decoder works on whatever part of the body is in the buffer and
+// leaves the decoded bytes at the front of that same buffer (decoded data
+// is never longer than its encoding), so a body of any size passes
+// through a fixed buffer and is never held whole. It stops exactly at the
+// end of the body; anything after it belongs to the next request.
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "http_parser.h"
+#include "io_wait.h"
+
+#define HTTP_CHUNK_SIZE_DIGITS 15   // Chunk sizes up to 2^60
+#define HTTP_TRAILER_MAX 8192       // Total trailer bytes accepted
+
+typedef enum {
+    BODY_FIXED,                     // Content-Length bytes left in remaining
+    BODY_CHUNK_SIZE,
+    BODY_CHUNK_EXT,                 // Extensions after the size, ignored
+    BODY_CHUNK_SIZE_LF,
+    BODY_CHUNK_DATA,
+    BODY_CHUNK_DATA_CR,
+    BODY_CHUNK_DATA_LF,
+    BODY_TRAILER,
+    BODY_TRAILER_LF,
+    BODY_DONE
+} http_body_state_t;
+
+typedef struct {
+    http_body_state_t state;
+    uint64_t remaining;             // Bytes left in the body or the current chunk
+    uint64_t total;                 // Decoded bytes so far
+    int digits;                     // Of the chunk size being read
+    size_t line_len;                // Of the trailer line being read
+    size_t trailer_len;
+} http_body_t;
+
+// Handler callback for each decoded piece of a body
+typedef void (*http_body_cb)(void *ctx, const char *data, size_t len);
+
+static inline void http_body_init(http_body_t *body, const http_request_t *req) {
+    memset(body, 0, sizeof(*body));
+    if (req->chunked)
+        body->state = BODY_CHUNK_SIZE;
+    else if (req->content_length > 0) {
+        body->state = BODY_FIXED;
+        body->remaining = req->content_length;
+    } else {
+        body->state = BODY_DONE;
+    }
+}
+
+static inline int http_body_done(const http_body_t *body) {
+    return body->state == BODY_DONE;
+}
+
+static inline int http_hex_digit(char ch) {
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+        return (ch | 0x20) - 'a' + 10;
+    return -1;
+}
+
+// Decode buf[0..len) in place. The decoded bytes end up in buf[0..*out).
+// Returns how many input bytes were used - all of them unless the body
+// ended inside the buffer - or HTTP_PARSE_ERROR for broken chunk framing.
+static inline long http_body_decode(http_body_t *body, char *buf, size_t len, size_t *out) {
+    size_t in = 0;
+
+    *out = 0;
+    while (in < len && body->state != BODY_DONE) {
+        char ch = buf[in];
+        int digit;
+
+        switch (body->state) {
+        case BODY_FIXED:
+        case BODY_CHUNK_DATA: {
+            size_t n = len - in < body->remaining ? len - in : body->remaining;
+
+            memmove(buf + *out, buf + in, n);
+            *out += n;
+            in += n;
+            body->total += n;
+            body->remaining -= n;
+            if (body->remaining == 0)
+                body->state = body->state == BODY_FIXED ? BODY_DONE : BODY_CHUNK_DATA_CR;
+            continue;
+        }
+        case BODY_CHUNK_SIZE:
+            if ((digit = http_hex_digit(ch)) >= 0) {
+                if (++body->digits > HTTP_CHUNK_SIZE_DIGITS)
+                    return HTTP_PARSE_ERROR;
+                body->remaining = body->remaining * 16 + digit;
+            } else if (body->digits == 0) {
+                return HTTP_PARSE_ERROR;
+            } else if (ch == ';' || ch == ' ' || ch == '\t') {
+                body->state = BODY_CHUNK_EXT;
+            } else if (ch == '\r') {
+                body->state = BODY_CHUNK_SIZE_LF;
+            } else {
+                return HTTP_PARSE_ERROR;
+            }
+            break;
+        case BODY_CHUNK_EXT:
+            if (ch == '\r')
+                body->state = BODY_CHUNK_SIZE_LF;
+            break;
+        case BODY_CHUNK_SIZE_LF:
+            if (ch != '\n')
+                return HTTP_PARSE_ERROR;
+            // The zero-size chunk is the last; trailer fields may follow
+            body->state = body->remaining > 0 ? BODY_CHUNK_DATA : BODY_TRAILER;
+            break;
+        case BODY_CHUNK_DATA_CR:
+            if (ch != '\r')
+                return HTTP_PARSE_ERROR;
+            body->state = BODY_CHUNK_DATA_LF;
+            break;
+        case BODY_CHUNK_DATA_LF:
+            if (ch != '\n')
+                return HTTP_PARSE_ERROR;
+            body->state = BODY_CHUNK_SIZE;
+            body->digits = 0;
+            break;
+        case BODY_TRAILER:
+            if (++body->trailer_len > HTTP_TRAILER_MAX)
+                return HTTP_PARSE_ERROR;
+            if (ch == '\r')
+                body->state = BODY_TRAILER_LF;
+            else
+                body->line_len++;
+            break;
+        case BODY_TRAILER_LF:
+            if (ch != '\n')
+                return HTTP_PARSE_ERROR;
+            // An empty line ends the trailer and the body
+            body->state = body->line_len == 0 ? BODY_DONE : BODY_TRAILER;
+            body->line_len = 0;
+            break;
+        case BODY_DONE:
+            break;
+        }
+        in++;
+    }
+
+    return in;
+}
+
+// Stream the body of a request read by http_read_request() into
+// buf[0..len): the body bytes already read behind the headers first, then
+// the rest from the socket through the same buffer. Each decoded piece
+// goes to cb, or nowhere if cb is NULL. Returns 0 once the whole body is
+// in, -1 on broken framing or if the client goes away first.
+static inline int http_read_body(int fd, char *buf, size_t size, size_t len,
+                                 const http_request_t *req, http_body_cb cb, void *ctx) {
+    http_body_t body;
+    size_t have = len - req->header_len;
+
+    http_body_init(&body, req);
+    memmove(buf, buf + req->header_len, have);
+
+    while (1) {
+        size_t out;
+        long used = http_body_decode(&body, buf, have, &out);
+
+        if (used < 0)
+            return -1;
+        if (out > 0 && cb != NULL)
+            cb(ctx, buf, out);
+        if (http_body_done(&body))
+            return 0;
+
+        // Everything buffered was used; read the next piece
+        ssize_t n;
+        do {
+            n = read(fd, buf, size);
+        } while (n < 0 && io_retry(fd, POLLIN));
+        if (n <= 0)
+            return -1;
+        have = n;
+    }
+}
+
+#endif
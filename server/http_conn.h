@@ -0,0 +1,485 @@
+#ifndef HTTP_CONN_H
+#define HTTP_CONN_H
+
+// Protocol side of a connection, shared by the event-driven engines
+// (engine_epoll.h, engine_uring.h) so they run identical handler logic and
+// differ only in how bytes move between the socket and these buffers.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deadline.h"
+#include "engine.h"
+#include "http_body.h"
+#include "http_parser.h"
+#include "log.h"
+#include "metrics.h"
+#include "offload.h"
+#include "out_chain.h"
+#include "response.h"
+#include "router.h"
+#include "slab.h"
+#include "static_files.h"
+#include "timer_wheel.h"
+#include "trace.h"
+
+#define KEEPALIVE_MAX_REQUESTS 100  // Requests served before forcing a close
+#define CONN_OUT_HIGH_WATER 65536   // Streamed output queued before the producer pauses
+#define CONN_OUT_IOV 16             // iovecs per send: the response's and the chain's
+
+// Connection life cycle: reading -> handling -> [body] -> [waiting] ->
+// writing, then back to reading for the next request on a persistent
+// connection, or closed. A request body streams through the input buffer
+// in BODY, piece by piece, to the handler's on_body callback (or nowhere);
+// a handler that answers as the body comes in queues its output on the
+// connection's chain (out_chain.h) and stays in BODY while the engine sends
+// it, until the chain reaches CONN_OUT_HIGH_WATER: then it waits in WRITING
+// for the chain to drain before taking more of the body. A handler that sets delay_ms parks the
+// connection in WAITING on the loop's timer wheel instead of sleeping; the
+// response is written when it fires. One that leaves blocking work waits
+// in WAITING too, while the work runs on the offload executor; the
+// connection comes back through the loop's offload port. The same timer enforces the
+// deadlines (deadline.h): header or idle in READING, body in BODY and
+// write in WRITING once the socket stops taking the response.
+typedef enum {
+    CONN_READING,
+    CONN_HANDLING,
+    CONN_BODY,
+    CONN_WAITING,
+    CONN_WRITING,
+    CONN_CLOSED
+} conn_state_t;
+
+typedef struct conn conn_t;
+
+// Gets each decoded piece of a request body, then (NULL, 0) at its end.
+// The data stays in the input buffer until the callback's response is out.
+typedef void (*conn_body_cb)(conn_t *conn, const char *data, size_t len);
+
+// Per-connection state, from the slab allocator. The input buffer may
+// hold several pipelined requests; req_len frames the headers of the one
+// at its front. It is taken from the slab only while there is input, so
+// an idle connection costs little more than this struct.
+struct conn {
+    int fd;
+    conn_state_t state;
+    char *in;                   // BUFFER_SIZE bytes, or NULL while empty
+    size_t in_len;
+    size_t req_len;             // Header block of the current request
+    http_request_t req;         // Parse state of the request at the front
+    http_body_t body_decoder;   // Its body, once the headers are handled
+    size_t body_used;           // Input the decoder used and not yet dropped
+    conn_body_cb on_body;
+    conn_state_t after_body;    // Where to go once the body is in
+    int streaming;              // Response pieces go out as the body comes in
+    response_t resp;            // Response being written
+    out_chain_t out;            // Streamed output, sent behind resp
+    struct iovec out_iov[CONN_OUT_IOV];
+    struct msghdr out_msg;      // Over out_iov; stays put while a send is in flight
+    arena_t arena;              // Request scratch the response may point into
+    static_file_t *file;        // Cached file the response is sending
+    off_t file_offset;          // Part of the file left for sendfile()
+    off_t file_end;
+    int sendfile;               // The engine can send files with sendfile()
+    int corked;                 // TCP_CORK is on for a pipelined batch
+    metrics_route_t route;      // What the response answered, for /metrics
+    int status;
+    uint64_t start_us;          // When the request was complete
+    int keep_alive;
+    unsigned requests;          // Requests completed on this connection
+    unsigned delay_ms;
+    offload_work_fn work;       // Blocking work the handler left, or NULL
+    unsigned work_arg;
+    int offloaded;              // The work is out; only its callback may free this
+    offload_job_t job;
+    uint64_t deadline;          // Header or body deadline, 0 while idle
+    trace_t trace;              // Of the request at the front
+    wheel_timer_t timer;
+    timer_wheel_t *wheel;       // Owning loop's wheel
+    offload_port_t *port;       // Owning loop's offload port
+};
+
+// Free space left in the input buffer, keeping room for the terminating NUL
+static inline size_t conn_in_space(const conn_t *conn) {
+    return BUFFER_SIZE - 1 - conn->in_len;
+}
+
+// Make sure there is an input buffer to read into; -1 if out of memory
+static inline int conn_in_acquire(conn_t *conn) {
+    if (conn->in == NULL && (conn->in = slab_alloc(BUFFER_SIZE)) == NULL)
+        return -1;
+    return 0;
+}
+
+// Give the input buffer back while there is nothing in it
+static inline void conn_in_release(conn_t *conn) {
+    if (conn->in_len == 0) {
+        slab_free(conn->in, BUFFER_SIZE);
+        conn->in = NULL;
+    }
+}
+
+// Drop n bytes from the front of the input buffer
+static inline void conn_drop_input(conn_t *conn, size_t n) {
+    if (n == 0)
+        return;
+    memmove(conn->in, conn->in + n, conn->in_len - n);
+    conn->in_len -= n;
+    conn->in[conn->in_len] = '\0';
+}
+
+// Let go of what the response was sending from
+static inline void conn_drop_body(conn_t *conn) {
+    arena_reset(&conn->arena);
+    out_chain_free(&conn->out);
+    if (conn->file != NULL)
+        static_file_put(conn->file);
+    conn->file = NULL;
+    conn->file_offset = 0;
+    conn->file_end = 0;
+}
+
+// Bytes queued to send: what is left of the response, then the chain.
+// A file range, if any, follows them.
+static inline size_t conn_out_pending(const conn_t *conn) {
+    return conn->resp.remaining + conn->out.bytes;
+}
+
+// Gather the queued bytes into one message, for a single writev-style send
+static inline struct msghdr *conn_out_msghdr(conn_t *conn) {
+    response_t *r = &conn->resp;
+    int n = r->iovcnt - r->iov_pos;
+
+    memcpy(conn->out_iov, r->iov + r->iov_pos, n * sizeof(struct iovec));
+    n += out_chain_iov(&conn->out, conn->out_iov + n, CONN_OUT_IOV - n);
+
+    memset(&conn->out_msg, 0, sizeof(conn->out_msg));
+    conn->out_msg.msg_iov = conn->out_iov;
+    conn->out_msg.msg_iovlen = n;
+    return &conn->out_msg;
+}
+
+// Account for n bytes sent from conn_out_msghdr()
+static inline void conn_out_advance(conn_t *conn, size_t n) {
+    size_t head = n < conn->resp.remaining ? n : conn->resp.remaining;
+
+    response_advance(&conn->resp, head);
+    out_chain_consume(&conn->out, n - head);
+}
+
+// Has a pipelined request come in behind the current one? Its response
+// will follow this one's at once.
+static inline int conn_pipelined(const conn_t *conn) {
+    return conn->keep_alive && conn->req_len > 0 && conn->in_len > conn->req_len;
+}
+
+// The response is out: count it and release its body
+static inline void conn_response_sent(conn_t *conn) {
+    metrics_request(conn->route, conn->status, conn->start_us);
+    trace_end(&conn->trace, conn->route, conn->status);
+    conn_drop_body(conn);
+}
+
+// The connection is going away, possibly in the middle of a response
+static inline void conn_release(conn_t *conn) {
+    conn_drop_body(conn);
+    slab_free(conn->in, BUFFER_SIZE);
+    conn->in = NULL;
+    metrics_connection_closed();
+}
+
+// Start the header deadline of a new connection; its first request is
+// timed from the connect
+static inline void conn_start_deadline(conn_t *conn) {
+    conn->deadline = io_now_ms() + deadline_config.header_ms;
+}
+
+// How long to wait for more input: until the deadline of the request under
+// way, whose header deadline starts with its first byte, or the idle limit
+// between requests
+static inline unsigned conn_read_timeout(conn_t *conn) {
+    if (conn->deadline == 0 && conn->in_len > 0)
+        conn->deadline = io_now_ms() + deadline_config.header_ms;
+    return conn->deadline != 0 ? deadline_left(conn->deadline) : deadline_config.idle_ms;
+}
+
+// A deadline passed. A request cut off part way is answered 408, unless
+// part of a streamed response may be out already; the engine then closes
+// the connection.
+static inline void conn_timed_out(conn_t *conn) {
+    if ((conn->state == CONN_READING && conn->in_len > 0) ||
+        (conn->state == CONN_BODY && !conn->streaming))
+        deadline_reject(conn->fd);
+    else if (conn->state == CONN_WRITING)
+        log_warn("Write deadline passed, closing client");
+}
+
+// Frame the request at the front of the buffer. It is complete once the
+// header block parses; the body, if any, streams afterwards. Malformed
+// requests and headers that can never fit the buffer are reported
+// complete so the handler can reject them.
+static inline int conn_request_complete(conn_t *conn) {
+    if (conn->in_len == 0)
+        return 0;
+    conn->in[conn->in_len] = '\0';
+
+    if (conn->req_len == 0) {
+        long status;
+
+        trace_mark_once(&conn->trace, TRACE_FIRST_BYTE);
+        status = http_parse_request(&conn->req, conn->in, conn->in_len);
+
+        if (status == HTTP_PARSE_ERROR)
+            return 1;
+        if (status == HTTP_PARSE_INCOMPLETE) {
+            if (conn_in_space(conn) > 0)
+                return 0;
+            conn->req.error_status = 431;
+            return 1;
+        }
+
+        conn->req_len = status;
+        trace_mark(&conn->trace, TRACE_PARSED);
+        conn->keep_alive = http_keep_alive(&conn->req) &&
+                           conn->requests + 1 < KEEPALIVE_MAX_REQUESTS &&
+                           !handoff_draining();
+    }
+
+    return 1;
+}
+
+// Status lines for files; their headers come from the file cache
+static const char head_file[] = "HTTP/1.1 200 OK\r\n";
+static const char head_304[] = "HTTP/1.1 304 Not Modified\r\n";
+
+// A piece of the echoed body is queued (queued < 0 if that failed); an
+// empty one ends it. Memory stays under the high-water mark whatever the
+// upload size: past it, reading waits for the client to take what it has
+// been sent.
+static inline void conn_echo_queued(conn_t *conn, int queued, size_t len) {
+    if (queued < 0) {
+        log_error("Failed to queue echoed body");
+        conn->state = CONN_CLOSED;
+        return;
+    }
+    if (len == 0) {
+        conn->streaming = 0;
+        conn->state = CONN_WRITING;
+    } else if (conn->out.bytes >= CONN_OUT_HIGH_WATER) {
+        conn->state = CONN_WRITING;
+    }
+}
+
+// POST /echo: every piece of the body goes back out as a chunk of the
+// response, queued on the chain behind the headers
+static inline void conn_echo_body(conn_t *conn, const char *data, size_t len) {
+    conn_echo_queued(conn, out_chain_add_chunk(&conn->out, data, len), len);
+}
+
+// The same for HTTP/1.0: the pieces go back as they are, and the close
+// ends the body
+static inline void conn_echo_raw(conn_t *conn, const char *data, size_t len) {
+    conn_echo_queued(conn, out_chain_add(&conn->out, data, len), len);
+}
+
+// Set up the request body to stream through the input buffer once the
+// headers are out of the way; the response already built waits until it
+// is all in, unless the handler streams one
+static inline void conn_expect_body(conn_t *conn) {
+    http_body_init(&conn->body_decoder, &conn->req);
+    if (http_body_done(&conn->body_decoder)) {
+        if (conn->on_body != NULL)
+            conn->on_body(conn, NULL, 0);
+        return;
+    }
+
+    conn_drop_input(conn, conn->req_len);
+    conn->req_len = 0;
+    conn->deadline = io_now_ms() + deadline_config.body_ms;
+    conn->after_body = conn->state;
+    conn->state = CONN_BODY;
+}
+
+// Pass the buffered part of the body through the decoder to the handler.
+// Leaves the state at BODY when it needs more input.
+static inline void conn_body(conn_t *conn) {
+    timer_cancel(&conn->timer);
+
+    if (!http_body_done(&conn->body_decoder)) {
+        size_t out;
+        long used = http_body_decode(&conn->body_decoder, conn->in, conn->in_len, &out);
+
+        if (used < 0) {
+            // Broken chunk framing; once part of a streamed response is
+            // out there is no way to say so but to cut the connection
+            conn->keep_alive = 0;
+            if (conn->streaming && conn->resp.remaining == 0) {
+                conn->state = CONN_CLOSED;
+                return;
+            }
+            conn->streaming = 0;
+            conn->on_body = NULL;
+            RESPONSE_START_LITERAL(&conn->resp, head_400);
+            response_add_date(&conn->resp);
+            response_add_length(&conn->resp, sizeof("400 Bad Request\n") - 1);
+            response_end_headers(&conn->resp, 0);
+            RESPONSE_ADD_LITERAL(&conn->resp, "400 Bad Request\n");
+            conn_drop_body(conn);
+            conn->route = ROUTE_REJECTED;
+            conn->status = 400;
+            conn->delay_ms = 0;
+            conn->state = CONN_WRITING;
+            return;
+        }
+
+        conn->body_used = used;
+        if (out > 0 && conn->on_body != NULL) {
+            conn->on_body(conn, conn->in, out);
+            if (conn->state != CONN_BODY)
+                return;             // Resumes here once that is written
+        }
+        conn_drop_input(conn, conn->body_used);
+        conn->body_used = 0;
+        if (!http_body_done(&conn->body_decoder))
+            return;
+    }
+
+    if (conn->on_body != NULL)
+        conn->on_body(conn, NULL, 0);
+    else
+        conn->state = conn->after_body;
+}
+
+// Answer from the file cache: 304 when the client's copy is current, else
+// the file itself, straight from its mapping or, when it is large and the
+// engine can, with sendfile() once the headers are out
+static inline void conn_file_response(conn_t *conn) {
+    response_t *r = &conn->resp;
+    static_file_t *file = conn->file;
+
+    conn->route = ROUTE_STATIC;
+    if (static_not_modified(file, &conn->req)) {
+        RESPONSE_START_LITERAL(r, head_304);
+        response_add(r, file->headers, file->headers_len);
+        response_add_date(r);
+        response_end_headers(r, conn->keep_alive);
+        conn->status = 304;
+    } else {
+        RESPONSE_START_LITERAL(r, head_file);
+        response_add(r, file->headers, file->headers_len);
+        response_add_date(r);
+        response_add_length(r, file->size);
+        response_end_headers(r, conn->keep_alive);
+        if (!http_span_eq(conn->req.method, "HEAD")) {
+            if (conn->sendfile && file->size > STATIC_MMAP_MAX)
+                conn->file_end = file->size;
+            else
+                response_add(r, file->map, file->size);
+        }
+        conn->status = 200;
+    }
+
+    conn->state = CONN_WRITING;
+}
+
+// Build the response for a fully read request
+static inline void handle_request(conn_t *conn) {
+    router_result_t res;
+
+    conn->start_us = metrics_now_us();
+    trace_mark(&conn->trace, TRACE_HANDLER_START);
+
+    // Malformed requests and oversized headers are refused, and the
+    // connection is closed since the rest of it cannot be skipped reliably
+    if (conn->req.error_status != 0) {
+        conn->keep_alive = 0;
+        conn->req_len = conn->in_len;
+    }
+    // Files under the document root; "/" itself stays the GET route
+    else if ((http_span_eq(conn->req.method, "GET") || http_span_eq(conn->req.method, "HEAD")) &&
+             (conn->file = static_file_get(&static_files, conn->req.path)) != NULL) {
+        conn_file_response(conn);
+        conn_expect_body(conn);
+        return;
+    }
+
+    res = router_handle(&conn->req, conn->keep_alive, &conn->resp, &conn->arena);
+    conn->route = res.route;
+    conn->status = res.status;
+    conn->delay_ms = res.delay_ms;
+    conn->work = res.work;
+    conn->work_arg = res.work_arg;
+
+    if (conn->req.error_status != 0) {
+        conn->state = CONN_WRITING;
+        return;
+    }
+
+    // The echo goes back piece by piece as the body arrives
+    if (res.route == ROUTE_ECHO) {
+        conn->on_body = res.chunked ? conn_echo_body : conn_echo_raw;
+        if (!res.chunked)
+            conn->keep_alive = 0;
+        conn->streaming = 1;
+        conn_expect_body(conn);
+        return;
+    }
+
+    conn->state = conn->delay_ms > 0 || conn->work != NULL ? CONN_WAITING : CONN_WRITING;
+    conn_expect_body(conn);
+}
+
+// Hand the handler's blocking work to the offload executor; callback picks
+// the connection up on the loop's thread once it has run. If the executor
+// has no room the request is answered 503 at once.
+static inline void conn_offload(conn_t *conn, void (*callback)(void *data)) {
+    if (offload_submit(&conn->job, conn->port, conn->work, conn->work_arg, callback, conn) == 0) {
+        conn->offloaded = 1;
+        return;
+    }
+    conn->status = router_busy(&conn->resp, conn->keep_alive);
+    conn->work = NULL;
+    conn->state = CONN_WRITING;
+}
+
+// The offloaded work is done: the response can go out, unless the engine
+// marked the connection closed meanwhile
+static inline void conn_offload_done(conn_t *conn) {
+    conn->offloaded = 0;
+    conn->work = NULL;
+    if (conn->state != CONN_CLOSED)
+        conn->state = CONN_WRITING;
+}
+
+// Is the response being sent the last thing on the connection?
+static inline int conn_last_response(const conn_t *conn) {
+    return !conn->keep_alive && !conn->streaming;
+}
+
+// The response is out: drop the request from the front of the buffer, so
+// a pipelined one behind it becomes current, and decide whether to go on.
+// A streamed response whose chain has drained instead goes back for more
+// of the body.
+static inline void conn_finish_request(conn_t *conn) {
+    if (conn->streaming) {
+        conn_drop_input(conn, conn->body_used);
+        conn->body_used = 0;
+        response_start(&conn->resp, NULL, 0);
+        conn->state = CONN_BODY;
+        return;
+    }
+
+    conn_response_sent(conn);
+    conn_drop_input(conn, conn->req_len < conn->in_len ? conn->req_len : conn->in_len);
+    conn->req_len = 0;
+    http_request_init(&conn->req);
+    conn->on_body = NULL;
+    conn->delay_ms = 0;
+    conn->deadline = 0;
+    conn->requests++;
+
+    conn->state = conn->keep_alive ? CONN_READING : CONN_CLOSED;
+}
+
+#endif
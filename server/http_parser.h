@@ -0,0 +1,411 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+// Incremental, zero-copy HTTP/1.x request parser.
+//
+// The parser works in place over the caller's read buffer and returns
+// spans (pointer + length) into it for the method, path, query, version
+// and each header; nothing is copied or NUL-terminated. It can be called
+// again each time more bytes arrive: lines that were already parsed are
+// not scanned twice, so a request trickling in byte by byte costs O(n).
+// The buffer must not move between calls for the same request.
+//
+// Delimiter scanning uses SSE2 (AVX2 when built with -mavx2 or
+// -march=native) to find the next ' ', ':', '?' or control byte 16 or 32
+// bytes at a time. Control bytes other than HTAB end the scan, so CR/LF
+// are found by the same pass that rejects stray control characters.
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "io_wait.h"
+
+#define HTTP_MAX_HEADERS 32
+
+enum {
+    HTTP_PARSE_ERROR = -1,
+    HTTP_PARSE_INCOMPLETE = -2
+};
+
+// A view into the read buffer
+typedef struct {
+    const char *ptr;
+    size_t len;
+} http_span_t;
+
+typedef struct {
+    http_span_t name;
+    http_span_t value;
+} http_header_t;
+
+typedef struct {
+    http_span_t method;
+    http_span_t path;
+    http_span_t query;              // Empty when the target has no '?'
+    http_span_t version;
+    int minor_version;              // 0 or 1 for HTTP/1.0 and HTTP/1.1
+    size_t num_headers;
+    size_t header_len;              // Request line and headers, blank line included
+    size_t content_length;
+    int has_content_length;
+    int chunked;
+    int error_status;               // 400, 431 or 501 when parsing fails
+
+    // Resume state
+    size_t pos;                     // Start of the first unparsed line
+    int in_headers;                 // Request line done
+
+    // Last, so resetting a request does not touch the whole table
+    http_header_t headers[HTTP_MAX_HEADERS];
+} http_request_t;
+
+static inline void http_request_init(http_request_t *req) {
+    memset(req, 0, offsetof(http_request_t, headers));
+}
+
+// Find the first byte in [p, end) that is a or b, or a control character
+// other than HTAB (which includes CR and LF); returns end if there is none
+static inline const char *http_scan(const char *p, const char *end, char a, char b) {
+#if defined(__AVX2__)
+    const __m256i va32 = _mm256_set1_epi8(a);
+    const __m256i vb32 = _mm256_set1_epi8(b);
+    const __m256i ctl32 = _mm256_set1_epi8(0x1f);
+    const __m256i tab32 = _mm256_set1_epi8('\t');
+    const __m256i del32 = _mm256_set1_epi8(0x7f);
+
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        // Unsigned x <= 0x1f, minus HTAB, plus DEL
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(x, ctl32), x);
+        ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(x, tab32), ctl);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, va32),
+                                                      _mm256_cmpeq_epi8(x, vb32)),
+                                      _mm256_or_si256(ctl, _mm256_cmpeq_epi8(x, del32)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i ctl16 = _mm_set1_epi8(0x1f);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i del = _mm_set1_epi8(0x7f);
+
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(x, ctl16), x);
+        ctl = _mm_andnot_si128(_mm_cmpeq_epi8(x, tab), ctl);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)),
+                                   _mm_or_si128(ctl, _mm_cmpeq_epi8(x, del)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    for (; p < end; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c == (unsigned char)a || c == (unsigned char)b ||
+            (c < 0x20 && c != '\t') || c == 0x7f)
+            return p;
+    }
+    return end;
+}
+
+// Match a line terminator at p: CRLF or a bare LF. Returns its length,
+// 0 if more bytes are needed, -1 if p does not start a terminator.
+static inline int http_eol(const char *p, const char *end) {
+    if (p >= end)
+        return 0;
+    if (*p == '\n')
+        return 1;
+    if (*p != '\r')
+        return -1;
+    if (p + 1 >= end)
+        return 0;
+    return p[1] == '\n' ? 2 : -1;
+}
+
+static inline int http_span_eq(http_span_t span, const char *s) {
+    size_t len = strlen(s);
+    return span.len == len && memcmp(span.ptr, s, len) == 0;
+}
+
+static inline int http_span_case_eq(http_span_t span, const char *s) {
+    size_t len = strlen(s);
+    return span.len == len && strncasecmp(span.ptr, s, len) == 0;
+}
+
+// Look up a header by case-insensitive name; returns NULL if absent
+static inline const http_span_t *http_find_header(const http_request_t *req, const char *name) {
+    for (size_t i = 0; i < req->num_headers; i++) {
+        if (http_span_case_eq(req->headers[i].name, name))
+            return &req->headers[i].value;
+    }
+    return NULL;
+}
+
+static inline int http_parse_fail(http_request_t *req, int status) {
+    req->error_status = status;
+    return HTTP_PARSE_ERROR;
+}
+
+// "METHOD SP target SP HTTP/1.x EOL"; returns bytes consumed, 0 if
+// incomplete, -1 on malformed input
+static inline long http_parse_request_line(http_request_t *req, const char *start, const char *end) {
+    const char *p = start;
+    const char *q;
+    int eol;
+
+    q = http_scan(p, end, ' ', ' ');
+    if (q == end)
+        return 0;
+    if (*q != ' ' || q == p)
+        return -1;
+    req->method.ptr = p;
+    req->method.len = q - p;
+
+    p = q + 1;
+    q = http_scan(p, end, ' ', '?');
+    if (q == end)
+        return 0;
+    // Origin-form, or the asterisk-form of "OPTIONS * HTTP/1.1"
+    if ((*q != ' ' && *q != '?') || q == p || (*p != '/' && !(*p == '*' && q == p + 1)))
+        return -1;
+    req->path.ptr = p;
+    req->path.len = q - p;
+    req->query.ptr = q;
+    req->query.len = 0;
+
+    if (*q == '?') {
+        p = q + 1;
+        q = http_scan(p, end, ' ', ' ');
+        if (q == end)
+            return 0;
+        if (*q != ' ')
+            return -1;
+        req->query.ptr = p;
+        req->query.len = q - p;
+    }
+
+    p = q + 1;
+    q = http_scan(p, end, '\r', '\r');
+    if (q == end)
+        return 0;
+    if ((eol = http_eol(q, end)) <= 0)
+        return eol;
+    if (q - p != 8 || memcmp(p, "HTTP/1.", 7) != 0 || (p[7] != '0' && p[7] != '1'))
+        return -1;
+    req->version.ptr = p;
+    req->version.len = 8;
+    req->minor_version = p[7] - '0';
+
+    return (q + eol) - start;
+}
+
+// "name: value EOL"; returns bytes consumed, 0 if incomplete, -1 on
+// malformed input
+static inline long http_parse_header_line(http_header_t *header, const char *start, const char *end) {
+    const char *p = start;
+    const char *q;
+    int eol;
+
+    q = http_scan(p, end, ':', ' ');
+    if (q == end)
+        return 0;
+    // No whitespace or control bytes in the name, and it cannot be empty
+    if (*q != ':' || q == p)
+        return -1;
+    header->name.ptr = p;
+    header->name.len = q - p;
+
+    p = q + 1;
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    q = http_scan(p, end, '\r', '\r');
+    if (q == end)
+        return 0;
+    if ((eol = http_eol(q, end)) <= 0)
+        return eol;
+
+    const char *v_end = q;
+    while (v_end > p && (v_end[-1] == ' ' || v_end[-1] == '\t'))
+        v_end--;
+    header->value.ptr = p;
+    header->value.len = v_end - p;
+
+    return (q + eol) - start;
+}
+
+// One Transfer-Encoding field value. Chunked is the only coding we decode,
+// and it has to be the last one applied (RFC 9112 6.1); any other coding
+// is one we do not implement. Returns 0, or the status to refuse with.
+static inline int http_parse_transfer_coding(http_request_t *req, http_span_t v) {
+    const char *p = v.ptr, *end = v.ptr + v.len;
+
+    while (p < end) {
+        http_span_t coding;
+
+        // Empty list elements and whitespace around codings are allowed
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if (p == end)
+            break;
+        coding.ptr = p;
+        while (p < end && *p != ',')
+            p++;
+        coding.len = p - coding.ptr;
+        while (coding.len > 0 && (coding.ptr[coding.len - 1] == ' ' || coding.ptr[coding.len - 1] == '\t'))
+            coding.len--;
+
+        if (!http_span_case_eq(coding, "chunked"))
+            return 501;
+        if (req->chunked)
+            return 400;             // Chunked twice
+        req->chunked = 1;
+    }
+    return req->chunked ? 0 : 400;
+}
+
+// Pull the framing headers out once the header block is complete. Returns
+// 0, or the status to refuse the request with.
+static inline int http_parse_framing(http_request_t *req) {
+    for (size_t i = 0; i < req->num_headers; i++) {
+        http_header_t *h = &req->headers[i];
+
+        if (http_span_case_eq(h->name, "Content-Length")) {
+            size_t n = 0;
+
+            if (h->value.len == 0 || h->value.len > 18)
+                return 400;
+            for (size_t j = 0; j < h->value.len; j++) {
+                if (h->value.ptr[j] < '0' || h->value.ptr[j] > '9')
+                    return 400;
+                n = n * 10 + (h->value.ptr[j] - '0');
+            }
+            // Repeated Content-Length must agree
+            if (req->has_content_length && req->content_length != n)
+                return 400;
+            req->content_length = n;
+            req->has_content_length = 1;
+        } else if (http_span_case_eq(h->name, "Transfer-Encoding")) {
+            int status = http_parse_transfer_coding(req, h->value);
+            if (status != 0)
+                return status;
+        }
+    }
+
+    // Both framings at once is a request smuggling vector (RFC 9112 6.1)
+    if (req->chunked && req->has_content_length)
+        return 400;
+
+    return 0;
+}
+
+// Parse (or continue parsing) the request at buf[0..len). Returns the
+// header length once the blank line has been parsed, HTTP_PARSE_INCOMPLETE
+// if more bytes are needed, or HTTP_PARSE_ERROR with req->error_status set.
+static inline long http_parse_request(http_request_t *req, const char *buf, size_t len) {
+    const char *end = buf + len;
+    long n;
+    int status;
+
+    if (req->header_len > 0)
+        return req->header_len;
+
+    if (!req->in_headers) {
+        // Tolerate empty lines before the request line (RFC 9112 2.2)
+        while (req->pos < len && (buf[req->pos] == '\r' || buf[req->pos] == '\n'))
+            req->pos++;
+
+        n = http_parse_request_line(req, buf + req->pos, end);
+        if (n < 0)
+            return http_parse_fail(req, 400);
+        if (n == 0)
+            return HTTP_PARSE_INCOMPLETE;
+        req->pos += n;
+        req->in_headers = 1;
+    }
+
+    while (1) {
+        int eol = http_eol(buf + req->pos, end);
+
+        if (eol > 0) {
+            req->pos += eol;
+            break;
+        }
+        if (eol == 0)
+            return HTTP_PARSE_INCOMPLETE;
+
+        if (req->num_headers == HTTP_MAX_HEADERS)
+            return http_parse_fail(req, 431);
+
+        n = http_parse_header_line(&req->headers[req->num_headers], buf + req->pos, end);
+        if (n < 0)
+            return http_parse_fail(req, 400);
+        if (n == 0)
+            return HTTP_PARSE_INCOMPLETE;
+        req->pos += n;
+        req->num_headers++;
+    }
+
+    if ((status = http_parse_framing(req)) != 0)
+        return http_parse_fail(req, status);
+
+    req->header_len = req->pos;
+    return req->header_len;
+}
+
+// HTTP/1.1 persists by default, HTTP/1.0 only when asked to
+static inline int http_keep_alive(const http_request_t *req) {
+    const http_span_t *connection = http_find_header(req, "Connection");
+
+    if (connection != NULL && http_span_case_eq(*connection, "close"))
+        return 0;
+    if (connection != NULL && http_span_case_eq(*connection, "keep-alive"))
+        return 1;
+    return req->minor_version == 1;
+}
+
+// Blocking read loop for the thread and iterative variants: read until the
+// header block is complete, the buffer is full, or the peer closes. The
+// buffer is NUL-terminated. Returns the header length, HTTP_PARSE_ERROR
+// (error_status says 400, 431 or 501), or HTTP_PARSE_INCOMPLETE on EOF or a
+// read error before a full request arrived.
+static inline long http_read_request(int fd, char *buf, size_t size, size_t *len,
+                                     http_request_t *req) {
+    long status = HTTP_PARSE_INCOMPLETE;
+
+    http_request_init(req);
+    *len = 0;
+    buf[0] = '\0';
+
+    while (*len < size - 1) {
+        ssize_t n = read(fd, buf + *len, size - 1 - *len);
+        if (n < 0 && io_retry(fd, POLLIN))
+            continue;
+        if (n <= 0)
+            return HTTP_PARSE_INCOMPLETE;
+
+        *len += n;
+        buf[*len] = '\0';
+
+        status = http_parse_request(req, buf, *len);
+        if (status != HTTP_PARSE_INCOMPLETE)
+            return status;
+    }
+
+    return http_parse_fail(req, 431);
+}
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef HTTP_SERVE_H
+#define HTTP_SERVE_H
+
+// One request per connection, read and answered straight through, for the
+// engines whose handlers own a socket for the whole request (iterative,
+// pool, thread-per-conn). The socket is non-blocking and waits go
+// through io_wait (io_wait.h), parking a coroutine or polling on the
+// handler's own thread; either way the code here reads top to bottom, and
+// every wait is bounded by the deadline of its phase (deadline.h).
+//
+// Every answer is a reply_t from the slab, built in place by the router.
+// The engine decides how a reply with a simulated workload waits it out:
+// sleeping in the handler, or parking the reply on a timer wheel and
+// returning, in which case the reply owns the socket until it is sent.
+// Blocking work the handler left goes the same way: run in place, or
+// handed to the offload executor with the reply sent from the engine's
+// offload port when it is done.
+
+#include <errno.h>
+#include <string.h>
+
+#include "admission.h"
+#include "deadline.h"
+#include "engine.h"
+#include "http_body.h"
+#include "http_parser.h"
+#include "io_wait.h"
+#include "log.h"
+#include "metrics.h"
+#include "offload.h"
+#include "response.h"
+#include "router.h"
+#include "slab.h"
+#include "timer_wheel.h"
+#include "trace.h"
+
+typedef struct reply {
+    int fd;
+    response_t response;
+    arena_t arena;                  // Scratch the response may point into
+    router_result_t result;
+    uint64_t start_us;              // When the request was read, for the latency histogram
+    trace_t trace;
+    wheel_timer_t timer;            // For engines that park it on a wheel
+    offload_job_t job;              // For engines that offload its work
+    struct reply *next;             // For engines that collect due replies
+} reply_t;
+
+// How an engine waits out reply->result.delay_ms, or has
+// reply->result.work run; it calls reply_finish() when that is over,
+// before returning or later
+typedef void (*reply_wait_fn)(reply_t *reply);
+
+// Close the connection and free the reply, sent or not
+static inline void reply_close(reply_t *reply) {
+    metrics_connection_closed();
+    admission_close(reply->fd);
+    arena_reset(&reply->arena);
+    slab_free(reply, sizeof(*reply));
+}
+
+// Send the reply, count it and close the connection
+static inline void reply_finish(reply_t *reply) {
+    trace_mark(&reply->trace, TRACE_HANDLER_END);
+    io_deadline_set(deadline_config.write_ms);
+    if (response_send(reply->fd, &reply->response) < 0 && errno == ETIMEDOUT)
+        log_warn("Client too slow to take its response, closing");
+    metrics_request(reply->result.route, reply->result.status, reply->start_us);
+    trace_end(&reply->trace, reply->result.route, reply->result.status);
+    reply_close(reply);
+}
+
+// The executor had no room for the reply's work: answer 503 instead
+static inline void reply_busy(reply_t *reply) {
+    reply->result.status = router_busy(&reply->response, 0);
+    reply->result.work = NULL;
+}
+
+// Offload callback: the work is done, send the reply and close
+static inline void reply_offloaded(void *data) {
+    reply_finish((reply_t *)data);
+}
+
+// Hand the reply's work to the executor; the reply is sent from the
+// thread that drains port once it has run
+static inline void reply_offload(reply_t *reply, offload_port_t *port) {
+    if (offload_submit(&reply->job, port, reply->result.work, reply->result.work_arg,
+                       reply_offloaded, reply) == 0)
+        return;
+    reply_busy(reply);
+    reply_finish(reply);
+}
+
+// Send each piece of an echoed body straight back, as a response chunk or,
+// for HTTP/1.0, as it is; an empty piece ends the body
+static inline void serve_echo_chunk(void *ctx, const char *data, size_t len) {
+    reply_t *reply = ctx;
+    response_t raw;
+
+    if (reply->result.chunked) {
+        response_send_chunk(reply->fd, data, len);
+        return;
+    }
+    response_start(&raw, data, len);
+    response_send(reply->fd, &raw);
+}
+
+// Answer the request whose headers are in buffer[0..bytes_read), reading
+// its body behind them, then close the connection (at once, or through
+// wait once the workload is over). trace holds what the engine stamped.
+static inline void serve_request(int client_socket, char *buffer, size_t size, size_t bytes_read,
+                                 const http_request_t *req, const trace_t *trace,
+                                 reply_wait_fn wait) {
+    reply_t *reply;
+
+    log_debug("Received request:\n%s", buffer);
+
+    reply = slab_zalloc(sizeof(reply_t));
+    if (reply == NULL) {
+        log_error("Failed to allocate reply: %s", strerror(errno));
+        metrics_connection_closed();
+        admission_close(client_socket);
+        return;
+    }
+    reply->fd = client_socket;
+    reply->start_us = metrics_now_us();
+    reply->trace = *trace;
+    trace_mark(&reply->trace, TRACE_HANDLER_START);
+    reply->result = router_handle(req, 0, &reply->response, &reply->arena);
+    io_deadline_set(deadline_config.body_ms);
+
+    // JSON echo, streamed back through the request buffer as it arrives
+    if (reply->result.route == ROUTE_ECHO) {
+        response_send(client_socket, &reply->response);
+        if (http_read_body(client_socket, buffer, size, bytes_read, req,
+                           serve_echo_chunk, reply) == 0)
+            serve_echo_chunk(reply, NULL, 0);
+        response_start(&reply->response, NULL, 0);
+    }
+    // Any other body is read and dropped before the answer goes out; one
+    // that does not arrive in time gets a 408 instead
+    else if (req->error_status == 0) {
+        errno = 0;
+        if (http_read_body(client_socket, buffer, size, bytes_read, req, NULL, NULL) < 0) {
+            if (errno == ETIMEDOUT)
+                deadline_reject(client_socket);
+            else
+                log_error("Failed to read request body from client");
+            reply_close(reply);
+            return;
+        }
+    }
+
+    if (reply->result.delay_ms > 0 || reply->result.work != NULL)
+        wait(reply);
+    else
+        reply_finish(reply);
+}
+
+// Read one request into buffer and answer it, then close the connection.
+// A client that stops part way through its headers gets a 408 at the
+// header deadline; one that never sends anything is just closed.
+static inline void serve_client(int client_socket, char *buffer, size_t size, trace_t *trace,
+                                reply_wait_fn wait) {
+    size_t bytes_read;
+    http_request_t req;
+    long status;
+    char peek;
+
+    // Read and parse the request from the client. A traced one waits for
+    // its first byte on its own, to tell a silent client from a slow one.
+    io_deadline_set(deadline_config.header_ms);
+    if (trace_enabled()) {
+        while (recv(client_socket, &peek, 1, MSG_PEEK) < 0 && io_retry(client_socket, POLLIN))
+            ;
+        trace_mark(trace, TRACE_FIRST_BYTE);
+    }
+    errno = 0;
+    status = http_read_request(client_socket, buffer, size, &bytes_read, &req);
+    if (status == HTTP_PARSE_INCOMPLETE) {
+        if (errno == ETIMEDOUT && bytes_read > 0)
+            deadline_reject(client_socket);
+        else if (errno != ETIMEDOUT)
+            log_error("Failed to read request from client");
+        metrics_connection_closed();
+        admission_close(client_socket);
+        return;
+    }
+
+    trace_mark(trace, TRACE_PARSED);
+    serve_request(client_socket, buffer, size, bytes_read, &req, trace, wait);
+}
+
+#endif
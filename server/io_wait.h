@@ -0,0 +1,73 @@
+#ifndef IO_WAIT_H
+#define IO_WAIT_H
+
+// Hook through which the blocking helpers (http_read_request(),
+// http_read_body(), response_send()) wait on a socket that would block.
+//
+// Left NULL, a would-block error is just an error, as on blocking sockets.
+// A server that runs its handlers as coroutines over non-blocking sockets
+// points it at a function that parks the caller until fd is ready for
+// events (POLLIN or POLLOUT) and returns 0, or -1 if it cannot wait; the
+// helpers then retry, so handler code stays straight-line. Handlers on
+// plain threads use io_poll() over non-blocking sockets the same way.
+//
+// Either way a wait gives up at the calling thread's (or coroutine's)
+// deadline, set with io_deadline_set(), and fails with ETIMEDOUT.
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+
+static int (*io_wait)(int fd, unsigned events);
+
+// Absolute CLOCK_MONOTONIC milliseconds, or 0 for no deadline. The
+// coroutine runtime swaps it in and out with each coroutine.
+static __thread uint64_t io_deadline;
+
+static inline uint64_t io_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// Give the waits from here on ms milliseconds in all (0 = no limit)
+static inline void io_deadline_set(unsigned ms) {
+    io_deadline = ms > 0 ? io_now_ms() + ms : 0;
+}
+
+// Milliseconds until the deadline: -1 for none, 0 once it has passed
+static inline int io_deadline_left(void) {
+    uint64_t now;
+
+    if (io_deadline == 0)
+        return -1;
+    now = io_now_ms();
+    return io_deadline > now ? (int)(io_deadline - now) : 0;
+}
+
+// io_wait for handlers on their own thread: poll() the one socket until
+// it is ready or the deadline passes
+static inline int io_poll(int fd, unsigned events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int n;
+
+    do {
+        n = poll(&pfd, 1, io_deadline_left());
+    } while (n < 0 && errno == EINTR);
+    if (n == 0)
+        errno = ETIMEDOUT;
+    return n > 0 ? 0 : -1;
+}
+
+// Should a call that failed with errno be retried?
+static inline int io_retry(int fd, unsigned events) {
+    if (errno == EINTR)
+        return 1;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return 0;
+    return io_wait != NULL && io_wait(fd, events) == 0;
+}
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Asynchronous logger that keeps stdio off the request path.
+//
+// A thread formats each message into its own single-producer ring and
+// goes on; a flusher thread drains all rings every LOG_FLUSH_MS and writes
+// them out in batches to stderr or a file. Nothing on the logging side
+// takes a lock or makes a system call. When a ring is full the message is
+// dropped and counted, never waited for; the flusher reports the drops.
+// Messages from one thread stay in order; messages from different threads
+// are interleaved at flush granularity.
+//
+// A thread that exits leaves its ring to the next new thread, as
+// metrics.h does with its shards.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+#define LOG_RING_SIZE 32768         // Per thread, a power of two
+#define LOG_LINE_MAX 1024           // Longer messages are truncated
+#define LOG_BATCH_SIZE 65536        // Bytes per write() from the flusher
+#define LOG_FLUSH_MS 10
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF
+} log_level_t;
+
+static const char *const log_level_names[] = { "debug", "info", "warn", "error", "off" };
+
+// Records are a 32-bit length followed by the text, wrapping freely.
+// head is written only by the owning thread, tail only by the flusher.
+typedef struct log_ring {
+    uint64_t head __attribute__((aligned(CACHE_LINE)));
+    uint64_t dropped;               // Messages that did not fit, by the owner
+    uint64_t tail __attribute__((aligned(CACHE_LINE)));
+    struct log_ring *next;
+    int retired;                    // Its thread exited; free for reuse
+    char data[LOG_RING_SIZE] __attribute__((aligned(CACHE_LINE)));
+} log_ring_t;
+
+static struct {
+    int level;
+    int fd;
+    pthread_mutex_t lock;           // Guards the ring list
+    pthread_mutex_t flush_lock;     // One drain at a time
+    pthread_once_t once;
+    pthread_key_t key;
+    log_ring_t *rings;
+    uint64_t reported_drops;
+    char batch[LOG_BATCH_SIZE];
+    size_t batch_len;
+} log_config = {
+    LOG_LEVEL_INFO, STDERR_FILENO, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_ONCE_INIT, 0, NULL, 0, { 0 }, 0
+};
+
+static __thread log_ring_t *log_local;
+
+#define log_debug(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Parse "debug", "info", "warn", "error" or "off"; returns -1 if unknown
+static inline int log_parse_level(const char *name) {
+    for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_OFF; level++) {
+        if (strcasecmp(name, log_level_names[level]) == 0)
+            return level;
+    }
+    return -1;
+}
+
+static inline int log_enabled(int level) {
+    return level >= log_config.level;
+}
+
+static inline void log_retire(void *ring) {
+    pthread_mutex_lock(&log_config.lock);
+    ((log_ring_t *)ring)->retired = 1;
+    pthread_mutex_unlock(&log_config.lock);
+}
+
+static inline void log_init_key(void) {
+    pthread_key_create(&log_config.key, log_retire);
+}
+
+// This thread's ring: a retired one if there is one, else a new one
+static inline log_ring_t *log_attach(void) {
+    log_ring_t *ring;
+
+    pthread_once(&log_config.once, log_init_key);
+    pthread_mutex_lock(&log_config.lock);
+    for (ring = log_config.rings; ring != NULL; ring = ring->next) {
+        if (ring->retired)
+            break;
+    }
+    if (ring != NULL) {
+        ring->retired = 0;
+    } else if (posix_memalign((void **)&ring, CACHE_LINE, sizeof(*ring)) == 0) {
+        memset(ring, 0, offsetof(log_ring_t, data));
+        ring->next = log_config.rings;
+        log_config.rings = ring;
+    }
+    pthread_mutex_unlock(&log_config.lock);
+
+    if (ring != NULL)
+        pthread_setspecific(log_config.key, ring);
+    return ring;
+}
+
+// Copy in or out of the ring across its end
+static inline void log_ring_put(log_ring_t *ring, uint64_t pos, const void *src, size_t len) {
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+
+    memcpy(ring->data + off, src, first);
+    memcpy(ring->data, (const char *)src + first, len - first);
+}
+
+static inline void log_ring_get(const log_ring_t *ring, uint64_t pos, void *dst, size_t len) {
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+
+    memcpy(dst, ring->data + off, first);
+    memcpy((char *)dst + first, ring->data, len - first);
+}
+
+// Format a message into this thread's ring, or drop it if there is no room
+__attribute__((format(printf, 2, 3)))
+static inline void log_write(int level, const char *fmt, ...) {
+    char line[LOG_LINE_MAX];
+    va_list ap;
+    int n;
+
+    if (!log_enabled(level))
+        return;
+    if (__builtin_expect(log_local == NULL, 0) && (log_local = log_attach()) == NULL)
+        return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    // Every message ends its own line
+    uint32_t len = n < LOG_LINE_MAX - 1 ? n : LOG_LINE_MAX - 1;
+    if (len == 0 || line[len - 1] != '\n')
+        line[len++] = '\n';
+
+    log_ring_t *ring = log_local;
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head + sizeof(len) + len - tail > LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    log_ring_put(ring, head, &len, sizeof(len));
+    log_ring_put(ring, head + sizeof(len), line, len);
+    __atomic_store_n(&ring->head, head + sizeof(len) + len, __ATOMIC_RELEASE);
+}
+
+static inline void log_batch_write(void) {
+    size_t done = 0;
+
+    while (done < log_config.batch_len) {
+        ssize_t n = write(log_config.fd, log_config.batch + done, log_config.batch_len - done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;                  // Nowhere to log to; lose the batch
+        done += n;
+    }
+    log_config.batch_len = 0;
+}
+
+static inline void log_batch_add(const void *data, size_t len) {
+    if (log_config.batch_len + len > sizeof(log_config.batch))
+        log_batch_write();
+    memcpy(log_config.batch + log_config.batch_len, data, len);
+    log_config.batch_len += len;
+}
+
+// Move everything queued so far to the output
+static inline void log_flush(void) {
+    uint64_t dropped = 0;
+
+    pthread_mutex_lock(&log_config.flush_lock);
+    pthread_mutex_lock(&log_config.lock);
+    log_ring_t *rings = log_config.rings;
+    pthread_mutex_unlock(&log_config.lock);
+
+    // Rings are only ever prepended, so the list from here on is stable
+    for (log_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        while (tail < head) {
+            char line[LOG_LINE_MAX];
+            uint32_t len;
+
+            log_ring_get(ring, tail, &len, sizeof(len));
+            log_ring_get(ring, tail + sizeof(len), line, len);
+            log_batch_add(line, len);
+            tail += sizeof(len) + len;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+
+    if (dropped > log_config.reported_drops) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "log: %lu messages dropped\n",
+                         (unsigned long)(dropped - log_config.reported_drops));
+        log_batch_add(line, n);
+        log_config.reported_drops = dropped;
+    }
+
+    log_batch_write();
+    pthread_mutex_unlock(&log_config.flush_lock);
+}
+
+static inline void *log_flusher_thread(void *arg) {
+    struct timespec interval = { 0, LOG_FLUSH_MS * 1000000L };
+    (void)arg;
+
+    while (1) {
+        nanosleep(&interval, NULL);
+        log_flush();
+    }
+
+    return NULL;
+}
+
+// Set the level and output (NULL for stderr) and start the flusher; what
+// is still queued is flushed at exit
+static inline int log_start(int level, const char *path) {
+    pthread_t thread;
+
+    log_config.level = level;
+    if (path != NULL) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return -1;
+        log_config.fd = fd;
+    }
+
+    if (pthread_create(&thread, NULL, log_flusher_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread);
+    atexit(log_flush);
+    return 0;
+}
+
+#endif
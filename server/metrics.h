@@ -0,0 +1,373 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Runtime metrics in the Prometheus text format, for the /metrics route.
+//
+// Every thread that records anything gets its own cache-line-aligned shard
+// and is the only writer of it, so the request path does plain stores, with
+// no locks, no read-modify-write atomics and no shared cache lines. Shards
+// are summed only when /metrics is scraped. A thread that exits leaves its
+// shard behind for the next new thread, so totals never go backwards.
+//
+// Gauges that belong to one server (pool size, queue depth) are read
+// through callbacks registered with metrics_gauge().
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+#define METRICS_BODY_SIZE 16384    // Enough for every series with room to spare
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+#define METRICS_MAX_GAUGES 16
+
+typedef enum {
+    ROUTE_OPTIONS,
+    ROUTE_GET,
+    ROUTE_POST,
+    ROUTE_ECHO,
+    ROUTE_NOT_FOUND,
+    ROUTE_METRICS,
+    ROUTE_STATIC,
+    ROUTE_REJECTED,                 // Refused before routing (400, 413, 431, 501, 503)
+    ROUTE_COUNT
+} metrics_route_t;
+
+static const char *const metrics_route_names[ROUTE_COUNT] = {
+    "options", "get", "post", "echo", "not_found", "metrics", "static", "rejected"
+};
+
+// Stages of a traced request (trace.h), each ending at one of its time stamps
+typedef enum {
+    STAGE_ADMIT,                    // Accepted to queued for a handler
+    STAGE_QUEUE,                    // Queued to taken by a worker
+    STAGE_FIRST_BYTE,               // Waiting for the client to send
+    STAGE_HEADERS,                  // First byte to a parsed header block
+    STAGE_DISPATCH,                 // Parsed to the handler starting
+    STAGE_HANDLER,                  // Handler, body and simulated workload
+    STAGE_WRITE,                    // Response going out
+    STAGE_COUNT
+} metrics_stage_t;
+
+static const char *const metrics_stage_names[STAGE_COUNT] = {
+    "admit", "queue", "first_byte", "headers", "dispatch", "handler", "write"
+};
+
+static const int metrics_statuses[] = { 200, 204, 304, 400, 404, 408, 413, 431, 501, 503 };
+#define METRICS_STATUS_COUNT (int)(sizeof(metrics_statuses) / sizeof(metrics_statuses[0]) + 1)
+
+// Histogram bucket upper bounds in microseconds
+static const uint64_t metrics_bounds_us[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000
+};
+#define METRICS_BUCKETS (int)(sizeof(metrics_bounds_us) / sizeof(metrics_bounds_us[0]))
+
+typedef struct {
+    uint64_t buckets[METRICS_BUCKETS + 1];  // Last one is +Inf
+    uint64_t sum_us;
+} metrics_histogram_t;
+
+typedef struct metrics_shard {
+    uint64_t requests[ROUTE_COUNT][METRICS_STATUS_COUNT];
+    metrics_histogram_t latency;
+    metrics_histogram_t queue_wait;
+    metrics_histogram_t stages[STAGE_COUNT];
+    uint64_t opened;                // Connections accepted
+    uint64_t closed;                // Connections closed
+    uint64_t busy;                  // 1 while a pool worker serves a client
+    struct metrics_shard *next;
+    int retired;                    // Its thread exited; free for reuse
+} __attribute__((aligned(CACHE_LINE))) metrics_shard_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    double (*read)(void);
+} metrics_gauge_t;
+
+static struct {
+    pthread_mutex_t lock;           // Guards the shard list and gauges, never the counters
+    pthread_once_t once;
+    pthread_key_t key;
+    metrics_shard_t *shards;
+    metrics_gauge_t gauges[METRICS_MAX_GAUGES];
+    int num_gauges;
+} metrics = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT, 0, NULL, { { 0 } }, 0 };
+
+static __thread metrics_shard_t *metrics_local;
+
+static inline void metrics_retire(void *shard) {
+    pthread_mutex_lock(&metrics.lock);
+    ((metrics_shard_t *)shard)->retired = 1;
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+static inline void metrics_init_key(void) {
+    pthread_key_create(&metrics.key, metrics_retire);
+}
+
+// This thread's shard: a retired one if there is one, else a new one
+static inline metrics_shard_t *metrics_attach(void) {
+    metrics_shard_t *shard;
+
+    pthread_once(&metrics.once, metrics_init_key);
+    pthread_mutex_lock(&metrics.lock);
+    for (shard = metrics.shards; shard != NULL; shard = shard->next) {
+        if (shard->retired)
+            break;
+    }
+    if (shard != NULL) {
+        shard->retired = 0;
+        shard->busy = 0;
+    } else if (posix_memalign((void **)&shard, CACHE_LINE, sizeof(*shard)) == 0) {
+        memset(shard, 0, sizeof(*shard));
+        shard->next = metrics.shards;
+        metrics.shards = shard;
+    } else {
+        // Out of memory: count into a throwaway shard rather than fail
+        static metrics_shard_t spare;
+        shard = &spare;
+    }
+    pthread_mutex_unlock(&metrics.lock);
+
+    pthread_setspecific(metrics.key, shard);
+    return shard;
+}
+
+static inline metrics_shard_t *metrics_shard(void) {
+    if (__builtin_expect(metrics_local == NULL, 0))
+        metrics_local = metrics_attach();
+    return metrics_local;
+}
+
+// Owner-only update; the relaxed store keeps scrapes from seeing torn values
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline void metrics_observe(metrics_histogram_t *h, uint64_t us) {
+    int b = 0;
+
+    while (b < METRICS_BUCKETS && us > metrics_bounds_us[b])
+        b++;
+    metrics_add(&h->buckets[b], 1);
+    metrics_add(&h->sum_us, us);
+}
+
+// A response went out: count it and its latency since start_us
+static inline void metrics_request(metrics_route_t route, int status, uint64_t start_us) {
+    metrics_shard_t *shard = metrics_shard();
+    int s = 0;
+
+    while (s < METRICS_STATUS_COUNT - 1 && metrics_statuses[s] != status)
+        s++;
+    metrics_add(&shard->requests[route][s], 1);
+    metrics_observe(&shard->latency, metrics_now_us() - start_us);
+}
+
+static inline void metrics_queue_wait(uint64_t us) {
+    metrics_observe(&metrics_shard()->queue_wait, us);
+}
+
+static inline void metrics_stage(metrics_stage_t stage, uint64_t us) {
+    metrics_observe(&metrics_shard()->stages[stage], us);
+}
+
+static inline void metrics_connection_opened(void) {
+    metrics_add(&metrics_shard()->opened, 1);
+}
+
+static inline void metrics_connection_closed(void) {
+    metrics_add(&metrics_shard()->closed, 1);
+}
+
+static inline void metrics_busy(int busy) {
+    __atomic_store_n(&metrics_shard()->busy, busy, __ATOMIC_RELAXED);
+}
+
+// Sum of the busy flags, for pool gauges
+static inline double metrics_busy_threads(void) {
+    uint64_t busy = 0;
+
+    pthread_mutex_lock(&metrics.lock);
+    for (metrics_shard_t *shard = metrics.shards; shard != NULL; shard = shard->next)
+        busy += __atomic_load_n(&shard->busy, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&metrics.lock);
+    return busy;
+}
+
+// Register a gauge. Gauges are registered at startup, so running out of
+// room is a build problem and stops the server rather than losing a series.
+static inline void metrics_gauge(const char *name, const char *help, double (*read)(void)) {
+    pthread_mutex_lock(&metrics.lock);
+    if (metrics.num_gauges == METRICS_MAX_GAUGES) {
+        fprintf(stderr, "Too many gauges for %s: raise METRICS_MAX_GAUGES\n", name);
+        exit(EXIT_FAILURE);
+    }
+    metrics.gauges[metrics.num_gauges++] = (metrics_gauge_t){ name, help, read };
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+} metrics_out_t;
+
+static inline void metrics_printf(metrics_out_t *out, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (out->len >= out->size)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(out->buf + out->len, out->size - out->len, fmt, ap);
+    va_end(ap);
+    out->len = n < 0 ? out->size : out->len + n;
+    if (out->len > out->size)
+        out->len = out->size;
+}
+
+static inline void metrics_sum_histogram(metrics_histogram_t *into, const metrics_histogram_t *h) {
+    for (int b = 0; b <= METRICS_BUCKETS; b++)
+        into->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    into->sum_us += __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_histogram_count(const metrics_histogram_t *h) {
+    uint64_t count = 0;
+
+    for (int b = 0; b <= METRICS_BUCKETS; b++)
+        count += h->buckets[b];
+    return count;
+}
+
+// The series of one histogram; label is "" or one name="value" pair
+static inline void metrics_print_buckets(metrics_out_t *out, const char *name, const char *label,
+                                         const metrics_histogram_t *h) {
+    const char *sep = label[0] != '\0' ? "," : "";
+    uint64_t count = 0;
+
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        count += h->buckets[b];
+        metrics_printf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, label, sep,
+                       metrics_bounds_us[b] / 1e6, (unsigned long)count);
+    }
+    count += h->buckets[METRICS_BUCKETS];
+    metrics_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, label, sep,
+                   (unsigned long)count);
+    if (label[0] != '\0')
+        metrics_printf(out, "%s_sum{%s} %.6f\n%s_count{%s} %lu\n", name, label, h->sum_us / 1e6,
+                       name, label, (unsigned long)count);
+    else
+        metrics_printf(out, "%s_sum %.6f\n%s_count %lu\n", name, h->sum_us / 1e6, name,
+                       (unsigned long)count);
+}
+
+static inline void metrics_print_histogram(metrics_out_t *out, const char *name, const char *help,
+                                           const metrics_histogram_t *h) {
+    metrics_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    metrics_print_buckets(out, name, "", h);
+}
+
+// Render every metric into buf; returns the length, truncated to size
+static inline size_t metrics_render(char *buf, size_t size) {
+    metrics_out_t out = { buf, size, 0 };
+    uint64_t requests[ROUTE_COUNT][METRICS_STATUS_COUNT];
+    metrics_histogram_t latency, queue_wait, stages[STAGE_COUNT];
+    uint64_t opened = 0, closed = 0;
+    int traced = 0;
+
+    memset(requests, 0, sizeof(requests));
+    memset(&latency, 0, sizeof(latency));
+    memset(&queue_wait, 0, sizeof(queue_wait));
+    memset(stages, 0, sizeof(stages));
+
+    pthread_mutex_lock(&metrics.lock);
+    for (metrics_shard_t *shard = metrics.shards; shard != NULL; shard = shard->next) {
+        for (int r = 0; r < ROUTE_COUNT; r++) {
+            for (int s = 0; s < METRICS_STATUS_COUNT; s++)
+                requests[r][s] += __atomic_load_n(&shard->requests[r][s], __ATOMIC_RELAXED);
+        }
+        metrics_sum_histogram(&latency, &shard->latency);
+        metrics_sum_histogram(&queue_wait, &shard->queue_wait);
+        for (int s = 0; s < STAGE_COUNT; s++)
+            metrics_sum_histogram(&stages[s], &shard->stages[s]);
+        opened += __atomic_load_n(&shard->opened, __ATOMIC_RELAXED);
+        closed += __atomic_load_n(&shard->closed, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&metrics.lock);
+
+    metrics_printf(&out, "# HELP http_requests_total Responses sent, by route and status.\n"
+                         "# TYPE http_requests_total counter\n");
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        for (int s = 0; s < METRICS_STATUS_COUNT; s++) {
+            if (requests[r][s] == 0)
+                continue;
+            if (s < METRICS_STATUS_COUNT - 1)
+                metrics_printf(&out, "http_requests_total{route=\"%s\",status=\"%d\"} %lu\n",
+                               metrics_route_names[r], metrics_statuses[s],
+                               (unsigned long)requests[r][s]);
+            else
+                metrics_printf(&out, "http_requests_total{route=\"%s\",status=\"other\"} %lu\n",
+                               metrics_route_names[r], (unsigned long)requests[r][s]);
+        }
+    }
+
+    metrics_print_histogram(&out, "http_request_duration_seconds",
+                            "Time from a complete request to its response being sent.", &latency);
+    metrics_print_histogram(&out, "http_queue_wait_seconds",
+                            "Time accepted clients waited for a worker.", &queue_wait);
+
+    // Stages are only timed while tracing is on; stages an engine does not
+    // go through stay empty and are left out
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        char label[32];
+
+        if (metrics_histogram_count(&stages[s]) == 0)
+            continue;
+        if (!traced++)
+            metrics_printf(&out, "# HELP http_request_stage_seconds Time traced requests "
+                                 "spent in each stage.\n"
+                                 "# TYPE http_request_stage_seconds histogram\n");
+        snprintf(label, sizeof(label), "stage=\"%s\"", metrics_stage_names[s]);
+        metrics_print_buckets(&out, "http_request_stage_seconds", label, &stages[s]);
+    }
+
+    metrics_printf(&out, "# HELP http_connections_open Client connections currently open.\n"
+                         "# TYPE http_connections_open gauge\n"
+                         "http_connections_open %ld\n",
+                   (long)(opened - closed));
+    metrics_printf(&out, "# HELP http_connections_total Client connections accepted.\n"
+                         "# TYPE http_connections_total counter\n"
+                         "http_connections_total %lu\n",
+                   (unsigned long)opened);
+
+    pthread_mutex_lock(&metrics.lock);
+    int num_gauges = metrics.num_gauges;
+    pthread_mutex_unlock(&metrics.lock);
+    for (int g = 0; g < num_gauges; g++) {
+        metrics_gauge_t *gauge = &metrics.gauges[g];
+        metrics_printf(&out, "# HELP %s %s\n# TYPE %s gauge\n%s %g\n",
+                       gauge->name, gauge->help, gauge->name, gauge->name, gauge->read());
+    }
+
+    return out.len;
+}
+
+#endif
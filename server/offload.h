@@ -0,0 +1,225 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+// Offload executor: a bounded set of threads for the blocking part of a
+// handler (disk or CPU work, a real sleep), so the thread that owns the
+// connection keeps serving its other sockets meanwhile.
+//
+// A job completes to a port. Each event loop owns one: an eventfd it waits
+// on along with its sockets, and a lock-free list of finished jobs. A
+// worker runs the job, pushes it on the list and writes the eventfd if the
+// list was empty; the loop then calls each job's done callback on its own
+// thread, where the connection is safe to touch again. At most
+// --offload-queue jobs wait for a worker; offload_submit() refuses more,
+// and the request is answered 503 instead.
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "metrics.h"
+
+#define OFFLOAD_THREADS 4
+#define OFFLOAD_QUEUE 256
+
+#define OFFLOAD_OPTSTRING "o:O:"
+#define OFFLOAD_OPTIONS                                             \
+    { "offload-threads", required_argument, NULL, 'o' },            \
+    { "offload-queue",   required_argument, NULL, 'O' }
+#define OFFLOAD_USAGE                                                           \
+    "  --offload-threads=N\n"                                                    \
+    "                    threads running handlers' blocking work (default 4)\n" \
+    "  --offload-queue=N blocking jobs waiting for one before requests get a\n" \
+    "                    503 (default 256)\n"
+
+// Blocking work a handler leaves to the executor
+typedef void (*offload_work_fn)(unsigned arg);
+
+typedef struct offload_job offload_job_t;
+
+// Where finished jobs go back to their owner
+typedef struct {
+    int event_fd;                   // Readable while jobs are on done
+    offload_job_t *done;            // Pushed by the workers, LIFO
+} offload_port_t;
+
+// A job, embedded in whatever is waiting on it
+struct offload_job {
+    offload_work_fn work;
+    unsigned arg;
+    void (*callback)(void *data);   // On the port owner's thread, once work has run
+    void *data;
+    offload_port_t *port;
+    offload_job_t *next;
+};
+
+static struct {
+    int threads;
+    unsigned queue_max;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    offload_job_t *head, *tail;     // Waiting for a worker, oldest first
+    unsigned queued;
+    unsigned running;
+} offload = {
+    .threads = OFFLOAD_THREADS,
+    .queue_max = OFFLOAD_QUEUE,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+};
+
+// Handle one of OFFLOAD_OPTIONS. Returns 1 if c was one of them, 0 if it
+// is the caller's.
+static inline int offload_option(int c, const char *arg) {
+    switch (c) {
+    case 'o':
+        offload.threads = atoi(arg);
+        return 1;
+    case 'O':
+        offload.queue_max = (unsigned)atoi(arg);
+        return 1;
+    }
+    return 0;
+}
+
+// Set up a port for an event loop to wait on; -1 on failure
+static inline int offload_port_init(offload_port_t *port) {
+    port->done = NULL;
+    port->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return port->event_fd < 0 ? -1 : 0;
+}
+
+// Run work(arg) on the executor, then callback(data) on the thread that
+// drains port. Returns -1 when the queue is full, in which case neither
+// runs.
+static inline int offload_submit(offload_job_t *job, offload_port_t *port, offload_work_fn work,
+                                 unsigned arg, void (*callback)(void *data), void *data) {
+    job->work = work;
+    job->arg = arg;
+    job->callback = callback;
+    job->data = data;
+    job->port = port;
+    job->next = NULL;
+
+    pthread_mutex_lock(&offload.lock);
+    if (offload.queued >= offload.queue_max) {
+        pthread_mutex_unlock(&offload.lock);
+        return -1;
+    }
+    if (offload.tail != NULL)
+        offload.tail->next = job;
+    else
+        offload.head = job;
+    offload.tail = job;
+    offload.queued++;
+    pthread_cond_signal(&offload.ready);
+    pthread_mutex_unlock(&offload.lock);
+    return 0;
+}
+
+// Hand a finished job back to its port
+static inline void offload_complete(offload_job_t *job) {
+    offload_port_t *port = job->port;
+    offload_job_t *head = __atomic_load_n(&port->done, __ATOMIC_RELAXED);
+
+    do {
+        job->next = head;
+    } while (!__atomic_compare_exchange_n(&port->done, &head, job, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Only the push onto an empty list needs to wake the loop
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(port->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            log_error("Failed to signal offload completion: %s", strerror(errno));
+    }
+}
+
+static inline void *offload_thread(void *arg) {
+    offload_job_t *job;
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&offload.lock);
+        while (offload.head == NULL)
+            pthread_cond_wait(&offload.ready, &offload.lock);
+        job = offload.head;
+        offload.head = job->next;
+        if (offload.head == NULL)
+            offload.tail = NULL;
+        offload.queued--;
+        offload.running++;
+        pthread_mutex_unlock(&offload.lock);
+
+        job->work(job->arg);
+
+        __atomic_fetch_sub(&offload.running, 1, __ATOMIC_RELAXED);
+        offload_complete(job);
+    }
+
+    return NULL;
+}
+
+// Call back every job finished for port, oldest first. For an owner that
+// has already read the eventfd (io_uring reads it through the ring).
+static inline void offload_drain(offload_port_t *port) {
+    offload_job_t *list = __atomic_exchange_n(&port->done, NULL, __ATOMIC_ACQUIRE);
+    offload_job_t *fifo = NULL;
+
+    while (list != NULL) {
+        offload_job_t *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    while (fifo != NULL) {
+        offload_job_t *next = fifo->next;
+        fifo->callback(fifo->data);
+        fifo = next;
+    }
+}
+
+// The port's eventfd is readable: reset it and call back what finished
+static inline void offload_port_ready(offload_port_t *port) {
+    uint64_t count;
+
+    if (read(port->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_error("Failed to read offload completions: %s", strerror(errno));
+    offload_drain(port);
+}
+
+static inline double offload_queue_depth(void) {
+    return __atomic_load_n(&offload.queued, __ATOMIC_RELAXED);
+}
+
+static inline double offload_busy_threads(void) {
+    return __atomic_load_n(&offload.running, __ATOMIC_RELAXED);
+}
+
+// Start the executor's threads. Called once from main() before the engine
+// starts.
+static inline int offload_start(void) {
+    if (offload.threads < 1)
+        offload.threads = 1;
+
+    for (int i = 0; i < offload.threads; i++) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, offload_thread, NULL) != 0)
+            return -1;
+        pthread_detach(thread);
+    }
+
+    metrics_gauge("offload_queue_depth", "Blocking jobs waiting for an offload thread.",
+                  offload_queue_depth);
+    metrics_gauge("offload_busy_threads", "Offload threads running a job.", offload_busy_threads);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef OUT_CHAIN_H
+#define OUT_CHAIN_H
+
+// Output chain: bytes a connection has produced and not yet sent, copied
+// into a list of slab segments. A response is mostly iovecs over memory
+// that outlives it (response.h); the chain holds what does not, such as
+// pieces of a streamed body whose input buffer is to be reused, so the
+// producer can run ahead of a slow socket. The engine queues the chain
+// behind the response's iovecs and sends both with one writev() or
+// sendmsg(). The producer stops at a high-water mark (CONN_OUT_HIGH_WATER
+// in http_conn.h) and goes on once the chain has drained, so a slow reader
+// costs a bounded amount of memory.
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "response.h"
+#include "slab.h"
+
+#define OUT_SEGMENT_SIZE 16384      // Slab object per segment, header included
+
+typedef struct out_segment {
+    struct out_segment *next;
+    size_t start;                   // First byte not yet sent
+    size_t end;                     // End of what was written into data
+    char data[];
+} out_segment_t;
+
+#define OUT_SEGMENT_DATA (OUT_SEGMENT_SIZE - sizeof(out_segment_t))
+
+typedef struct {
+    out_segment_t *head, *tail;
+    size_t bytes;                   // Unsent, over all segments
+} out_chain_t;
+
+// Copy len bytes onto the end of the chain; -1 if out of memory, with
+// whatever fitted kept
+static inline int out_chain_add(out_chain_t *c, const void *data, size_t len) {
+    const char *p = data;
+
+    while (len > 0) {
+        out_segment_t *s = c->tail;
+        size_t n;
+
+        if (s == NULL || s->end == OUT_SEGMENT_DATA) {
+            if ((s = slab_alloc(OUT_SEGMENT_SIZE)) == NULL)
+                return -1;
+            s->next = NULL;
+            s->start = s->end = 0;
+            if (c->tail != NULL)
+                c->tail->next = s;
+            else
+                c->head = s;
+            c->tail = s;
+        }
+
+        n = OUT_SEGMENT_DATA - s->end;
+        if (n > len)
+            n = len;
+        memcpy(s->data + s->end, p, n);
+        s->end += n;
+        c->bytes += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Append one chunk of a chunked body, framing included; an empty one is
+// the last chunk
+static inline int out_chain_add_chunk(out_chain_t *c, const void *data, size_t len) {
+    char line[24];
+
+    if (len == 0)
+        return out_chain_add(c, "0\r\n\r\n", 5);
+    if (out_chain_add(c, line, response_chunk_line(line, len)) < 0 ||
+        out_chain_add(c, data, len) < 0)
+        return -1;
+    return out_chain_add(c, "\r\n", 2);
+}
+
+// Point up to max iovecs at the unsent bytes, in order; returns how many
+static inline int out_chain_iov(const out_chain_t *c, struct iovec *iov, int max) {
+    int n = 0;
+
+    for (out_segment_t *s = c->head; s != NULL && n < max; s = s->next) {
+        iov[n].iov_base = s->data + s->start;
+        iov[n].iov_len = s->end - s->start;
+        n++;
+    }
+    return n;
+}
+
+// Drop n sent bytes from the front, freeing the segments they empty
+static inline void out_chain_consume(out_chain_t *c, size_t n) {
+    c->bytes -= n;
+    while (n > 0 && c->head != NULL) {
+        out_segment_t *s = c->head;
+        size_t left = s->end - s->start;
+
+        if (n < left) {
+            s->start += n;
+            return;
+        }
+        n -= left;
+        c->head = s->next;
+        slab_free(s, OUT_SEGMENT_SIZE);
+    }
+    if (c->head == NULL)
+        c->tail = NULL;
+}
+
+// Drop everything, sent or not
+static inline void out_chain_free(out_chain_t *c) {
+    while (c->head != NULL) {
+        out_segment_t *s = c->head;
+
+        c->head = s->next;
+        slab_free(s, OUT_SEGMENT_SIZE);
+    }
+    c->tail = NULL;
+    c->bytes = 0;
+}
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+// Response builder over pre-rendered header blocks.
+//
+// A response is a short list of iovecs: a status line and static headers
+// rendered once at compile time, the cached Date line, Content-Length,
+// the Connection line and the body. Nothing is formatted with printf and
+// nothing is copied except the clock strings; the whole response goes
+// out with one writev(). The iovecs point into the response itself, so
+// build it where it will be sent from and never copy it.
+//
+// The Date line and the "[YYYY-MM-DD HH:MM:SS]" stamp used in bodies are
+// rendered once per second by a clock thread (http_clock_start()), so
+// requests never call time(), localtime() or strftime().
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "io_wait.h"
+
+#define RESPONSE_MAX_IOV 8
+
+#define CORS_HEADERS \
+    "Access-Control-Allow-Origin: *\r\n" \
+    "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n" \
+    "Access-Control-Allow-Headers: Content-Type\r\n"
+
+// Start with, or append, a pre-rendered string literal or char array
+#define RESPONSE_START_LITERAL(r, s) response_start((r), (s), sizeof(s) - 1)
+#define RESPONSE_ADD_LITERAL(r, s) response_add((r), (s), sizeof(s) - 1)
+
+#define HTTP_DATE_LINE_SIZE 40      // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+#define HTTP_STAMP_SIZE 24          // "[1994-11-06 08:49:37]"
+
+// Two slots, flipped by the clock thread once per second; readers copy
+// out of the current one within microseconds of loading the index
+typedef struct {
+    char date_line[2][HTTP_DATE_LINE_SIZE];
+    size_t date_line_len;
+    char stamp[2][HTTP_STAMP_SIZE];
+    size_t stamp_len;
+    int current;
+} http_clock_t;
+
+static http_clock_t http_clock;
+
+typedef struct {
+    struct iovec iov[RESPONSE_MAX_IOV];
+    int iovcnt;
+    int iov_pos;                    // First iovec not completely sent
+    size_t remaining;               // Bytes left to send
+    char date_line[HTTP_DATE_LINE_SIZE];
+    char stamp[HTTP_STAMP_SIZE];
+    char length_line[40];
+    struct msghdr msg;              // For engines that submit a sendmsg
+} response_t;
+
+static inline void http_clock_render(int slot) {
+    time_t now = time(NULL);
+    struct tm tm;
+
+    gmtime_r(&now, &tm);
+    http_clock.date_line_len = strftime(http_clock.date_line[slot], HTTP_DATE_LINE_SIZE,
+                                        "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    localtime_r(&now, &tm);
+    http_clock.stamp_len = strftime(http_clock.stamp[slot], HTTP_STAMP_SIZE,
+                                    "[%Y-%m-%d %H:%M:%S]", &tm);
+}
+
+// Re-render the strings right after every wall-clock second boundary
+static inline void *http_clock_thread(void *arg) {
+    struct timespec next;
+    (void)arg;
+
+    while (1) {
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec++;
+        next.tv_nsec = 0;
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+
+        int slot = !__atomic_load_n(&http_clock.current, __ATOMIC_RELAXED);
+        http_clock_render(slot);
+        __atomic_store_n(&http_clock.current, slot, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+// Render the first strings and start the clock thread
+static inline int http_clock_start(void) {
+    pthread_t thread;
+
+    http_clock_render(0);
+    if (pthread_create(&thread, NULL, http_clock_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+static inline void response_add(response_t *r, const void *data, size_t len) {
+    if (len == 0 || r->iovcnt == RESPONSE_MAX_IOV)
+        return;
+    r->iov[r->iovcnt].iov_base = (void *)data;
+    r->iov[r->iovcnt].iov_len = len;
+    r->iovcnt++;
+    r->remaining += len;
+}
+
+// Start a response with its pre-rendered status line and static headers
+static inline void response_start(response_t *r, const char *head, size_t len) {
+    r->iovcnt = 0;
+    r->iov_pos = 0;
+    r->remaining = 0;
+    response_add(r, head, len);
+}
+
+static inline void response_add_date(response_t *r) {
+    int slot = __atomic_load_n(&http_clock.current, __ATOMIC_ACQUIRE);
+    size_t len = http_clock.date_line_len;
+
+    memcpy(r->date_line, http_clock.date_line[slot], len);
+    response_add(r, r->date_line, len);
+}
+
+// Append the "[YYYY-MM-DD HH:MM:SS]" stamp, for bodies
+static inline void response_add_stamp(response_t *r) {
+    int slot = __atomic_load_n(&http_clock.current, __ATOMIC_ACQUIRE);
+    size_t len = http_clock.stamp_len;
+
+    memcpy(r->stamp, http_clock.stamp[slot], len);
+    response_add(r, r->stamp, len);
+}
+
+static inline void response_add_length(response_t *r, size_t length) {
+    static const char prefix[] = "Content-Length: ";
+    char digits[20];
+    int n = 0;
+    size_t len = sizeof(prefix) - 1;
+
+    do {
+        digits[n++] = '0' + length % 10;
+        length /= 10;
+    } while (length > 0);
+
+    memcpy(r->length_line, prefix, len);
+    while (n > 0)
+        r->length_line[len++] = digits[--n];
+    r->length_line[len++] = '\r';
+    r->length_line[len++] = '\n';
+    response_add(r, r->length_line, len);
+}
+
+// Connection line plus the blank line that ends the headers
+static inline void response_end_headers(response_t *r, int keep_alive) {
+    if (keep_alive)
+        RESPONSE_ADD_LITERAL(r, "Connection: keep-alive\r\n\r\n");
+    else
+        RESPONSE_ADD_LITERAL(r, "Connection: close\r\n\r\n");
+}
+
+// Render the size line of a chunk of len bytes (len > 0) into line, which
+// takes at least 18 bytes; returns its length
+static inline size_t response_chunk_line(char *line, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    char digits[16];
+    int n = 0;
+    size_t out = 0;
+
+    do {
+        digits[n] = hex[(len >> (4 * n)) & 0xf];
+        n++;
+    } while (n < 16 && (len >> (4 * n)) != 0);
+    while (n > 0)
+        line[out++] = digits[--n];
+    line[out++] = '\r';
+    line[out++] = '\n';
+    return out;
+}
+
+// Append one chunk of a chunked body; an empty one is the last chunk and
+// ends the body. The size line is kept in length_line, which chunked
+// responses have no other use for.
+static inline void response_add_chunk(response_t *r, const void *data, size_t len) {
+    if (len == 0) {
+        RESPONSE_ADD_LITERAL(r, "0\r\n\r\n");
+        return;
+    }
+
+    response_add(r, r->length_line, response_chunk_line(r->length_line, len));
+    response_add(r, data, len);
+    RESPONSE_ADD_LITERAL(r, "\r\n");
+}
+
+// Account for n sent bytes, so the next writev() resumes where this stopped
+static inline void response_advance(response_t *r, size_t n) {
+    r->remaining -= n;
+    while (n > 0 && r->iov_pos < r->iovcnt) {
+        struct iovec *v = &r->iov[r->iov_pos];
+
+        if (n < v->iov_len) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+            return;
+        }
+        n -= v->iov_len;
+        r->iov_pos++;
+    }
+}
+
+// One writev() of whatever is left; returns its result
+static inline ssize_t response_writev(int fd, response_t *r) {
+    ssize_t n;
+
+    do {
+        n = writev(fd, r->iov + r->iov_pos, r->iovcnt - r->iov_pos);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+        response_advance(r, n);
+    return n;
+}
+
+// Point the message header at the unsent iovecs; it must stay put until
+// the sendmsg completes
+static inline struct msghdr *response_msghdr(response_t *r) {
+    memset(&r->msg, 0, sizeof(r->msg));
+    r->msg.msg_iov = r->iov + r->iov_pos;
+    r->msg.msg_iovlen = r->iovcnt - r->iov_pos;
+    return &r->msg;
+}
+
+// Blocking send of the whole response; returns 0 or -1
+static inline int response_send(int fd, response_t *r) {
+    while (r->remaining > 0) {
+        if (response_writev(fd, r) < 0 && !io_retry(fd, POLLOUT))
+            return -1;
+    }
+    return 0;
+}
+
+// Blocking send of one chunk, once the chunked response's headers are out
+static inline int response_send_chunk(int fd, const void *data, size_t len) {
+    response_t r;
+
+    response_start(&r, NULL, 0);
+    response_add_chunk(&r, data, len);
+    return response_send(fd, &r);
+}
+
+#endif
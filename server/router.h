@@ -0,0 +1,569 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+// Routes and responses, shared by every engine so they all answer the same
+// requests with the same bytes and the same simulated workload, and differ
+// only in how they get bytes in and out and how they wait out the delay.
+//
+// router_handle() builds the whole response for a parsed request, except
+// that POST /echo gets only its headers: the engine streams the body back
+// (http_conn.h, http_serve.h). Static files are the engine's business too.
+// A handler with blocking work to do leaves it in the result instead of
+// doing it; the engine runs it on the offload executor (offload.h) and
+// sends the response once it is done.
+//
+// The route set is fixed at build time (ROUTER_ROUTES). router_init()
+// compiles it once at startup: routes with a literal path go into a
+// perfect-hash table keyed on (method, path), found with one hash and one
+// compare; patterns with ":name" parameters or a trailing "*" go into a
+// per-method segment trie that is only walked when the table misses.
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_parser.h"
+#include "metrics.h"
+#include "offload.h"
+#include "response.h"
+#include "slab.h"
+
+#define WORK_DELAY_MS 5000          // Simulated workload for GET and POST
+#define ROUTER_MAX_DELAY_MS 60000   // Longest workload GET /delay/:ms or /block/:ms asks for
+
+// Pre-rendered status lines and static headers
+static const char head_204[] = "HTTP/1.1 204 No Content\r\n" CORS_HEADERS;
+#define TEXT_HEAD(status) "HTTP/1.1 " status "\r\nContent-Type: text/plain\r\n" CORS_HEADERS
+static const char head_200[] = TEXT_HEAD("200 OK");
+static const char head_400[] = TEXT_HEAD("400 Bad Request");
+static const char head_404[] = TEXT_HEAD("404 Not Found");
+static const char head_431[] = TEXT_HEAD("431 Request Header Fields Too Large");
+static const char head_501[] = TEXT_HEAD("501 Not Implemented");
+static const char head_503[] = TEXT_HEAD("503 Service Unavailable");
+static const char head_metrics[] =
+    "HTTP/1.1 200 OK\r\nContent-Type: " METRICS_CONTENT_TYPE "\r\n";
+static const char head_echo[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: application/json\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    CORS_HEADERS;
+static const char head_echo_close[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: application/json\r\n"
+    CORS_HEADERS;
+
+// What the router made of a request
+typedef struct {
+    metrics_route_t route;
+    int status;
+    unsigned delay_ms;              // Workload to wait out before sending
+    offload_work_fn work;           // Or blocking work to run first, NULL for none
+    unsigned work_arg;
+    int chunked;                    // A streamed body goes out in chunks, else up to the close
+} router_result_t;
+
+typedef enum {
+    METHOD_GET,
+    METHOD_HEAD,
+    METHOD_POST,
+    METHOD_PUT,
+    METHOD_DELETE,
+    METHOD_PATCH,
+    METHOD_OPTIONS,
+    METHOD_OTHER,
+    METHOD_COUNT
+} router_method_t;
+
+#define ROUTER_MAX_PARAMS 4
+
+// Values of the ":name" segments a pattern matched, pointing into the request
+typedef struct {
+    int count;
+    struct {
+        http_span_t name;
+        http_span_t value;
+    } p[ROUTER_MAX_PARAMS];
+} route_params_t;
+
+// Value of a route parameter by name, or NULL
+static inline const http_span_t *router_param(const route_params_t *params, const char *name) {
+    for (int i = 0; i < params->count; i++) {
+        if (http_span_eq(params->p[i].name, name))
+            return &params->p[i].value;
+    }
+    return NULL;
+}
+
+// What a handler answers with; router_handle() renders it
+typedef struct {
+    const char *head;               // Status line and static headers
+    size_t head_len;
+    const char *body;               // NULL for none
+    size_t body_len;                // Taken from strlen(body) when 0
+    int status;
+    unsigned delay_ms;
+    offload_work_fn work;           // Blocking work, run off the I/O thread
+    unsigned work_arg;
+    int stream;                     // Headers only; the engine sends the body
+    int chunked;                    // ... framed in chunks rather than by the close
+} route_answer_t;
+
+#define ANSWER_HEAD(a, s) ((a)->head = (s), (a)->head_len = sizeof(s) - 1)
+
+typedef void (*route_fn)(const http_request_t *req, const route_params_t *params,
+                         route_answer_t *a, arena_t *arena);
+
+static inline void route_options(const http_request_t *req, const route_params_t *params,
+                                 route_answer_t *a, arena_t *arena) {
+    (void)req, (void)params, (void)arena;
+    ANSWER_HEAD(a, head_204);
+    a->status = 204;
+}
+
+// JSON echo: the headers now, the body chunk by chunk as it arrives
+static inline void route_echo(const http_request_t *req, const route_params_t *params,
+                              route_answer_t *a, arena_t *arena) {
+    (void)params, (void)arena;
+    // An HTTP/1.0 client knows no chunks: its echo is delimited by the close
+    if (req->minor_version == 0) {
+        ANSWER_HEAD(a, head_echo_close);
+    } else {
+        ANSWER_HEAD(a, head_echo);
+        a->chunked = 1;
+    }
+    a->status = 200;
+    a->stream = 1;
+}
+
+// Prometheus scrape, answered at once without the simulated workload
+static inline void route_metrics(const http_request_t *req, const route_params_t *params,
+                                 route_answer_t *a, arena_t *arena) {
+    char *text = arena_alloc(arena, METRICS_BODY_SIZE);
+
+    (void)req, (void)params;
+    if (text == NULL) {
+        ANSWER_HEAD(a, head_503);
+        a->body = "503 Service Unavailable\n";
+        a->status = 503;
+        return;
+    }
+    ANSWER_HEAD(a, head_metrics);
+    a->body = text;
+    a->body_len = metrics_render(text, METRICS_BODY_SIZE);
+    a->status = 200;
+}
+
+static inline void route_get(const http_request_t *req, const route_params_t *params,
+                             route_answer_t *a, arena_t *arena) {
+    (void)req, (void)params, (void)arena;
+    ANSWER_HEAD(a, head_200);
+    a->body = "GET request response\n";
+    a->delay_ms = WORK_DELAY_MS;
+    a->status = 200;
+}
+
+static inline void route_post(const http_request_t *req, const route_params_t *params,
+                              route_answer_t *a, arena_t *arena) {
+    (void)req, (void)params, (void)arena;
+    ANSWER_HEAD(a, head_200);
+    a->body = "POST request response\n";
+    a->delay_ms = WORK_DELAY_MS;
+    a->status = 200;
+}
+
+// The ":ms" parameter, or -1 (with a 400 answered) if it is not a number
+// of milliseconds up to ROUTER_MAX_DELAY_MS
+static inline long route_param_ms(const route_params_t *params, route_answer_t *a) {
+    const http_span_t *ms = router_param(params, "ms");
+    unsigned delay = 0;
+
+    for (size_t i = 0; i < ms->len && delay <= ROUTER_MAX_DELAY_MS; i++) {
+        if (ms->ptr[i] < '0' || ms->ptr[i] > '9') {
+            delay = ROUTER_MAX_DELAY_MS + 1;
+            break;
+        }
+        delay = delay * 10 + (ms->ptr[i] - '0');
+    }
+    if (delay > ROUTER_MAX_DELAY_MS) {
+        ANSWER_HEAD(a, head_400);
+        a->body = "400 Bad Request\n";
+        a->status = 400;
+        return -1;
+    }
+    return delay;
+}
+
+// The GET workload, with a length of the client's choosing
+static inline void route_delay(const http_request_t *req, const route_params_t *params,
+                               route_answer_t *a, arena_t *arena) {
+    long delay = route_param_ms(params, a);
+
+    if (delay < 0)
+        return;
+    route_get(req, params, a, arena);
+    a->delay_ms = delay;
+}
+
+// Work that holds its thread for ms milliseconds, standing in for a disk
+// read or a CPU-bound computation
+static inline void route_block_work(unsigned ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+// The GET workload as blocking work rather than a wait
+static inline void route_block(const http_request_t *req, const route_params_t *params,
+                               route_answer_t *a, arena_t *arena) {
+    long ms = route_param_ms(params, a);
+
+    if (ms < 0)
+        return;
+    route_get(req, params, a, arena);
+    a->delay_ms = 0;
+    a->work = route_block_work;
+    a->work_arg = ms;
+}
+
+// The route set: method, path pattern, metrics label and handler. A literal
+// path matches exactly; ":name" matches one segment; a trailing "*"
+// matches whatever is left, including nothing. Literal segments win over
+// parameters, and parameters over "*".
+#define ROUTER_ROUTES(X)                                        \
+    X(OPTIONS, "*",           ROUTE_OPTIONS, route_options)     \
+    X(POST,    "/echo",       ROUTE_ECHO,    route_echo)        \
+    X(GET,     "/metrics",    ROUTE_METRICS, route_metrics)     \
+    X(GET,     "/delay/:ms",  ROUTE_GET,     route_delay)       \
+    X(GET,     "/block/:ms",  ROUTE_GET,     route_block)       \
+    X(GET,     "/*",          ROUTE_GET,     route_get)         \
+    X(POST,    "/*",          ROUTE_POST,    route_post)
+
+typedef struct {
+    router_method_t method;
+    const char *pattern;
+    size_t len;
+    metrics_route_t route;
+    route_fn fn;
+} route_t;
+
+#define ROUTER_ENTRY(method, pattern, route, fn) \
+    { METHOD_##method, pattern, sizeof(pattern) - 1, route, fn },
+
+static const route_t router_routes[] = { ROUTER_ROUTES(ROUTER_ENTRY) };
+
+#define ROUTER_ROUTE_COUNT (int)(sizeof(router_routes) / sizeof(router_routes[0]))
+#define ROUTER_TABLE_SIZE 64        // Power of two, at least twice the literal routes
+#define ROUTER_MAX_NODES 64         // Trie nodes over all methods
+#define ROUTER_MAX_DEPTH 16         // Segments a trie lookup follows
+
+_Static_assert(ROUTER_TABLE_SIZE >= 2 * ROUTER_ROUTE_COUNT, "route table too small");
+
+// One path segment in a method's trie. Literal children hang off child and
+// are chained through sibling; a ":name" child and a "*" route are kept
+// apart so they are only tried once the literals fail.
+typedef struct {
+    http_span_t label;              // Literal segment, or the parameter name
+    int16_t child;
+    int16_t sibling;
+    int16_t param;                  // The ":name" child, or -1
+    int16_t route;                  // Route ending at this segment, or -1
+    int16_t wildcard;               // Route taking the rest after "*", or -1
+} router_node_t;
+
+static struct {
+    uint32_t seed;
+    int8_t slots[ROUTER_TABLE_SIZE];   // Route index, or -1 for an empty slot
+    router_node_t nodes[ROUTER_MAX_NODES];
+    int nodes_used;
+    int16_t roots[METHOD_COUNT];
+} router;
+
+// Tell the method apart by its length and first byte before comparing
+static inline router_method_t router_method(http_span_t m) {
+    switch (m.len) {
+    case 3:
+        if (memcmp(m.ptr, "GET", 3) == 0) return METHOD_GET;
+        if (memcmp(m.ptr, "PUT", 3) == 0) return METHOD_PUT;
+        break;
+    case 4:
+        if (memcmp(m.ptr, "POST", 4) == 0) return METHOD_POST;
+        if (memcmp(m.ptr, "HEAD", 4) == 0) return METHOD_HEAD;
+        break;
+    case 5:
+        if (memcmp(m.ptr, "PATCH", 5) == 0) return METHOD_PATCH;
+        break;
+    case 6:
+        if (memcmp(m.ptr, "DELETE", 6) == 0) return METHOD_DELETE;
+        break;
+    case 7:
+        if (memcmp(m.ptr, "OPTIONS", 7) == 0) return METHOD_OPTIONS;
+        break;
+    }
+    return METHOD_OTHER;
+}
+
+// FNV-1a over the path, started from the seed and the method
+static inline unsigned router_hash(uint32_t seed, router_method_t method,
+                                   const char *path, size_t len) {
+    uint32_t h = (seed ^ ((uint32_t)method * 0x9e3779b9u)) * 16777619u;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)path[i]) * 16777619u;
+    return (h ^ (h >> 16)) & (ROUTER_TABLE_SIZE - 1);
+}
+
+static inline int router_is_literal(const route_t *route) {
+    return memchr(route->pattern, ':', route->len) == NULL &&
+           memchr(route->pattern, '*', route->len) == NULL;
+}
+
+static inline int router_node_new(http_span_t label) {
+    router_node_t *node;
+
+    if (router.nodes_used == ROUTER_MAX_NODES)
+        return -1;
+    node = &router.nodes[router.nodes_used];
+    node->label = label;
+    node->child = node->sibling = node->param = -1;
+    node->route = node->wildcard = -1;
+    return router.nodes_used++;
+}
+
+// Add a pattern route to its method's trie
+static inline int router_trie_add(int index) {
+    const route_t *route = &router_routes[index];
+    const char *p = route->pattern, *end = p + route->len;
+    int node = router.roots[route->method], params = 0;
+
+    if (node < 0 && (node = router.roots[route->method] = router_node_new((http_span_t){ 0 })) < 0)
+        return -1;
+    if (p < end && *p == '/')
+        p++;
+
+    while (p < end) {
+        const char *q = memchr(p, '/', end - p);
+        http_span_t seg = { p, (q != NULL ? q : end) - p };
+        int next;
+
+        if (seg.len == 1 && *p == '*') {
+            if (q != NULL)
+                return -1;          // "*" only at the end
+            router.nodes[node].wildcard = index;
+            return 0;
+        }
+        if (seg.len > 1 && *p == ':') {
+            if (++params > ROUTER_MAX_PARAMS)
+                return -1;
+            seg.ptr++, seg.len--;
+            next = router.nodes[node].param;
+            if (next < 0) {
+                if ((next = router_node_new(seg)) < 0)
+                    return -1;
+                router.nodes[node].param = next;
+            }
+        } else {
+            for (next = router.nodes[node].child; next >= 0; next = router.nodes[next].sibling) {
+                http_span_t label = router.nodes[next].label;
+                if (label.len == seg.len && memcmp(label.ptr, seg.ptr, seg.len) == 0)
+                    break;
+            }
+            if (next < 0) {
+                if ((next = router_node_new(seg)) < 0)
+                    return -1;
+                router.nodes[next].sibling = router.nodes[node].child;
+                router.nodes[node].child = next;
+            }
+        }
+        node = next;
+        p = q != NULL ? q + 1 : end;
+    }
+    router.nodes[node].route = index;
+    return 0;
+}
+
+// Place every literal route with this seed; 0 when none collide
+static inline int router_place(uint32_t seed) {
+    memset(router.slots, -1, sizeof(router.slots));
+    for (int i = 0; i < ROUTER_ROUTE_COUNT; i++) {
+        const route_t *route = &router_routes[i];
+        unsigned slot;
+
+        if (!router_is_literal(route))
+            continue;
+        slot = router_hash(seed, route->method, route->pattern, route->len);
+        if (router.slots[slot] >= 0)
+            return -1;
+        router.slots[slot] = i;
+    }
+    router.seed = seed;
+    return 0;
+}
+
+// Compile the route set: find a seed that gives every literal route a slot
+// of its own, and build the tries. Fails only if ROUTER_ROUTES is malformed
+// or outgrows the limits above.
+static inline int router_init(void) {
+    uint32_t seed;
+
+    for (int m = 0; m < METHOD_COUNT; m++)
+        router.roots[m] = -1;
+    for (int i = 0; i < ROUTER_ROUTE_COUNT; i++) {
+        if (!router_is_literal(&router_routes[i]) && router_trie_add(i) < 0)
+            return -1;
+    }
+    for (seed = 1; seed < 1u << 16; seed++) {
+        if (router_place(seed) == 0)
+            return 0;
+    }
+    return -1;
+}
+
+// Follow the segments of path from node, trying literal children, then the
+// parameter, then the wildcard, and backtracking when a branch dead-ends
+static inline int router_trie_find(int node, const char *p, const char *end,
+                                   int depth, route_params_t *params) {
+    const router_node_t *n = &router.nodes[node];
+    const char *q;
+    http_span_t seg;
+    int found;
+
+    if (p == end && n->route >= 0)
+        return n->route;
+    if (p < end && depth < ROUTER_MAX_DEPTH) {
+        q = memchr(p, '/', end - p);
+        seg = (http_span_t){ p, (q != NULL ? q : end) - p };
+        q = q != NULL ? q + 1 : end;
+
+        for (int c = n->child; c >= 0; c = router.nodes[c].sibling) {
+            http_span_t label = router.nodes[c].label;
+            if (label.len == seg.len && memcmp(label.ptr, seg.ptr, seg.len) == 0) {
+                if ((found = router_trie_find(c, q, end, depth + 1, params)) >= 0)
+                    return found;
+                break;
+            }
+        }
+        if (n->param >= 0 && seg.len > 0 && params->count < ROUTER_MAX_PARAMS) {
+            int i = params->count++;
+            params->p[i].name = router.nodes[n->param].label;
+            params->p[i].value = seg;
+            if ((found = router_trie_find(n->param, q, end, depth + 1, params)) >= 0)
+                return found;
+            params->count--;
+        }
+    }
+    return n->wildcard;
+}
+
+// The route for a request, or NULL for a 404. HEAD is answered by the
+// GET route, without the body (RFC 9110 9.3.2).
+static inline const route_t *router_match(const http_request_t *req, route_params_t *params) {
+    router_method_t method = router_method(req->method);
+    const char *path = req->path.ptr, *end = path + req->path.len;
+    int slot, found;
+
+    if (method == METHOD_HEAD)
+        method = METHOD_GET;
+
+    slot = router.slots[router_hash(router.seed, method, path, req->path.len)];
+    if (slot >= 0) {
+        const route_t *route = &router_routes[slot];
+        if (route->method == method && route->len == req->path.len &&
+            memcmp(route->pattern, path, route->len) == 0)
+            return route;
+    }
+
+    params->count = 0;
+    if (router.roots[method] < 0)
+        return NULL;
+    if (path < end && *path == '/')
+        path++;
+    found = router_trie_find(router.roots[method], path, end, 0, params);
+    return found >= 0 ? &router_routes[found] : NULL;
+}
+
+// Is the request answered at once, with no simulated workload: a
+// preflight, a scrape, a HEAD or a 404? Only the request line needs to be
+// parsed, so an engine can ask before it reads the rest.
+static inline int router_is_cheap(const http_request_t *req) {
+    route_params_t params;
+    const route_t *route = router_match(req, &params);
+
+    return route == NULL || route->route == ROUTE_OPTIONS || route->route == ROUTE_METRICS ||
+           router_method(req->method) == METHOD_HEAD;
+}
+
+// Replace the response built into r with a 503, for a request whose work
+// the offload executor had no room for or a client the server has no room
+// for at all. Returns the status.
+static inline int router_busy(response_t *r, int keep_alive) {
+    RESPONSE_START_LITERAL(r, head_503);
+    RESPONSE_ADD_LITERAL(r, "Retry-After: 1\r\n");
+    response_add_date(r);
+    response_add_length(r, sizeof("503 Service Unavailable\n") - 1);
+    response_end_headers(r, keep_alive);
+    RESPONSE_ADD_LITERAL(r, "503 Service Unavailable\n");
+    return 503;
+}
+
+// Build the response for a request into r. Malformed requests (error_status
+// set by the parser) get their 400, 431 or 501 here too; the caller decides
+// whether keep_alive can stand. Anything the body points to that is not a
+// literal lives in arena until the response is out. A HEAD gets the GET
+// route's headers at once: there is no body to wait out a workload for.
+static inline router_result_t router_handle(const http_request_t *req, int keep_alive,
+                                            response_t *r, arena_t *arena) {
+    router_result_t res = { .route = ROUTE_REJECTED };
+    route_answer_t a = { 0 };
+    route_params_t params;
+    const route_t *route;
+    int head = req->error_status == 0 && router_method(req->method) == METHOD_HEAD;
+
+    // Malformed requests and oversized headers are refused
+    if (req->error_status == 431) {
+        ANSWER_HEAD(&a, head_431);
+        a.body = "431 Request Header Fields Too Large\n";
+        a.status = 431;
+    } else if (req->error_status == 501) {
+        ANSWER_HEAD(&a, head_501);
+        a.body = "501 Not Implemented\n";
+        a.status = 501;
+    } else if (req->error_status != 0) {
+        ANSWER_HEAD(&a, head_400);
+        a.body = "400 Bad Request\n";
+        a.status = 400;
+    } else if ((route = router_match(req, &params)) != NULL) {
+        route->fn(req, &params, &a, arena);
+        res.route = route->route;
+    } else {
+        ANSWER_HEAD(&a, head_404);
+        a.body = "404 Not Found\n";
+        a.status = 404;
+        res.route = ROUTE_NOT_FOUND;
+    }
+    res.status = a.status;
+    res.delay_ms = head ? 0 : a.delay_ms;
+    res.work = head ? NULL : a.work;
+    res.work_arg = a.work_arg;
+    res.chunked = a.chunked;
+
+    response_start(r, a.head, a.head_len);
+    response_add_date(r);
+    if (a.stream) {
+        response_end_headers(r, keep_alive && a.chunked);
+        return res;
+    }
+
+    // 204 responses carry no body and therefore no entity headers
+    if (a.body != NULL && a.body_len == 0)
+        a.body_len = strlen(a.body);
+    if (a.body != NULL)
+        response_add_length(r, a.body_len);
+    response_end_headers(r, keep_alive);
+    if (a.body != NULL && !head)
+        response_add(r, a.body, a.body_len);
+    return res;
+}
+
+#endif
@@ -0,0 +1,369 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+// Lock-free work-stealing scheduler for a pool of worker threads.
+//
+// The acceptor submits tasks (client sockets) to a bounded MPMC injection
+// queue (Vyukov's sequence-numbered ring). Each worker owns a Chase-Lev
+// deque: it takes a small batch from the injection queue, keeps one task
+// and leaves the rest at the bottom of its deque, where it pops them LIFO
+// while idle workers steal from the top. Nothing takes a lock on the task
+// path.
+//
+// Idle workers park on a futex-based event count: a worker announces
+// itself as a waiter, re-checks every queue, then sleeps only if the
+// count's sequence has not moved. Producers bump the sequence and wake a
+// sleeper only when someone is waiting, so a busy pool makes no syscalls.
+//
+// Worker slots are fixed at init, but the set of running workers may
+// change: a slot's deque is empty whenever its worker is not running, and
+// the parking timeout lets the owner of the pool retire idle workers.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define SCHED_DEQUE_SIZE 256        // Per worker; a power of two
+#define SCHED_INJECT_BATCH 8        // Most tasks moved from injection at once
+#define SCHED_STEAL_ROUNDS 2        // Passes over the victims before parking
+
+#define CACHE_LINE 64
+
+// A queued client socket, stamped so workers can measure queueing delay
+typedef struct {
+    int fd;
+    uint32_t queued_us;             // Monotonic microseconds; wraps, compare by difference
+} task_t;
+
+static inline uint32_t sched_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+// Futex-based event count: lets a thread sleep until "something changed"
+// without losing a notification that races with its last check
+typedef struct {
+    uint32_t seq;
+    uint32_t waiters;
+} event_count_t;
+
+// Returns -1 if the timeout (in ms, negative for none) expired
+static inline int futex_wait(uint32_t *addr, uint32_t val, int timeout_ms) {
+    struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val,
+                timeout_ms < 0 ? NULL : &ts, NULL, 0) < 0 && errno == ETIMEDOUT)
+        return -1;
+    return 0;
+}
+
+static inline void futex_wake(uint32_t *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// Announce a wait; the caller re-checks its condition before ec_wait()
+static inline uint32_t ec_prepare(event_count_t *ec) {
+    __atomic_fetch_add(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+    // Pairs with the fence in ec_notify(): either the notifier sees this
+    // waiter, or the caller's re-check sees what was published before it
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ec->seq, __ATOMIC_SEQ_CST);
+}
+
+static inline void ec_cancel(event_count_t *ec) {
+    __atomic_fetch_sub(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+// Sleep unless a notification arrived since ec_prepare(); returns -1 if
+// timeout_ms (negative for none) passed without one
+static inline int ec_wait(event_count_t *ec, uint32_t seq, int timeout_ms) {
+    int result = 0;
+
+    if (__atomic_load_n(&ec->seq, __ATOMIC_SEQ_CST) == seq)
+        result = futex_wait(&ec->seq, seq, timeout_ms);
+    ec_cancel(ec);
+    return result;
+}
+
+// Wake up to n waiters; free when nobody waits
+static inline void ec_notify(event_count_t *ec, int n) {
+    // Order the caller's publish (a queue push) before the waiters load;
+    // without it the load can pass the push and miss a waiter that has
+    // just checked the queue and found it empty
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ec->waiters, __ATOMIC_SEQ_CST) == 0)
+        return;
+    __atomic_fetch_add(&ec->seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&ec->seq, n);
+}
+
+// Bounded MPMC queue. Each cell's sequence number tells producers and
+// consumers whose turn it is, so both sides only CAS their own index.
+typedef struct {
+    uint64_t seq;
+    task_t task;
+} mpmc_cell_t;
+
+typedef struct {
+    mpmc_cell_t *cells;
+    uint64_t mask;
+    char pad0[CACHE_LINE];
+    uint64_t tail;                  // Next enqueue position
+    char pad1[CACHE_LINE - sizeof(uint64_t)];
+    uint64_t head;                  // Next dequeue position
+    char pad2[CACHE_LINE - sizeof(uint64_t)];
+} mpmc_queue_t;
+
+// Capacity must be a power of two; returns -1 on allocation failure
+static inline int mpmc_init(mpmc_queue_t *q, uint64_t capacity) {
+    memset(q, 0, sizeof(*q));
+    q->cells = calloc(capacity, sizeof(mpmc_cell_t));
+    if (q->cells == NULL)
+        return -1;
+    for (uint64_t i = 0; i < capacity; i++)
+        q->cells[i].seq = i;
+    q->mask = capacity - 1;
+    return 0;
+}
+
+// Returns 0, or -1 if the queue is full
+static inline int mpmc_push(mpmc_queue_t *q, task_t task) {
+    uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    while (1) {
+        mpmc_cell_t *cell = &q->cells[pos & q->mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->task = task;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Returns 0 and the task, or -1 if the queue is empty
+static inline int mpmc_pop(mpmc_queue_t *q, task_t *task) {
+    uint64_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    while (1) {
+        mpmc_cell_t *cell = &q->cells[pos & q->mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - (pos + 1));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *task = cell->task;
+                __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Approximate number of queued tasks
+static inline uint64_t mpmc_depth(mpmc_queue_t *q) {
+    uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    return tail > head ? tail - head : 0;
+}
+
+// Chase-Lev deque with a fixed ring (Le et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models"). The owner pushes and pops at
+// the bottom; thieves CAS the top.
+typedef struct {
+    int64_t top;
+    char pad0[CACHE_LINE - sizeof(int64_t)];
+    int64_t bottom;
+    char pad1[CACHE_LINE - sizeof(int64_t)];
+    task_t tasks[SCHED_DEQUE_SIZE];
+} ws_deque_t;
+
+// Owner only; returns -1 if the deque is full
+static inline int deque_push(ws_deque_t *d, task_t task) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+    if (b - t >= SCHED_DEQUE_SIZE)
+        return -1;
+    __atomic_store(&d->tasks[b & (SCHED_DEQUE_SIZE - 1)], &task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Owner only; returns -1 if the deque is empty
+static inline int deque_pop(ws_deque_t *d, task_t *task) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    int64_t t;
+    int result = 0;
+
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    __atomic_load(&d->tasks[b & (SCHED_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+    if (t == b) {
+        // Last task: race the thieves for it
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            result = -1;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+// Any thread; returns -1 if the deque is empty or the race was lost
+static inline int deque_steal(ws_deque_t *d, task_t *task) {
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b)
+        return -1;
+
+    __atomic_load(&d->tasks[t & (SCHED_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return -1;
+    return 0;
+}
+
+typedef struct {
+    mpmc_queue_t injection;
+    ws_deque_t *deques;             // One per worker slot
+    int slots;
+    int active;                     // Running workers, maintained by the pool
+    event_count_t work;             // Signalled when tasks are queued
+} scheduler_t;
+
+// Returns -1 on allocation failure
+static inline int scheduler_init(scheduler_t *s, int slots, uint64_t capacity) {
+    memset(s, 0, sizeof(*s));
+    if (mpmc_init(&s->injection, capacity) < 0)
+        return -1;
+    if (posix_memalign((void **)&s->deques, CACHE_LINE, slots * sizeof(ws_deque_t)) != 0)
+        return -1;
+    memset(s->deques, 0, slots * sizeof(ws_deque_t));
+    s->slots = slots;
+    return 0;
+}
+
+// Queue a client socket from outside the pool; returns -1 if the queue is
+// full, leaving the socket to the caller
+static inline int scheduler_submit(scheduler_t *s, int fd) {
+    task_t task = { fd, sched_now_us() };
+
+    if (mpmc_push(&s->injection, task) < 0)
+        return -1;
+    ec_notify(&s->work, 1);
+    return 0;
+}
+
+// Number of workers parked waiting for work
+static inline int scheduler_idle(scheduler_t *s) {
+    return __atomic_load_n(&s->work.waiters, __ATOMIC_SEQ_CST);
+}
+
+// Tasks waiting behind the caller: its own deque plus the injection queue
+static inline uint64_t scheduler_backlog(scheduler_t *s, int self) {
+    ws_deque_t *own = &s->deques[self];
+    int64_t queued = __atomic_load_n(&own->bottom, __ATOMIC_RELAXED) -
+                     __atomic_load_n(&own->top, __ATOMIC_RELAXED);
+
+    return (queued > 0 ? queued : 0) + mpmc_depth(&s->injection);
+}
+
+// Move a share of the injection queue to this worker's deque and return
+// one task; idle workers are woken to steal the rest
+static inline int scheduler_take_injected(scheduler_t *s, ws_deque_t *own, task_t *task) {
+    int active = __atomic_load_n(&s->active, __ATOMIC_RELAXED);
+    uint64_t batch = mpmc_depth(&s->injection) / (active > 0 ? active : 1) + 1;
+    int moved = 0;
+
+    if (mpmc_pop(&s->injection, task) < 0)
+        return -1;
+
+    // Only called once the own deque is empty, so the batch always fits
+    if (batch > SCHED_INJECT_BATCH)
+        batch = SCHED_INJECT_BATCH;
+    while (--batch > 0) {
+        task_t extra;
+
+        if (mpmc_pop(&s->injection, &extra) < 0)
+            break;
+        deque_push(own, extra);
+        moved++;
+    }
+
+    if (moved > 0)
+        ec_notify(&s->work, moved);
+    return 0;
+}
+
+// Try one victim after another, starting next to the caller; slots with
+// no running worker have empty deques and fail fast
+static inline int scheduler_steal(scheduler_t *s, int self, task_t *task) {
+    for (int round = 0; round < SCHED_STEAL_ROUNDS; round++) {
+        for (int i = 1; i < s->slots; i++) {
+            if (deque_steal(&s->deques[(self + i) % s->slots], task) == 0)
+                return 0;
+        }
+    }
+    return -1;
+}
+
+static inline int scheduler_try_next(scheduler_t *s, int self, task_t *task) {
+    ws_deque_t *own = &s->deques[self];
+
+    if (deque_pop(own, task) == 0)
+        return 0;
+    if (scheduler_take_injected(s, own, task) == 0)
+        return 0;
+    return scheduler_steal(s, self, task);
+}
+
+// Next task for the worker in slot self: its own deque, then the injection
+// queue, then the other workers' deques; parks when all are empty. Returns
+// -1 once it has been idle for timeout_ms (negative to wait forever).
+static inline int scheduler_next(scheduler_t *s, int self, task_t *task, int timeout_ms) {
+    while (1) {
+        if (scheduler_try_next(s, self, task) == 0)
+            return 0;
+
+        uint32_t seq = ec_prepare(&s->work);
+        if (scheduler_try_next(s, self, task) == 0) {
+            ec_cancel(&s->work);
+            return 0;
+        }
+        if (ec_wait(&s->work, seq, timeout_ms) < 0)
+            return -1;
+    }
+}
+
+#endif
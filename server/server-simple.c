@@ -1,115 +0,0 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-
-#define PORT 8888
-#define BUFFER_SIZE 4096
-
-void handle_client(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-
-    // Read the request from the client
-    bytes_read = read(client_socket, buffer, sizeof(buffer) - 1);
-    if (bytes_read < 0) {
-        perror("Failed to read from client");
-        close(client_socket);
-        return;
-    }
-
-    buffer[bytes_read] = '\0';
-    printf("Received request:\n%s\n", buffer);
-
-    // Check if it's a GET request
-    if (strncmp(buffer, "GET /", 5) == 0) {
-        char response[] =
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/plain\r\n"
-            "Content-Length: 21\r\n"
-            "Connection: close\r\n"
-            "\r\n"
-            "GET request response\n";
-
-        // Log and send the response
-        printf("Sending GET response...\n");
-        write(client_socket, response, sizeof(response) - 1);
-    }
-    // Check if it's a POST request
-    else if (strncmp(buffer, "POST /", 6) == 0) {
-        char response[] =
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/plain\r\n"
-            "Content-Length: 22\r\n"
-            "Connection: close\r\n"
-            "\r\n"
-            "POST request response\n";
-
-        // Log and send the response
-        printf("Sending POST response...\n");
-        write(client_socket, response, sizeof(response) - 1);
-    } else {
-        // If the request is not GET or POST, send a 404 Not Found
-        char response[] =
-            "HTTP/1.1 404 Not Found\r\n"
-            "Content-Length: 13\r\n"
-            "Connection: close\r\n"
-            "\r\n"
-            "404 Not Found\n";
-
-        write(client_socket, response, sizeof(response) - 1);
-    }
-
-    close(client_socket);
-}
-
-int main() {
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-
-    // Create the server socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        perror("Failed to create socket");
-        exit(EXIT_FAILURE);
-    }
-
-    // Set up the server address
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
-
-    // Bind the socket to the port
-    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Failed to bind socket");
-        close(server_socket);
-        exit(EXIT_FAILURE);
-    }
-
-    // Listen for incoming connections
-    if (listen(server_socket, 10) < 0) {
-        perror("Failed to listen");
-        close(server_socket);
-        exit(EXIT_FAILURE);
-    }
-
-    printf("Server listening on port %d...\n", PORT);
-
-    // Accept and handle incoming connections
-    while (1) {
-        client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        if (client_socket < 0) {
-            perror("Failed to accept client");
-            continue;
-        }
-
-        printf("Client connected...\n");
-        handle_client(client_socket);
-    }
-
-    close(server_socket);
-    return 0;
-}
-
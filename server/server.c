@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "admission.h"
+#include "deadline.h"
+#include "engine.h"
+#include "engine_epoll.h"
+#include "engine_iterative.h"
+#include "engine_pool.h"
+#include "engine_select.h"
+#include "engine_thread.h"
+#include "engine_uring.h"
+#include "handoff.h"
+#include "log.h"
+#include "metrics.h"
+#include "offload.h"
+#include "response.h"
+#include "router.h"
+#include "slab.h"
+#include "static_files.h"
+#include "trace.h"
+
+// The concurrency engines, by the name --engine takes. All of them answer
+// through the same router, so only the engine differs between runs.
+static const struct {
+    const char *name;
+    void (*run)(void);
+    int serves_files;               // Takes --root
+} engines[] = {
+    { "iterative",       engine_iterative, 0 },
+    { "select",          engine_select,    0 },
+    { "thread-per-conn", engine_thread,    0 },
+    { "pool",            engine_pool,      0 },
+    { "epoll",           engine_epoll,     1 },
+    { "uring",           engine_uring,     1 },
+};
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--engine=NAME] [--port=N] [--threads=N] [--min-threads=N] [--queue=N]\n"
+            "          [--budget=MS] [--fast-workers=N] [--pin] [--root=DIR] [--log-level=L]\n"
+            "          [--log-file=PATH] [--backlog=N] [--defer-accept=S] [--max-conns=N] [--max-per-ip=N]\n"
+            "          [--handoff=PATH] [--drain-timeout=S] [--header-timeout=MS]\n"
+            "          [--body-timeout=MS] [--idle-timeout=MS] [--write-timeout=MS]\n"
+            "          [--trace=PATH] [--trace-ring=N] [--offload-threads=N]\n"
+            "          [--offload-queue=N]\n"
+            "  --engine=NAME     iterative, select, thread-per-conn, pool, epoll or\n"
+            "                    uring (default epoll)\n"
+            "  --port=N          port to listen on (default %d)\n"
+            "  --threads=N       pool: most workers (default %d); thread-per-conn:\n"
+            "                    coroutine scheduler threads (default one per CPU);\n"
+            "                    epoll: reactors, each with its own SO_REUSEPORT\n"
+            "                    listener (default 1); 0 = one per online CPU\n"
+            "  --min-threads=N   pool: workers kept even when idle (default %d)\n"
+            "  --queue=N         pool: injection queue capacity, rounded up to a\n"
+            "                    power of two (default %llu)\n"
+            "  --budget=MS       pool: queueing delay beyond which a full pool\n"
+            "                    answers 503 (default %d)\n"
+            "  --fast-workers=N  pool: workers kept for cheap requests (OPTIONS,\n"
+            "                    /metrics, 404s), which skip the queue; 0 turns the\n"
+            "                    fast lane off (default %d)\n"
+            "  --pin             epoll: pin reactor i to CPU i modulo the online CPUs\n"
+            "  --root=DIR        epoll, uring: serve the files under DIR to GET and HEAD\n"
+            "  --log-level=L     debug, info, warn, error or off (default info)\n"
+            "  --log-file=PATH   append the log to PATH instead of stderr\n"
+            ADMISSION_USAGE
+            HANDOFF_USAGE
+            DEADLINE_USAGE
+            TRACE_USAGE
+            OFFLOAD_USAGE,
+            prog, engine_config.port, POOL_MAX_THREADS, engine_config.min_threads,
+            (unsigned long long)engine_config.queue_size, engine_config.budget_ms,
+            engine_config.fast_workers);
+}
+
+int main(int argc, char *argv[]) {
+    const char *engine_name = "epoll";
+    int engine = -1;
+    int log_level = LOG_LEVEL_INFO;
+    const char *log_file = NULL;
+
+    static const struct option options[] = {
+        { "engine",      required_argument, NULL, 'e' },
+        { "port",        required_argument, NULL, 'P' },
+        { "threads",     required_argument, NULL, 't' },
+        { "min-threads", required_argument, NULL, 'm' },
+        { "queue",       required_argument, NULL, 'q' },
+        { "budget",      required_argument, NULL, 'b' },
+        { "fast-workers", required_argument, NULL, 'f' },
+        { "pin",         no_argument,       NULL, 'p' },
+        { "root",        required_argument, NULL, 'R' },
+        { "log-level",   required_argument, NULL, 'l' },
+        { "log-file",    required_argument, NULL, 'L' },
+        ADMISSION_OPTIONS,
+        HANDOFF_OPTIONS,
+        DEADLINE_OPTIONS,
+        TRACE_OPTIONS,
+        OFFLOAD_OPTIONS,
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "e:P:t:m:q:b:f:pR:l:L:h"
+                            ADMISSION_OPTSTRING HANDOFF_OPTSTRING DEADLINE_OPTSTRING TRACE_OPTSTRING
+                            OFFLOAD_OPTSTRING,
+                            options, NULL)) != -1) {
+        switch (c) {
+        case 'e':
+            engine_name = optarg;
+            break;
+        case 'P':
+            engine_config.port = atoi(optarg);
+            break;
+        case 't':
+            engine_config.threads = atoi(optarg);
+            break;
+        case 'm':
+            engine_config.min_threads = atoi(optarg);
+            break;
+        case 'q':
+            engine_config.queue_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            engine_config.budget_ms = atoi(optarg);
+            break;
+        case 'f':
+            engine_config.fast_workers = atoi(optarg);
+            break;
+        case 'p':
+            engine_config.pin = 1;
+            break;
+        case 'R':
+            engine_config.root = optarg;
+            break;
+        case 'l':
+            if ((log_level = log_parse_level(optarg)) < 0) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            log_file = optarg;
+            break;
+        default:
+            if (admission_option(c, optarg) || handoff_option(c, optarg) ||
+                deadline_option(c, optarg) || trace_option(c, optarg) ||
+                offload_option(c, optarg))
+                break;
+            usage(argv[0]);
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(engines[i].name, engine_name) == 0)
+            engine = i;
+    }
+    if (engine < 0) {
+        fprintf(stderr, "Unknown engine: %s\n", engine_name);
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (engine_config.root != NULL && !engines[engine].serves_files) {
+        fprintf(stderr, "--root needs the epoll or uring engine\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A peer that resets mid-write must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    // Messages go through per-thread rings to a flusher thread, never
+    // straight to stdio from a request
+    if (log_start(log_level, log_file) < 0) {
+        perror("Failed to start logger");
+        exit(EXIT_FAILURE);
+    }
+
+    // Traces go to their file from a writer thread of their own
+    if (trace_start() < 0) {
+        perror("Failed to start tracing");
+        exit(EXIT_FAILURE);
+    }
+
+    // Handlers' blocking work runs on threads of its own
+    if (offload_start() < 0) {
+        perror("Failed to start offload executor");
+        exit(EXIT_FAILURE);
+    }
+
+    if (admission_init() < 0) {
+        perror("Failed to set up admission");
+        exit(EXIT_FAILURE);
+    }
+
+    // Take the listeners over from a running server before anything binds
+    if (handoff_init() < 0) {
+        perror("Failed to take over listeners");
+        exit(EXIT_FAILURE);
+    }
+
+    if (router_init() < 0) {
+        fprintf(stderr, "Failed to build the route table\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Date headers come from a string re-rendered once per second
+    if (http_clock_start() < 0) {
+        perror("Clock thread creation failed");
+        exit(EXIT_FAILURE);
+    }
+    metrics_gauge("slab_memory_bytes", "Memory mapped for slab objects.", slab_memory_bytes);
+
+    if (engine_config.root != NULL && static_files_open(engine_config.root) < 0) {
+        perror("Failed to open document root");
+        exit(EXIT_FAILURE);
+    }
+
+    log_info("Running the %s engine", engines[engine].name);
+    engines[engine].run();
+    return 0;
+}
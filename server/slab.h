@@ -0,0 +1,238 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+// Size-class slab allocator with per-thread caches, and request arenas on
+// top of it, so steady-state serving never calls malloc() or free().
+//
+// Objects come in power-of-two classes from 64 B to 32 KiB, carved out of
+// SLAB_SIZE pages that are mapped once and never given back. Each thread
+// keeps a free list per class and allocates and frees with no lock. A list
+// that grows past two batches hands one batch to a global depot; an empty
+// one takes a batch back from it before carving a new page. That keeps
+// memory moving when one thread allocates what others free (an acceptor
+// and its workers). A thread that exits gives its lists to the depot, as
+// metrics.h does with its shards.
+//
+// The caller passes the object size back to slab_free(); nothing is stored
+// in front of an object.
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define SLAB_MIN_SHIFT 6            // 64 B, room for the free-list links
+#define SLAB_CLASSES 10             // Up to 32 KiB
+#define SLAB_MAX_SIZE ((size_t)1 << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+#define SLAB_SIZE (256 * 1024)      // Page carved into objects of one class
+#define SLAB_BATCH 32               // Objects moved to or from the depot at once
+
+// A free object. Only the depot uses next_batch and count, on the first
+// object of each batch.
+typedef struct slab_object {
+    struct slab_object *next;
+    struct slab_object *next_batch;
+    size_t count;
+} slab_object_t;
+
+typedef struct {
+    slab_object_t *free;
+    size_t count;
+} slab_list_t;
+
+static struct {
+    pthread_mutex_t lock;           // Guards the depot, never the thread caches
+    pthread_once_t once;
+    pthread_key_t key;
+    slab_object_t *depot[SLAB_CLASSES];
+    size_t pages;                   // Mapped so far, for the memory gauge
+} slab = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT, 0, { NULL }, 0 };
+
+static __thread slab_list_t slab_local[SLAB_CLASSES];
+static __thread int slab_attached;
+
+// Smallest class that fits size
+static inline int slab_class(size_t size) {
+    int c = 0;
+
+    while (((size_t)1 << (SLAB_MIN_SHIFT + c)) < size)
+        c++;
+    return c;
+}
+
+static inline void slab_depot_put(int c, slab_object_t *batch, size_t count) {
+    batch->count = count;
+    pthread_mutex_lock(&slab.lock);
+    batch->next_batch = slab.depot[c];
+    slab.depot[c] = batch;
+    pthread_mutex_unlock(&slab.lock);
+}
+
+// Give every cached object of an exiting thread to the depot
+static inline void slab_retire(void *arg) {
+    (void)arg;
+    for (int c = 0; c < SLAB_CLASSES; c++) {
+        if (slab_local[c].free != NULL)
+            slab_depot_put(c, slab_local[c].free, slab_local[c].count);
+        slab_local[c].free = NULL;
+        slab_local[c].count = 0;
+    }
+}
+
+static inline void slab_init_key(void) {
+    pthread_key_create(&slab.key, slab_retire);
+}
+
+// Register the thread's lists to be retired when it exits; the key only
+// needs a non-NULL value for its destructor to run
+static inline void slab_attach(void) {
+    pthread_once(&slab.once, slab_init_key);
+    pthread_setspecific(slab.key, slab_local);
+    slab_attached = 1;
+}
+
+// Refill an empty list: a batch from the depot, else a new page
+static inline int slab_refill(int c) {
+    size_t size = (size_t)1 << (SLAB_MIN_SHIFT + c);
+    slab_list_t *list = &slab_local[c];
+
+    if (__builtin_expect(!slab_attached, 0))
+        slab_attach();
+
+    pthread_mutex_lock(&slab.lock);
+    slab_object_t *batch = slab.depot[c];
+    if (batch != NULL)
+        slab.depot[c] = batch->next_batch;
+    pthread_mutex_unlock(&slab.lock);
+
+    if (batch != NULL) {
+        list->free = batch;
+        list->count = batch->count;
+        return 0;
+    }
+
+    char *page = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+        return -1;
+    __atomic_add_fetch(&slab.pages, 1, __ATOMIC_RELAXED);
+
+    // Thread the objects in address order, so the first ones used are
+    // the first in the page
+    for (size_t off = SLAB_SIZE; off >= size; off -= size) {
+        slab_object_t *obj = (slab_object_t *)(page + off - size);
+        obj->next = list->free;
+        list->free = obj;
+    }
+    list->count = SLAB_SIZE / size;
+    return 0;
+}
+
+// Uninitialised memory for an object of size bytes, or NULL when size is
+// over SLAB_MAX_SIZE or no memory is left
+static inline void *slab_alloc(size_t size) {
+    if (size > SLAB_MAX_SIZE)
+        return NULL;
+
+    int c = slab_class(size);
+    slab_list_t *list = &slab_local[c];
+
+    if (__builtin_expect(list->free == NULL, 0) && slab_refill(c) < 0)
+        return NULL;
+
+    slab_object_t *obj = list->free;
+    list->free = obj->next;
+    list->count--;
+    return obj;
+}
+
+static inline void *slab_zalloc(size_t size) {
+    void *obj = slab_alloc(size);
+
+    if (obj != NULL)
+        memset(obj, 0, size);
+    return obj;
+}
+
+// Return an object from slab_alloc(size), on any thread
+static inline void slab_free(void *ptr, size_t size) {
+    int c = slab_class(size);
+    slab_list_t *list = &slab_local[c];
+    slab_object_t *obj = ptr;
+
+    if (ptr == NULL)
+        return;
+    obj->next = list->free;
+    list->free = obj;
+    list->count++;
+
+    // Keep one batch, pass the rest on
+    if (__builtin_expect(list->count > 2 * SLAB_BATCH, 0)) {
+        slab_object_t *last = list->free;
+        for (int i = 1; i < SLAB_BATCH; i++)
+            last = last->next;
+        slab_object_t *batch = last->next;
+        last->next = NULL;
+        if (!slab_attached)
+            slab_attach();
+        slab_depot_put(c, batch, list->count - SLAB_BATCH);
+        list->count = SLAB_BATCH;
+    }
+}
+
+// Memory mapped for slabs, for a /metrics gauge
+static inline double slab_memory_bytes(void) {
+    return (double)__atomic_load_n(&slab.pages, __ATOMIC_RELAXED) * SLAB_SIZE;
+}
+
+// Bump allocator for request-scoped scratch: blocks come from the slab
+// classes and arena_reset() hands them all back when the request is done.
+// An arena belongs to one request at a time and is not thread safe.
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN 16
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;                    // Whole block, header included
+    size_t used;
+} arena_block_t;
+
+typedef struct {
+    arena_block_t *blocks;          // Current block first
+} arena_t;
+
+#define ARENA_HEADER ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static inline void *arena_alloc(arena_t *arena, size_t size) {
+    arena_block_t *block = arena->blocks;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = ARENA_HEADER + size > ARENA_BLOCK_SIZE ? ARENA_HEADER + size
+                                                                   : ARENA_BLOCK_SIZE;
+        // Round up to the class, so the slack is usable
+        block_size = (size_t)1 << (SLAB_MIN_SHIFT + slab_class(block_size));
+        if ((block = slab_alloc(block_size)) == NULL)
+            return NULL;
+        block->size = block_size;
+        block->used = ARENA_HEADER;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    void *ptr = (char *)block + block->used;
+    block->used += size;
+    return ptr;
+}
+
+// Release everything allocated since the arena was empty
+static inline void arena_reset(arena_t *arena) {
+    while (arena->blocks != NULL) {
+        arena_block_t *block = arena->blocks;
+        arena->blocks = block->next;
+        slab_free(block, block->size);
+    }
+}
+
+#endif
@@ -0,0 +1,377 @@
+#ifndef STATIC_FILES_H
+#define STATIC_FILES_H
+
+// Document root served from an open-file cache.
+//
+// A file is opened, stat()ed and mapped once, on its first request; later
+// requests find the descriptor, the mapping and the pre-rendered
+// Content-Type, ETag and Last-Modified headers in the cache and make no
+// file system calls at all. An inotify thread watches every directory a
+// cached file lives in and evicts entries whose file changes, moves or
+// goes away. Entries are reference counted, so an eviction never pulls a
+// file out from under a response that is still being sent.
+//
+// Small files go out from the mapping with the headers in one writev();
+// engines that can, send larger ones with sendfile().
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "http_parser.h"
+
+#define STATIC_PATH_MAX 256
+#define STATIC_BUCKETS 256          // Hash chains, a power of two
+#define STATIC_MAX_WATCHES 64       // Directories watched for changes
+#define STATIC_MMAP_MAX 65536       // Larger files are sent with sendfile()
+#define STATIC_HEADERS_SIZE 256
+
+typedef struct static_file {
+    char path[STATIC_PATH_MAX];     // Relative to the root; the cache key
+    int fd;
+    off_t size;
+    void *map;                      // Whole file, NULL when empty
+    char headers[STATIC_HEADERS_SIZE];
+    size_t headers_len;
+    char etag[64];                  // Quoted, as sent
+    time_t mtime;
+    int refs;                       // The cache's own plus one per response
+    struct static_file *next;
+} static_file_t;
+
+typedef struct {
+    int wd;
+    char dir[STATIC_PATH_MAX];      // Relative to the root, "" for the root itself
+} static_watch_t;
+
+typedef struct {
+    int root_fd;                    // -1 when no document root is served
+    int inotify_fd;
+    pthread_mutex_t lock;
+    static_file_t *buckets[STATIC_BUCKETS];
+    static_watch_t watches[STATIC_MAX_WATCHES];
+    int num_watches;
+} static_cache_t;
+
+static static_cache_t static_files = { -1, -1, PTHREAD_MUTEX_INITIALIZER, { NULL }, { { 0 } }, 0 };
+
+static inline unsigned static_hash(const char *path) {
+    unsigned h = 2166136261u;
+
+    while (*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h & (STATIC_BUCKETS - 1);
+}
+
+static inline const char *static_content_type(const char *path) {
+    static const struct { const char *ext; const char *type; } types[] = {
+        { ".html", "text/html; charset=utf-8" },
+        { ".css",  "text/css; charset=utf-8" },
+        { ".js",   "text/javascript; charset=utf-8" },
+        { ".json", "application/json" },
+        { ".txt",  "text/plain; charset=utf-8" },
+        { ".svg",  "image/svg+xml" },
+        { ".png",  "image/png" },
+        { ".jpg",  "image/jpeg" },
+        { ".ico",  "image/x-icon" },
+    };
+    const char *ext = strrchr(path, '.');
+
+    for (size_t i = 0; ext != NULL && i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcmp(ext, types[i].ext) == 0)
+            return types[i].type;
+    }
+    return "application/octet-stream";
+}
+
+// Turn a request path into a name under the root. Empty, "." and ".."
+// segments are refused, so nothing outside the root can be named.
+static inline int static_resolve(http_span_t target, char *path) {
+    const char *seg = path;
+
+    if (target.len < 2 || target.ptr[0] != '/' || target.len > STATIC_PATH_MAX)
+        return -1;
+    memcpy(path, target.ptr + 1, target.len - 1);
+    path[target.len - 1] = '\0';
+    if (memchr(path, '\0', target.len - 1) != NULL)
+        return -1;
+
+    while (1) {
+        const char *slash = strchr(seg, '/');
+        size_t len = slash != NULL ? (size_t)(slash - seg) : strlen(seg);
+
+        if (len == 0 || (len == 1 && seg[0] == '.') ||
+            (len == 2 && seg[0] == '.' && seg[1] == '.'))
+            return -1;
+        if (slash == NULL)
+            return 0;
+        seg = slash + 1;
+    }
+}
+
+static inline void static_file_put(static_file_t *file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    if (file->map != NULL)
+        munmap(file->map, file->size);
+    close(file->fd);
+    free(file);
+}
+
+// Watch the directory a newly cached file is in; called with the lock held
+static inline void static_watch_dir(static_cache_t *cache, const char *path) {
+    const char *slash = strrchr(path, '/');
+    char dir[STATIC_PATH_MAX];
+    size_t len = slash != NULL ? (size_t)(slash - path) : 0;
+
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    for (int i = 0; i < cache->num_watches; i++) {
+        if (strcmp(cache->watches[i].dir, dir) == 0)
+            return;
+    }
+    if (cache->inotify_fd < 0 || cache->num_watches == STATIC_MAX_WATCHES)
+        return;
+
+    // inotify has no *at() variant; go through the root descriptor
+    char proc_path[64 + STATIC_PATH_MAX];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d/%s", cache->root_fd, dir);
+    int wd = inotify_add_watch(cache->inotify_fd, proc_path,
+                               IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE |
+                               IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0)
+        return;
+    cache->watches[cache->num_watches].wd = wd;
+    strcpy(cache->watches[cache->num_watches].dir, dir);
+    cache->num_watches++;
+}
+
+// Open, stat and map a file and render its headers
+static inline static_file_t *static_file_load(static_cache_t *cache, const char *path) {
+    struct stat st;
+    struct tm tm;
+    static_file_t *file;
+    int fd = openat(cache->root_fd, path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (file = calloc(1, sizeof(*file))) == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    strcpy(file->path, path);
+    file->fd = fd;
+    file->size = st.st_size;
+    file->mtime = st.st_mtim.tv_sec;
+    if (file->size > 0) {
+        file->map = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (file->map == MAP_FAILED) {
+            close(fd);
+            free(file);
+            return NULL;
+        }
+    }
+
+    // Changes within the same second still change the tag
+    snprintf(file->etag, sizeof(file->etag), "\"%lx-%lx-%lx\"",
+             (unsigned long)st.st_ino, (unsigned long)st.st_size,
+             (unsigned long)(st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec));
+    gmtime_r(&file->mtime, &tm);
+    file->headers_len = snprintf(file->headers, sizeof(file->headers),
+                                 "Content-Type: %s\r\nETag: %s\r\n",
+                                 static_content_type(path), file->etag);
+    file->headers_len += strftime(file->headers + file->headers_len,
+                                  sizeof(file->headers) - file->headers_len,
+                                  "Last-Modified: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    return file;
+}
+
+// Find or load the file a request path names; the caller owns a reference
+// until static_file_put(). NULL if there is no such regular file.
+static inline static_file_t *static_file_get(static_cache_t *cache, http_span_t target) {
+    char path[STATIC_PATH_MAX + 1];
+    static_file_t *file, *loaded;
+    unsigned bucket;
+
+    if (cache->root_fd < 0 || static_resolve(target, path) < 0)
+        return NULL;
+    bucket = static_hash(path);
+
+    pthread_mutex_lock(&cache->lock);
+    for (file = cache->buckets[bucket]; file != NULL; file = file->next) {
+        if (strcmp(file->path, path) == 0) {
+            __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&cache->lock);
+            return file;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    // Load outside the lock; if another thread got there first, use theirs
+    if ((loaded = static_file_load(cache, path)) == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    for (file = cache->buckets[bucket]; file != NULL; file = file->next) {
+        if (strcmp(file->path, path) == 0)
+            break;
+    }
+    if (file == NULL) {
+        file = loaded;
+        file->refs = 1;
+        file->next = cache->buckets[bucket];
+        cache->buckets[bucket] = file;
+        static_watch_dir(cache, path);
+        loaded = NULL;
+    }
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache->lock);
+
+    if (loaded != NULL) {
+        loaded->refs = 1;
+        static_file_put(loaded);
+    }
+    return file;
+}
+
+// Drop cache entries: the one named path, or every one when path is NULL
+static inline void static_evict(static_cache_t *cache, const char *path) {
+    static_file_t *evicted = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    for (int b = 0; b < STATIC_BUCKETS; b++) {
+        static_file_t **link = &cache->buckets[b];
+
+        while (*link != NULL) {
+            static_file_t *file = *link;
+
+            if (path == NULL || strcmp(file->path, path) == 0) {
+                *link = file->next;
+                file->next = evicted;
+                evicted = file;
+            } else {
+                link = &file->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    while (evicted != NULL) {
+        static_file_t *next = evicted->next;
+        static_file_put(evicted);
+        evicted = next;
+    }
+}
+
+// Evict whatever the file system says changed
+static inline void *static_watch_thread(void *arg) {
+    static_cache_t *cache = (static_cache_t *)arg;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t n = read(cache->inotify_fd, events, sizeof(events));
+
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return NULL;
+        }
+
+        for (char *p = events; p < events + n;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            char path[2 * STATIC_PATH_MAX];
+            const char *dir = NULL;
+
+            pthread_mutex_lock(&cache->lock);
+            for (int i = 0; i < cache->num_watches; i++) {
+                if (cache->watches[i].wd != ev->wd)
+                    continue;
+                if (ev->mask & IN_IGNORED) {
+                    // The directory is gone; watch it again if it comes back
+                    cache->watches[i] = cache->watches[--cache->num_watches];
+                    break;
+                }
+                dir = cache->watches[i].dir;
+                if (ev->len > 0)
+                    snprintf(path, sizeof(path), "%s%s%s", dir, dir[0] ? "/" : "", ev->name);
+                break;
+            }
+            pthread_mutex_unlock(&cache->lock);
+
+            // A lost queue or a directory that moved: start over
+            if ((ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) || dir == NULL)
+                static_evict(cache, NULL);
+            else if (ev->len > 0)
+                static_evict(cache, path);
+
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    return NULL;
+}
+
+// Serve files under dir. Without inotify the cache still works but never
+// notices changes.
+static inline int static_files_open(const char *dir) {
+    pthread_t thread;
+
+    static_files.root_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (static_files.root_fd < 0)
+        return -1;
+
+    static_files.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (static_files.inotify_fd >= 0) {
+        if (pthread_create(&thread, NULL, static_watch_thread, &static_files) != 0)
+            return -1;
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+// Parse an HTTP date; returns -1 if it is not one
+static inline time_t static_parse_date(http_span_t value) {
+    char text[64];
+    struct tm tm;
+
+    if (value.len >= sizeof(text))
+        return -1;
+    memcpy(text, value.ptr, value.len);
+    text[value.len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+        return -1;
+    return timegm(&tm);
+}
+
+// Does a conditional request already have the current version?
+// If-None-Match wins over If-Modified-Since when both are present.
+static inline int static_not_modified(const static_file_t *file, const http_request_t *req) {
+    const http_span_t *value = http_find_header(req, "If-None-Match");
+
+    if (value != NULL) {
+        size_t etag_len = strlen(file->etag);
+
+        if (value->len == 1 && value->ptr[0] == '*')
+            return 1;
+        return memmem(value->ptr, value->len, file->etag, etag_len) != NULL;
+    }
+
+    value = http_find_header(req, "If-Modified-Since");
+    if (value != NULL) {
+        time_t since = static_parse_date(*value);
+        return since >= 0 && file->mtime <= since;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+// Hierarchical timing wheel driven by a timerfd.
+//
+// Four levels of 64 slots each; a timer is filed in the lowest level whose
+// span covers its remaining delay and cascades down one level each time the
+// level below wraps. Insert and cancel are O(1), and expiry costs O(1) per
+// tick plus the timers that actually fire. The timerfd ticks periodically
+// only while timers are pending, so an idle loop is never woken.
+//
+// A wheel is not thread safe; each event loop owns its own.
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define TIMER_TICK_MS 10
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+struct timer_wheel;
+
+// Timer node, embedded in whatever object is waiting on it
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer **pprev;     // NULL while the timer is not pending
+    struct timer_wheel *wheel;
+    uint64_t expires;               // Absolute tick
+    void (*callback)(void *data);
+    void *data;
+} wheel_timer_t;
+
+typedef struct timer_wheel {
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SIZE];
+    uint64_t now;                   // Current tick
+    size_t pending;
+    int timer_fd;
+    int armed;
+} timer_wheel_t;
+
+static inline void timer_wheel_arm(timer_wheel_t *tw, int on) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_value.tv_nsec = TIMER_TICK_MS * 1000000L;
+        its.it_interval.tv_nsec = TIMER_TICK_MS * 1000000L;
+    }
+    timerfd_settime(tw->timer_fd, 0, &its, NULL);
+    tw->armed = on;
+}
+
+// Create the wheel's non-blocking timerfd; returns -1 on failure
+static inline int timer_wheel_init(timer_wheel_t *tw) {
+    memset(tw, 0, sizeof(*tw));
+    tw->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    return tw->timer_fd < 0 ? -1 : 0;
+}
+
+// File the timer in the level whose span covers its remaining delay
+static inline void timer_wheel_insert(timer_wheel_t *tw, wheel_timer_t *t) {
+    uint64_t delta = t->expires > tw->now ? t->expires - tw->now : 0;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+        level++;
+
+    // Clamp delays beyond the top level's span; they are re-filed on cascade
+    if (delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS)))
+        t->expires = tw->now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (t->expires < tw->now)
+        t->expires = tw->now;
+
+    wheel_timer_t **slot = &tw->slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    t->next = *slot;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+static inline void timer_unlink(wheel_timer_t *t) {
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static inline int timer_pending(const wheel_timer_t *t) {
+    return t->pprev != NULL;
+}
+
+// Schedule callback(data) to run after delay_ms; re-adding reschedules
+static inline void timer_wheel_add(timer_wheel_t *tw, wheel_timer_t *t, unsigned delay_ms,
+                                   void (*callback)(void *data), void *data) {
+    if (timer_pending(t))
+        timer_unlink(t);
+    else
+        tw->pending++;
+
+    t->wheel = tw;
+    t->callback = callback;
+    t->data = data;
+    t->expires = tw->now + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer_wheel_insert(tw, t);
+
+    if (!tw->armed)
+        timer_wheel_arm(tw, 1);
+}
+
+// Cancel a pending timer; a no-op if it already fired or was never added
+static inline void timer_cancel(wheel_timer_t *t) {
+    if (!timer_pending(t))
+        return;
+
+    timer_unlink(t);
+    t->wheel->pending--;
+}
+
+// Move every timer of one higher-level slot down to where it now belongs
+static inline void timer_wheel_cascade(timer_wheel_t *tw, int level) {
+    wheel_timer_t **slot = &tw->slots[level][(tw->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    wheel_timer_t *t = *slot;
+
+    *slot = NULL;
+    while (t) {
+        wheel_timer_t *next = t->next;
+        timer_wheel_insert(tw, t);
+        t = next;
+    }
+}
+
+// Advance the wheel by a number of ticks, running every timer that expires
+static inline void timer_wheel_advance(timer_wheel_t *tw, uint64_t ticks) {
+    while (ticks-- > 0 && tw->pending > 0) {
+        int index = tw->now & WHEEL_MASK;
+
+        if (index == 0) {
+            for (int level = 1; level < WHEEL_LEVELS; level++) {
+                timer_wheel_cascade(tw, level);
+                if (((tw->now >> (WHEEL_BITS * level)) & WHEEL_MASK) != 0)
+                    break;
+            }
+        }
+
+        // Pop one at a time: callbacks may add timers to this very slot
+        wheel_timer_t **slot = &tw->slots[0][index];
+        while (*slot) {
+            wheel_timer_t *t = *slot;
+            timer_unlink(t);
+            tw->pending--;
+            t->callback(t->data);
+        }
+
+        tw->now++;
+    }
+
+    if (tw->pending == 0 && tw->armed)
+        timer_wheel_arm(tw, 0);
+}
+
+// Consume the timerfd expirations and run the timers that came due
+static inline void timer_wheel_expire(timer_wheel_t *tw) {
+    uint64_t ticks;
+
+    if (read(tw->timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+        timer_wheel_advance(tw, ticks);
+}
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Request lifecycle tracing. With --trace=PATH every request carries
+// monotonic time stamps for the points it passes (TRACE_POINTS), from the
+// accept to its last byte written. Engines stamp the points they have:
+// only the pool and thread-per-conn engines queue clients (the pool from
+// the moment it queues them), and a request after the first on a
+// persistent connection starts at its first byte.
+//
+// A finished trace is timed into the per-stage histograms of /metrics
+// (http_request_stage_seconds) and pushed onto a bounded lock-free ring.
+// Any thread may push; a writer thread drains the ring every
+// TRACE_FLUSH_MS and appends the traces to PATH as Chrome trace events,
+// which chrome://tracing and Perfetto load as they are. Each request is a
+// span named after its route, with its stages nested inside, on a track
+// per client socket. When the ring is full a trace is dropped and counted,
+// never waited for; the writer reports the drops.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+
+#define TRACE_RING_SIZE 4096        // Default traces in flight, a power of two
+#define TRACE_BATCH_SIZE 65536      // Bytes per write() from the writer
+#define TRACE_EVENT_MAX 256         // Longest event line
+#define TRACE_FLUSH_MS 100
+
+#define TRACE_OPTSTRING "x:z:"
+#define TRACE_OPTIONS                                           \
+    { "trace",      required_argument, NULL, 'x' },             \
+    { "trace-ring", required_argument, NULL, 'z' }
+#define TRACE_USAGE                                                             \
+    "  --trace=PATH      trace every request's stages into PATH as Chrome\n"    \
+    "                    trace-event JSON, and time them in /metrics\n"         \
+    "  --trace-ring=N    traces buffered for the writer, rounded up to a\n"     \
+    "                    power of two (default 4096)\n"
+
+// The points a request passes, in order. Stage s (metrics_stage_t) ends at
+// point s + 1 and starts at the last point before it that was stamped.
+typedef enum {
+    TRACE_ACCEPT,
+    TRACE_ENQUEUE,
+    TRACE_DEQUEUE,
+    TRACE_FIRST_BYTE,
+    TRACE_PARSED,
+    TRACE_HANDLER_START,
+    TRACE_HANDLER_END,
+    TRACE_LAST_BYTE,
+    TRACE_POINTS
+} trace_point_t;
+
+typedef struct {
+    uint64_t at[TRACE_POINTS];      // metrics_now_us() time, 0 where not passed
+    int fd;
+    metrics_route_t route;
+    int status;
+} trace_t;
+
+// A ring slot; seq is its index in the ring plus one once the trace in it
+// is complete
+typedef struct {
+    uint64_t seq;
+    trace_t trace;
+} trace_slot_t;
+
+static struct {
+    const char *path;               // NULL when tracing is off
+    uint64_t size;
+    int fd;
+    trace_slot_t *slots;
+    uint64_t head __attribute__((aligned(CACHE_LINE)));    // Claimed by pushers
+    uint64_t dropped;
+    uint64_t tail __attribute__((aligned(CACHE_LINE)));    // Drained by the writer
+    uint64_t reported_drops;
+    uint64_t written;               // Events in the file so far
+    char batch[TRACE_BATCH_SIZE];
+    size_t batch_len;
+} trace_config = {
+    .size = TRACE_RING_SIZE,
+    .fd = -1,
+};
+
+// Handle one of TRACE_OPTIONS. Returns 1 if c was one of them, 0 if it is
+// the caller's.
+static inline int trace_option(int c, const char *arg) {
+    switch (c) {
+    case 'x':
+        trace_config.path = arg;
+        return 1;
+    case 'z':
+        trace_config.size = strtoull(arg, NULL, 10);
+        return 1;
+    }
+    return 0;
+}
+
+static inline int trace_enabled(void) {
+    return trace_config.path != NULL;
+}
+
+// Start a trace for a request on fd, at the accept if stamp_accept is set
+static inline void trace_begin(trace_t *trace, int fd, int stamp_accept) {
+    memset(trace, 0, sizeof(*trace));
+    trace->fd = fd;
+    if (stamp_accept && trace_enabled())
+        trace->at[TRACE_ACCEPT] = metrics_now_us();
+}
+
+static inline void trace_mark(trace_t *trace, trace_point_t point) {
+    if (trace_enabled())
+        trace->at[point] = metrics_now_us();
+}
+
+// Stamp a point the first time it is passed, for points an engine may
+// pass more than once per request
+static inline void trace_mark_once(trace_t *trace, trace_point_t point) {
+    if (trace_enabled() && trace->at[point] == 0)
+        trace->at[point] = metrics_now_us();
+}
+
+// Stamp a point passed at us rather than now
+static inline void trace_mark_at(trace_t *trace, trace_point_t point, uint64_t us) {
+    if (trace_enabled())
+        trace->at[point] = us;
+}
+
+// Queue a finished trace for the writer, or drop it if the ring is full
+static inline void trace_push(const trace_t *trace) {
+    uint64_t head = __atomic_load_n(&trace_config.head, __ATOMIC_RELAXED);
+    trace_slot_t *slot;
+
+    do {
+        if (head - __atomic_load_n(&trace_config.tail, __ATOMIC_ACQUIRE) >= trace_config.size) {
+            __atomic_fetch_add(&trace_config.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&trace_config.head, &head, head + 1, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    slot = &trace_config.slots[head & (trace_config.size - 1)];
+    slot->trace = *trace;
+    __atomic_store_n(&slot->seq, head + 1, __ATOMIC_RELEASE);
+}
+
+// The response is out: stamp the last byte, time the stages and queue the
+// trace. The trace is then reset for the next request on the connection.
+static inline void trace_end(trace_t *trace, metrics_route_t route, int status) {
+    uint64_t start = 0;
+
+    if (!trace_enabled())
+        return;
+
+    trace->at[TRACE_LAST_BYTE] = metrics_now_us();
+    trace->route = route;
+    trace->status = status;
+    for (int p = 0; p < TRACE_POINTS; p++) {
+        if (trace->at[p] == 0)
+            continue;
+        if (start != 0 && p > 0)
+            metrics_stage((metrics_stage_t)(p - 1), trace->at[p] - start);
+        start = trace->at[p];
+    }
+
+    trace_push(trace);
+    trace_begin(trace, trace->fd, 0);
+}
+
+static inline void trace_batch_write(void) {
+    size_t done = 0;
+
+    while (done < trace_config.batch_len) {
+        ssize_t n = write(trace_config.fd, trace_config.batch + done,
+                          trace_config.batch_len - done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            log_error("Failed to write trace: %s", n < 0 ? strerror(errno) : "short write");
+            break;
+        }
+        done += n;
+    }
+    trace_config.batch_len = 0;
+}
+
+// Append one complete event ("X") to the batch. The file is a JSON array
+// left open at the end, which the trace format allows.
+__attribute__((format(printf, 1, 2)))
+static inline void trace_event(const char *fmt, ...) {
+    char line[TRACE_EVENT_MAX];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= (int)sizeof(line))
+        return;
+
+    if (trace_config.batch_len + n + 2 > sizeof(trace_config.batch))
+        trace_batch_write();
+    if (trace_config.written++ > 0)
+        trace_config.batch[trace_config.batch_len++] = ',';
+    memcpy(trace_config.batch + trace_config.batch_len, line, n);
+    trace_config.batch_len += n;
+    trace_config.batch[trace_config.batch_len++] = '\n';
+}
+
+// A request and its stages as events on the track of its socket
+static inline void trace_render(const trace_t *trace, int pid) {
+    uint64_t first = 0, start = 0;
+
+    for (int p = 0; p < TRACE_POINTS && first == 0; p++)
+        first = trace->at[p];
+    trace_event("{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"status\":%d}}",
+                metrics_route_names[trace->route], (unsigned long)first,
+                (unsigned long)(trace->at[TRACE_LAST_BYTE] - first), pid, trace->fd,
+                trace->status);
+
+    for (int p = 0; p < TRACE_POINTS; p++) {
+        if (trace->at[p] == 0)
+            continue;
+        if (start != 0 && p > 0)
+            trace_event("{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,"
+                        "\"pid\":%d,\"tid\":%d}",
+                        metrics_stage_names[p - 1], (unsigned long)start,
+                        (unsigned long)(trace->at[p] - start), pid, trace->fd);
+        start = trace->at[p];
+    }
+}
+
+// Write out every complete trace in the ring, oldest first
+static inline void trace_flush(void) {
+    uint64_t tail = trace_config.tail;
+    uint64_t dropped;
+    int pid = getpid();
+
+    while (1) {
+        trace_slot_t *slot = &trace_config.slots[tail & (trace_config.size - 1)];
+
+        // Claimed but still being copied in: the rest waits for next time
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1)
+            break;
+        trace_render(&slot->trace, pid);
+        __atomic_store_n(&trace_config.tail, ++tail, __ATOMIC_RELEASE);
+    }
+
+    dropped = __atomic_load_n(&trace_config.dropped, __ATOMIC_RELAXED);
+    if (dropped > trace_config.reported_drops) {
+        log_warn("trace: %lu requests dropped", (unsigned long)(dropped - trace_config.reported_drops));
+        trace_config.reported_drops = dropped;
+    }
+
+    trace_batch_write();
+}
+
+static inline void *trace_writer_thread(void *arg) {
+    struct timespec interval = { 0, TRACE_FLUSH_MS * 1000000L };
+    (void)arg;
+
+    while (1) {
+        nanosleep(&interval, NULL);
+        trace_flush();
+    }
+
+    return NULL;
+}
+
+// Open the trace file and start the writer, if tracing is on. Called once
+// from main() before the engine starts.
+static inline int trace_start(void) {
+    pthread_t thread;
+
+    if (!trace_enabled())
+        return 0;
+
+    if (trace_config.size < 2)
+        trace_config.size = 2;
+    while (trace_config.size & (trace_config.size - 1))
+        trace_config.size += trace_config.size & -trace_config.size;
+    trace_config.slots = calloc(trace_config.size, sizeof(trace_slot_t));
+    if (trace_config.slots == NULL)
+        return -1;
+
+    trace_config.fd = open(trace_config.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_config.fd < 0)
+        return -1;
+    trace_config.batch[trace_config.batch_len++] = '[';
+    trace_config.batch[trace_config.batch_len++] = '\n';
+
+    if (pthread_create(&thread, NULL, trace_writer_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+#endif